@@ -0,0 +1,152 @@
+#include "include.h"
+#include "connection.h"
+#include "client.h"
+#include "server.h"
+
+// Compares the socket option presets over loopback. For each preset a server and a client in this process both use it:
+// pings go back and forth one at a time for the round trip times, then the client streams bulk messages for the
+// throughput. Run without arguments for all presets, or name the ones to run: default, latency, throughput.
+// Loopback has no real network delay, so only differences the host's stack makes show up here.
+
+enum class eBenchMsg : uint16_t
+{
+	ping,
+	bulk
+};
+
+// Answers pings and counts bulk bytes right on the I/O thread, so Update() does not add to the times.
+class bench_server : public net::server_interface<eBenchMsg>
+{
+public:
+	bench_server(uint16_t port) : net::server_interface<eBenchMsg>(port)
+	{
+		SetInlineDispatch(true);
+	}
+
+	std::atomic<uint64_t> m_nBulkBytes = 0;
+
+protected:
+	bool OnClientConnect(std::shared_ptr<net::connection<eBenchMsg>> /*client*/) override
+	{
+		return true;
+	}
+
+	bool OnMessageInline(std::shared_ptr<net::connection<eBenchMsg>> client, net::sMessage<eBenchMsg>& message) override
+	{
+		if (message.header.id == eBenchMsg::ping)
+			client->Send(message);
+		else
+			m_nBulkBytes += message.body.size();
+		return true;
+	}
+};
+
+class bench_client : public net::client_interface<eBenchMsg>
+{
+public:
+	net::connection<eBenchMsg>& Connection()
+	{
+		return *m_connection;
+	}
+};
+
+struct sPreset
+{
+	const char* szName;
+	net::sSocketOptions options;
+};
+
+struct sResult
+{
+	double dP50 = 0.0;
+	double dP99 = 0.0;
+	double dMegabytesPerSecond = 0.0;
+};
+
+constexpr size_t nPings = 5000;
+constexpr size_t nBulkMessages = 20000;
+constexpr size_t nBulkBytes = 32 * 1024;
+// Bulk messages the client is at most ahead of the server, so the queues do not grow without end.
+constexpr size_t nBulkAhead = 64;
+
+sResult Run(const sPreset& preset, uint16_t nPort)
+{
+	sResult result;
+
+	bench_server server(nPort);
+	server.SetSocketOptions(preset.options);
+	if (!server.Start())
+		return result;
+
+	bench_client client;
+	client.SetSocketOptions(preset.options);
+	if (!client.Connect("127.0.0.1", nPort))
+		return result;
+	while (!client.IsConnected())
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	// Round trips, one ping at a time.
+	std::vector<double> vecMicroseconds;
+	vecMicroseconds.reserve(nPings);
+	net::sMessage<eBenchMsg> ping;
+	ping.header.id = eBenchMsg::ping;
+	ping << uint64_t(0);
+	for (size_t i = 0; i < nPings; i++)
+	{
+		auto tStart = std::chrono::steady_clock::now();
+		client.Connection().Send(ping);
+		while (client.Incoming().empty())
+			std::this_thread::yield();
+		client.Incoming().pop_front();
+		vecMicroseconds.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - tStart).count());
+	}
+	std::sort(vecMicroseconds.begin(), vecMicroseconds.end());
+	result.dP50 = vecMicroseconds[nPings / 2];
+	result.dP99 = vecMicroseconds[nPings * 99 / 100];
+
+	// Bulk, the client keeps up to nBulkAhead messages on their way.
+	net::sMessage<eBenchMsg> bulk;
+	bulk.header.id = eBenchMsg::bulk;
+	bulk.body.resize(nBulkBytes);
+	bulk.header.size = net::SizeField(bulk.body.size());
+	auto pBulk = std::make_shared<const net::sMessage<eBenchMsg>>(bulk);
+
+	auto tStart = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < nBulkMessages; i++)
+	{
+		while (i * nBulkBytes - server.m_nBulkBytes > nBulkAhead * nBulkBytes)
+			std::this_thread::yield();
+		client.Connection().Send(pBulk, net::ePriority::bulk);
+	}
+	while (server.m_nBulkBytes < nBulkMessages * nBulkBytes)
+		std::this_thread::yield();
+	double dSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+	result.dMegabytesPerSecond = nBulkMessages * nBulkBytes / dSeconds / 1e6;
+
+	client.Disconnect();
+	return result;
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> vecNames(argv + 1, argv + argc);
+	std::vector<sPreset> vecPresets = {
+		{ "default", net::sSocketOptions{} },
+		{ "latency", net::sSocketOptions::Latency() },
+		{ "throughput", net::sSocketOptions::Throughput() },
+	};
+
+	std::vector<std::pair<const char*, sResult>> vecResults;
+	uint16_t nPort = 60500;
+	for (const auto& preset : vecPresets)
+	{
+		if (!vecNames.empty() && std::find(vecNames.begin(), vecNames.end(), preset.szName) == vecNames.end())
+			continue;
+		vecResults.emplace_back(preset.szName, Run(preset, nPort++));
+	}
+
+	std::printf("%-12s %12s %12s %12s\n", "preset", "rtt p50 us", "rtt p99 us", "bulk MB/s");
+	for (const auto& [szName, result] : vecResults)
+		std::printf("%-12s %12.1f %12.1f %12.0f\n", szName, result.dP50, result.dP99, result.dMegabytesPerSecond);
+	return 0;
+}
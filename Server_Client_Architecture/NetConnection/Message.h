@@ -7,21 +7,102 @@ namespace net
 	template <typename T>
 	class connection;
 
+	// Priority lanes of a connection's outgoing queue. Lower lanes are always drained first.
+	enum class ePriority : uint8_t
+	{
+		control,
+		high,
+		normal,
+		bulk,
+		count
+	};
+
+	// Bits of the flags field in a message header.
+	namespace frame
+	{
+		// More fragments of this message follow on the same lane.
+		constexpr uint16_t more = 0x0001;
+		// Lane the frame was sent on, so fragments interleaved with other lanes can be put back together.
+		constexpr uint16_t laneMask = 0x0006;
+		constexpr uint16_t laneShift = 1;
+		// The frame belongs to the framework itself and carries an eControl operation instead of a user message.
+		constexpr uint16_t control = 0x0008;
+		// The body went through the compression codec negotiated for the connection.
+		constexpr uint16_t compressed = 0x0010;
+		// A request the sender waits a response for, and the response to it. Both carry the correlation id.
+		constexpr uint16_t request = 0x0020;
+		constexpr uint16_t response = 0x0040;
+		// The message was charged to the window the receiver advertised, so it is handed back once handled.
+		constexpr uint16_t windowed = 0x0080;
+		// State of the snapshot stream in the correlation field, see connection::SendSnapshot(). The body is the state
+		// or a delta of it, followed by the base sequence and the sequence.
+		constexpr uint16_t snapshot = 0x0100;
+	}
+
+	// Operations of control frames. The operation is the last byte of the body, so it is popped first.
+	enum class eControl : uint8_t
+	{
+		// codec, dictionary hash
+		compressionOffer,
+		// codec
+		compressionAccept,
+		compressionDecline,
+		// Last frame before the sender closes the connection on purpose.
+		goodbye,
+		// token, messages received, oldest message still buffered for replay
+		sessionRequest,
+		// resumed, messages received, token
+		sessionAccept,
+		// messages received
+		ack,
+		// sequence, 0 if the peer has to send the next snapshot in full. The stream is in the correlation field.
+		snapshotAck,
+		// batch of routed messages between the servers of a cluster
+		cluster,
+		// Streams carried by the connection, see connection::OpenStream().
+		// stream
+		streamOpen,
+		// stream, bytes the sender of the window update handled on the stream since the last one
+		streamWindow,
+		// stream
+		streamClose,
+		// body bytes, messages the receiver handled since the last update, or its first window
+		window,
+		// milliseconds, lane. The sender is overloaded, messages from the lane down should wait that long.
+		backOff
+	};
+
 	// Templated header for a typical message. Will need to be passed in a tape of the message
-	// Contains the ID and size in bytes
+	// Contains the ID, size of the body in bytes and the frame flags
 	template <typename T>
 	struct sMessageHeader
 	{
 		T id;
+		// Body bytes of the frame. For a whole message the size of its body, or 0 if it is too big for the field,
+		// see SizeField(). body.size() is always right.
 		uint16_t size = 0;
+		uint16_t flags = 0;
+		// Matches a response to its request, 0 for all other messages.
+		uint32_t correlation = 0;
+		// Logical stream the frame belongs to, 0 for the connection itself. See connection::OpenStream().
+		uint32_t stream = 0;
 	};
 
+	// What the size field of a header says for a body of nBody bytes. Bodies too big for it say 0 rather than a wrong size.
+	inline uint16_t SizeField(size_t nBody)
+	{
+		return nBody <= std::numeric_limits<uint16_t>::max() ? static_cast<uint16_t>(nBody) : 0;
+	}
+
 	// Templated message comprised of a Message header and a body
 	template <typename T>
 	struct sMessage
 	{
 		sMessageHeader<T> header{};
 		std::vector<uint8_t> body;
+		// Past it the message is dropped instead of being written or handled. It stays on this end, only the header
+		// and the body are sent. No deadline by default, see connection::SetExpiry().
+		std::chrono::steady_clock::time_point deadline{};
 
 		// returns size of a message including header and body.
 		size_t size() const
@@ -29,6 +110,12 @@ namespace net
 			return sizeof(sMessageHeader<T>) + body.size();
 		}
 
+		// Whether the message has a deadline and it passed.
+		bool Expired(std::chrono::steady_clock::time_point tNow) const
+		{
+			return deadline != std::chrono::steady_clock::time_point{} && tNow > deadline;
+		}
+
 		// Overloaded operator used to put Trivial data types into the message buffer
 		template <typename DataType>
 		friend sMessage<T>& operator <<(sMessage<T>& msg, const DataType& data)
@@ -39,14 +126,14 @@ namespace net
 
 			std::memcpy(msg.body.data() + i, &data, sizeof(DataType));
 
-			msg.header.size = msg.size();
+			msg.header.size = SizeField(msg.body.size());
 
 			return msg;
 		}
 
 		// Overloaded operator used to retrieve trivial data types form the message buffer
 		template <typename DataType>
-		friend sMessage<T>& operator >> (sMessage<T>& msg, const DataType& data)
+		friend sMessage<T>& operator >> (sMessage<T>& msg, DataType& data)
 		{
 			size_t i = msg.body.size();
 
@@ -54,7 +141,7 @@ namespace net
 
 			msg.body.resize(i - sizeof(DataType));
 
-			msg.header.size() = msg.size();
+			msg.header.size = SizeField(msg.body.size());
 
 			return msg;
 		}
@@ -67,5 +154,11 @@ namespace net
 	{
 		std::shared_ptr<connection<T>> remote = nullptr;
 		sMessage<T> message;
+		// Bytes charged to the in-flight budget of the connection it came on.
+		size_t nBudget = 0;
+		// Handed back to the remote's receive window once handled, see connection::SetReceiveWindow().
+		bool bWindowed = false;
+		// When the connection put it in the incoming queue.
+		std::chrono::steady_clock::time_point tQueued{};
 	};
 }
@@ -0,0 +1,70 @@
+#pragma once
+#include "include.h"
+
+namespace net
+{
+	// Tells from how long messages waited in a queue whether it is overloaded, the way CoDel does. A burst drains
+	// again, so messages waiting over the target now and then are no problem. But once none got through under the
+	// target for a whole interval, the queue stands and more work comes in than is handled. It is overloaded then,
+	// until a message gets through under the target again or the queue runs empty.
+	class admission_control
+	{
+	public:
+		admission_control(std::chrono::steady_clock::duration target, std::chrono::steady_clock::duration interval)
+			: m_target(target), m_interval(interval)
+		{
+		}
+
+		// A message was taken off the queue after waiting for the given time. Returns whether the queue is overloaded.
+		// Called by the thread draining the queue only.
+		bool Dequeued(std::chrono::steady_clock::duration waited, std::chrono::steady_clock::time_point tNow)
+		{
+			m_nDelay = waited.count();
+			if (waited < m_target)
+			{
+				m_tAboveUntil = {};
+				m_bOverloaded = false;
+			}
+			else if (m_tAboveUntil == std::chrono::steady_clock::time_point{})
+			{
+				m_tAboveUntil = tNow + m_interval;
+			}
+			else if (tNow >= m_tAboveUntil)
+			{
+				m_bOverloaded = true;
+			}
+			return m_bOverloaded;
+		}
+
+		// The queue ran empty, whatever stood in it is gone.
+		void Drained()
+		{
+			m_tAboveUntil = {};
+			m_bOverloaded = false;
+		}
+
+		bool IsOverloaded() const
+		{
+			return m_bOverloaded;
+		}
+
+		// How long the last message waited.
+		std::chrono::steady_clock::duration Delay() const
+		{
+			return std::chrono::steady_clock::duration(m_nDelay);
+		}
+
+		std::chrono::steady_clock::duration Interval() const
+		{
+			return m_interval;
+		}
+
+	private:
+		const std::chrono::steady_clock::duration m_target;
+		const std::chrono::steady_clock::duration m_interval;
+		// Until when messages have to keep waiting over the target for the queue to count as overloaded.
+		std::chrono::steady_clock::time_point m_tAboveUntil{};
+		std::atomic<bool> m_bOverloaded = false;
+		std::atomic<std::chrono::steady_clock::duration::rep> m_nDelay = 0;
+	};
+}
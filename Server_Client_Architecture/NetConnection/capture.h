@@ -0,0 +1,359 @@
+#pragma once
+#include "include.h"
+#include "tsQueue.h"
+#include "Message.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace net
+{
+	// Which way a captured message went, seen from the server that captured it.
+	enum class eCaptureDirection : uint8_t
+	{
+		in,
+		out
+	};
+
+	// Traffic capture, see server_interface::StartCapture(). A capture file starts with a file header, followed by
+	// one record per message: the record header, the message header and the body, padded to 8 bytes.
+	// A record size of 0 marks the end, the rest of the file is unused.
+	namespace capture
+	{
+		constexpr uint32_t nMagic = 0x5041434E;
+
+		struct sFileHeader
+		{
+			uint32_t nMagic;
+			// Size of the message headers in the file, captures are only read back with the same message id type.
+			uint32_t nMessageHeaderSize;
+		};
+
+		struct sRecord
+		{
+			uint32_t nSize;
+			uint32_t nConnection;
+			// Nanoseconds since the capture started.
+			uint64_t nTime;
+			eCaptureDirection direction;
+			uint8_t padding[3];
+			uint32_t nBodySize;
+		};
+
+		inline size_t RecordSize(size_t nMessageHeaderSize, size_t nBodySize)
+		{
+			return (sizeof(sRecord) + nMessageHeaderSize + nBodySize + 7) & ~size_t(7);
+		}
+
+		// A file mapped into memory, for writing a fixed size or for reading all of it.
+		class mapped_file
+		{
+		public:
+			~mapped_file()
+			{
+				Close(0);
+			}
+
+			// Opens a new file of nSize bytes for writing, or an existing one for reading if nSize is 0.
+			bool Open(const std::string& sPath, size_t nSize)
+			{
+				bool bWrite = nSize > 0;
+#if defined(_WIN32)
+				m_hFile = ::CreateFileA(sPath.c_str(), bWrite ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+					FILE_SHARE_READ, nullptr, bWrite ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+				if (m_hFile == INVALID_HANDLE_VALUE)
+					return false;
+
+				if (!bWrite)
+				{
+					LARGE_INTEGER nFileSize;
+					if (!::GetFileSizeEx(m_hFile, &nFileSize) || nFileSize.QuadPart == 0)
+						return false;
+					nSize = static_cast<size_t>(nFileSize.QuadPart);
+				}
+
+				m_hMapping = ::CreateFileMappingA(m_hFile, nullptr, bWrite ? PAGE_READWRITE : PAGE_READONLY,
+					static_cast<DWORD>(uint64_t(nSize) >> 32), static_cast<DWORD>(nSize), nullptr);
+				if (!m_hMapping)
+					return false;
+
+				m_pData = static_cast<uint8_t*>(::MapViewOfFile(m_hMapping, bWrite ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, nSize));
+				if (!m_pData)
+					return false;
+#else
+				m_nFile = ::open(sPath.c_str(), bWrite ? O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+				if (m_nFile < 0)
+					return false;
+
+				if (bWrite)
+				{
+					if (::ftruncate(m_nFile, static_cast<off_t>(nSize)) != 0)
+						return false;
+				}
+				else
+				{
+					struct stat status;
+					if (::fstat(m_nFile, &status) != 0 || status.st_size == 0)
+						return false;
+					nSize = static_cast<size_t>(status.st_size);
+				}
+
+				void* pData = ::mmap(nullptr, nSize, bWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, m_nFile, 0);
+				if (pData == MAP_FAILED)
+					return false;
+				m_pData = static_cast<uint8_t*>(pData);
+#endif
+				m_nSize = nSize;
+				return true;
+			}
+
+			// Unmaps the file. A file opened for writing is cut down to nKeepSize bytes.
+			void Close(size_t nKeepSize)
+			{
+#if defined(_WIN32)
+				if (m_pData)
+					::UnmapViewOfFile(m_pData);
+				if (m_hMapping)
+					::CloseHandle(m_hMapping);
+				if (m_hFile != INVALID_HANDLE_VALUE)
+				{
+					if (nKeepSize > 0)
+					{
+						LARGE_INTEGER nPosition;
+						nPosition.QuadPart = static_cast<LONGLONG>(nKeepSize);
+						::SetFilePointerEx(m_hFile, nPosition, nullptr, FILE_BEGIN);
+						::SetEndOfFile(m_hFile);
+					}
+					::CloseHandle(m_hFile);
+				}
+				m_hMapping = nullptr;
+				m_hFile = INVALID_HANDLE_VALUE;
+#else
+				if (m_pData)
+					::munmap(m_pData, m_nSize);
+				if (m_nFile >= 0)
+				{
+					if (nKeepSize > 0 && ::ftruncate(m_nFile, static_cast<off_t>(nKeepSize)) != 0)
+						log::Error("Capture truncate fail!");
+					::close(m_nFile);
+				}
+				m_nFile = -1;
+#endif
+				m_pData = nullptr;
+				m_nSize = 0;
+			}
+
+			uint8_t* Data() const
+			{
+				return m_pData;
+			}
+
+			size_t Size() const
+			{
+				return m_nSize;
+			}
+
+		private:
+#if defined(_WIN32)
+			HANDLE m_hFile = INVALID_HANDLE_VALUE;
+			HANDLE m_hMapping = nullptr;
+#else
+			int m_nFile = -1;
+#endif
+			uint8_t* m_pData = nullptr;
+			size_t m_nSize = 0;
+		};
+	}
+
+	// Append only log of the messages a server received and sent. The file is mapped into memory and sized up front,
+	// so recording is a copy into the mapping. Space for a record is reserved with an atomic add, which lets
+	// the I/O threads of all connections record at the same time without a lock. Records that do not fit
+	// anymore are dropped and counted. The file is cut down to what was used when the log goes away.
+	class capture_log
+	{
+	public:
+		~capture_log()
+		{
+			m_file.Close(std::min(m_nUsed.load(), m_file.Size()));
+		}
+
+		template <typename T>
+		bool Open(const std::string& sPath, size_t nMaxBytes)
+		{
+			if (nMaxBytes < sizeof(capture::sFileHeader) || !m_file.Open(sPath, nMaxBytes))
+				return false;
+
+			capture::sFileHeader header{ capture::nMagic, static_cast<uint32_t>(sizeof(sMessageHeader<T>)) };
+			std::memcpy(m_file.Data(), &header, sizeof(header));
+			m_nUsed = sizeof(header);
+			m_tStart = std::chrono::steady_clock::now();
+			return true;
+		}
+
+		// Records a complete message. Runs on the I/O thread of the connection it belongs to.
+		template <typename T>
+		void Record(uint32_t nConnection, eCaptureDirection direction, const sMessage<T>& message)
+		{
+			size_t nSize = capture::RecordSize(sizeof(sMessageHeader<T>), message.body.size());
+			size_t nOffset = m_nUsed.fetch_add(nSize, std::memory_order_relaxed);
+			if (nOffset + nSize > m_file.Size() || nSize > std::numeric_limits<uint32_t>::max())
+			{
+				m_nDropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			capture::sRecord record{};
+			record.nSize = static_cast<uint32_t>(nSize);
+			record.nConnection = nConnection;
+			record.nTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - m_tStart).count());
+			record.direction = direction;
+			record.nBodySize = static_cast<uint32_t>(message.body.size());
+
+			uint8_t* pRecord = m_file.Data() + nOffset;
+			std::memcpy(pRecord + sizeof(record), &message.header, sizeof(sMessageHeader<T>));
+			if (!message.body.empty())
+				std::memcpy(pRecord + sizeof(record) + sizeof(sMessageHeader<T>), message.body.data(), message.body.size());
+			// The size goes in last, a reader stops at a record that was never completed.
+			std::memcpy(pRecord, &record, sizeof(record));
+		}
+
+		// Messages that did not fit into the file anymore.
+		uint64_t Dropped() const
+		{
+			return m_nDropped.load(std::memory_order_relaxed);
+		}
+
+	private:
+		capture::mapped_file m_file;
+		std::atomic<size_t> m_nUsed = 0;
+		std::atomic<uint64_t> m_nDropped = 0;
+		std::chrono::steady_clock::time_point m_tStart;
+	};
+
+	// A message read back from a capture.
+	template <typename T>
+	struct sCapturedMessage
+	{
+		uint64_t nTime = 0;
+		uint32_t nConnection = 0;
+		eCaptureDirection direction = eCaptureDirection::in;
+		sMessage<T> message;
+	};
+
+	// Reads the messages of a capture in the order they were recorded.
+	template <typename T>
+	class capture_reader
+	{
+	public:
+		bool Open(const std::string& sPath)
+		{
+			if (!m_file.Open(sPath, 0) || m_file.Size() < sizeof(capture::sFileHeader))
+				return false;
+
+			capture::sFileHeader header;
+			std::memcpy(&header, m_file.Data(), sizeof(header));
+			m_nOffset = sizeof(header);
+			return header.nMagic == capture::nMagic && header.nMessageHeaderSize == sizeof(sMessageHeader<T>);
+		}
+
+		// Reads the next message. Returns false at the end of the capture, or if the rest of it is malformed.
+		bool Next(sCapturedMessage<T>& captured)
+		{
+			capture::sRecord record;
+			if (m_file.Size() - m_nOffset < sizeof(record))
+				return false;
+			std::memcpy(&record, m_file.Data() + m_nOffset, sizeof(record));
+
+			if (record.nSize == 0 || record.nSize > m_file.Size() - m_nOffset
+				|| record.nSize < capture::RecordSize(sizeof(sMessageHeader<T>), record.nBodySize))
+				return false;
+
+			const uint8_t* pMessage = m_file.Data() + m_nOffset + sizeof(record);
+			captured.nTime = record.nTime;
+			captured.nConnection = record.nConnection;
+			captured.direction = record.direction;
+			std::memcpy(&captured.message.header, pMessage, sizeof(sMessageHeader<T>));
+			captured.message.body.assign(pMessage + sizeof(sMessageHeader<T>), pMessage + sizeof(sMessageHeader<T>) + record.nBodySize);
+
+			m_nOffset += record.nSize;
+			return true;
+		}
+
+	private:
+		capture::mapped_file m_file;
+		size_t m_nOffset = 0;
+	};
+
+	// Drives a server with the messages clients sent in a capture. Each client of the capture gets a connection
+	// of its own, opened when its first message is due. Messages go out at the time they were received,
+	// divided by dSpeed, 0 sends them as fast as possible. What the server sends back is thrown away.
+	// Returns false if the capture cannot be read or the server is not found.
+	template <typename T>
+	bool ReplayCapture(const std::string& sPath, const std::string& host, const uint16_t port, double dSpeed = 1.0)
+	{
+		capture_reader<T> reader;
+		if (!reader.Open(sPath))
+		{
+			log::Error("Cannot read capture ", sPath);
+			return false;
+		}
+
+		asio::io_context context;
+		auto workGuard = asio::make_work_guard(context);
+		TsQueue<sOwnedMessage<T>> qMessagesIn;
+		std::unordered_map<uint32_t, std::unique_ptr<connection<T>>> mapConnections;
+
+		asio::ip::tcp::resolver::results_type endpoints;
+		try
+		{
+			asio::ip::tcp::resolver resolver(context);
+			endpoints = resolver.resolve(host, std::to_string(port));
+		}
+		catch (std::exception& e)
+		{
+			log::Error("Replay exception: ", e.what());
+			return false;
+		}
+
+		std::thread thrContext([&context]() { context.run(); });
+
+		auto tStart = std::chrono::steady_clock::now();
+		sCapturedMessage<T> captured;
+		while (reader.Next(captured))
+		{
+			if (captured.direction != eCaptureDirection::in)
+				continue;
+
+			if (dSpeed > 0.0)
+			{
+				std::this_thread::sleep_until(tStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<double, std::nano>(captured.nTime / dSpeed)));
+			}
+
+			auto& pConnection = mapConnections[captured.nConnection];
+			if (!pConnection)
+			{
+				pConnection = std::make_unique<connection<T>>(connection<T>::owner::client, context,
+					asio::ip::tcp::socket(asio::make_strand(context)), qMessagesIn);
+				pConnection->ConnectToServer(endpoints);
+			}
+			pConnection->Send(captured.message);
+
+			qMessagesIn.clear();
+		}
+
+		// Everything queued is written before the connections close.
+		for (auto& [nConnection, pConnection] : mapConnections)
+			pConnection->DisconnectGracefully();
+		workGuard.reset();
+		thrContext.join();
+		return true;
+	}
+}
@@ -5,6 +5,73 @@
 
 namespace net
 {
+	// The incoming queue of a client. A message taken off it counts as handled, and goes back to the receive window
+	// of the connection it came on, see client_interface::SetReceiveWindow(). Clearing the queue hands back all of them.
+	template <typename T>
+	class incoming_queue : public TsQueue<sOwnedMessage<T>>
+	{
+	public:
+		sOwnedMessage<T> pop_front()
+		{
+			sOwnedMessage<T> msg;
+			std::shared_ptr<connection<T>> pConnection;
+			{
+				std::scoped_lock lock(this->myMutex);
+				msg = std::move(this->myDeque.front());
+				this->myDeque.pop_front();
+				pConnection = m_pConnection.lock();
+			}
+			Handled(msg, pConnection);
+			return msg;
+		}
+
+		sOwnedMessage<T> pop_back()
+		{
+			sOwnedMessage<T> msg;
+			std::shared_ptr<connection<T>> pConnection;
+			{
+				std::scoped_lock lock(this->myMutex);
+				msg = std::move(this->myDeque.back());
+				this->myDeque.pop_back();
+				pConnection = m_pConnection.lock();
+			}
+			Handled(msg, pConnection);
+			return msg;
+		}
+
+		void clear()
+		{
+			std::deque<sOwnedMessage<T>> deqCleared;
+			std::shared_ptr<connection<T>> pConnection;
+			{
+				std::scoped_lock lock(this->myMutex);
+				deqCleared.swap(this->myDeque);
+				pConnection = m_pConnection.lock();
+			}
+			for (const auto& msg : deqCleared)
+				Handled(msg, pConnection);
+		}
+
+		// Messages queued from now on came on pConnection. Those still queued from a connection before are not
+		// handed back to it.
+		void Attach(const std::shared_ptr<connection<T>>& pConnection)
+		{
+			std::scoped_lock lock(this->myMutex);
+			for (auto& msg : this->myDeque)
+				msg.bWindowed = false;
+			m_pConnection = pConnection;
+		}
+
+	private:
+		static void Handled(const sOwnedMessage<T>& msg, const std::shared_ptr<connection<T>>& pConnection)
+		{
+			if (msg.bWindowed && pConnection)
+				pConnection->ReleaseInFlight(msg.nBudget, true);
+		}
+
+		std::weak_ptr<connection<T>> m_pConnection;
+	};
+
 	// A client interface implementation that owns one connection object, its own socket,
 	// a thread to read messages continuously and a thread safe queue of incoming ownedMessages.
 	// This class only takes care of connecting / disconnecting the client to / from a server
@@ -12,38 +79,59 @@ namespace net
 	template <typename T>
 	class client_interface
 	{
+	public:
 		client_interface() : m_socket(m_context)
 		{
 		}
 
-		~client_interface()
+		virtual ~client_interface()
 		{
 			Disconnect();
 		}
 
-	public:
 		bool Connect(const std::string& host, const uint16_t port)
 		{
+			// Connecting again, the previous connection is closed and its handlers run to the end before it goes.
+			if (m_connection)
+			{
+				m_connection->Disconnect();
+				if (thrContext.joinable())
+					thrContext.join();
+				m_context.restart();
+				m_context.run();
+			}
+			m_context.restart();
+
 			try
 			{
 				// Create the connection.
-				m_connection = std::make_unique<connection<T>>(
+				m_connection = std::make_shared<connection<T>>(
 					connection<T>::owner::client,
 					m_context,
-					asio::ip::tcp::socket(m_context), m_qMessagesIn);
+					asio::ip::tcp::socket(asio::make_strand(m_context)), m_qMessagesIn);
+
+				if (m_pSession)
+					m_connection->UseSession(m_pSession, m_fnSessionHandler);
+				m_connection->UseSocketOptions(m_socketOptions);
+				if (m_nMaxSnapshotStreams > 0)
+					m_connection->AcceptSnapshots(m_nMaxSnapshotStreams);
+				m_qMessagesIn.Attach(m_connection);
 
 				// resolve the address passed in.
 				asio::ip::tcp::resolver resolver(m_context);
 				asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 				// connect to server
 				m_connection->ConnectToServer(endpoints);
+				// The window is granted once the socket is open.
+				if (m_nWindowBytes > 0)
+					m_connection->SetReceiveWindow(m_nWindowBytes, m_nWindowMessages);
 
 				// Create the thread that will continuosly execute operations on the stack.
 				thrContext = std::thread([this]() { m_context.run(); });
 			}
 			catch (std::exception& e)
 			{
-				std::cerr << "Client exception: " << e.what() << "\n";
+				log::Error("Client exception: ", e.what());
 				return false;
 			}
 			return true;
@@ -64,6 +152,54 @@ namespace net
 				thrContext.join();
 		}
 
+		// Keeps a session across connections. When Connect() is called again after the connection dropped,
+		// the session is resumed and only the messages missed on either side are sent again. The handler is told
+		// on every connect if that worked, if not the session starts over and the application has to resync.
+		// The server must have sessions enabled as well. Call before Connect().
+		void EnableSession(size_t nMaxReplayBytes, std::function<void(bool bResumed)> fnHandler = nullptr)
+		{
+			m_pSession = std::make_shared<session_state<T>>(0, nMaxReplayBytes);
+			m_fnSessionHandler = std::move(fnHandler);
+		}
+
+		// Sets the options of the socket, applied once it connected. See sSocketOptions::Latency() and Throughput()
+		// for presets. Call before Connect().
+		void SetSocketOptions(const sSocketOptions& options)
+		{
+			m_socketOptions = options;
+		}
+
+		// Takes snapshots from the server on up to nMaxStreams streams, see connection::AcceptSnapshots(). Without it
+		// a snapshot from the server closes the connection. Call before Connect().
+		void AcceptSnapshots(size_t nMaxStreams)
+		{
+			m_nMaxSnapshotStreams = nMaxStreams;
+		}
+
+		// Lets the server send at most nBytes and nMessages ahead of what was taken off Incoming(), see
+		// connection::SetReceiveWindow(). The rest waits on the server's end, so the incoming queue stays bounded however
+		// far the application falls behind. Call before Connect().
+		void SetReceiveWindow(size_t nBytes, uint32_t nMessages = std::numeric_limits<uint32_t>::max())
+		{
+			if (nMessages == 0)
+			{
+				log::Error("Client - Receive window of 0 messages turned down");
+				return;
+			}
+			m_nWindowBytes = nBytes;
+			m_nWindowMessages = nMessages;
+		}
+
+		// Opens a stream on the connection to the server, see connection::OpenStream(). Its messages come in with the stream
+		// as their remote. The server must AcceptStreams().
+		std::shared_ptr<connection<T>> OpenStream()
+		{
+			if (m_connection)
+				return m_connection->OpenStream();
+			else
+				return nullptr;
+		}
+
 		bool IsConnected()
 		{
 			if (m_connection)
@@ -72,8 +208,17 @@ namespace net
 				return false;
 		}
 
+#if defined(ASIO_HAS_CO_AWAIT)
+		// Runs a coroutine on the connection's strand. After m_connection->UseReceive() it can
+		// talk to the server with AsyncReceive() and AsyncSend().
+		void Spawn(asio::awaitable<void> session)
+		{
+			m_connection->Spawn(std::move(session));
+		}
+#endif
+
 		// returns the thread safe queue of incoming messages.
-		TsQueue<sOwnedMessage<T>>& Incoming()
+		incoming_queue<T>& Incoming()
 		{
 			return m_qMessagesIn;
 		}
@@ -87,10 +232,20 @@ namespace net
 		// It gets passed to connection object via constructor
 		asio::ip::tcp::socket m_socket;
 		// the client has a single instance of a connection object (this class), which handles the data transfer
-		std::unique_ptr<connection<T>> m_connection;
+		std::shared_ptr<connection<T>> m_connection;
+		// Session kept across connections, if enabled.
+		std::shared_ptr<session_state<T>> m_pSession;
+		std::function<void(bool bResumed)> m_fnSessionHandler;
+		// Options of the socket, see SetSocketOptions().
+		sSocketOptions m_socketOptions;
+		// Snapshot streams taken from the server, see AcceptSnapshots().
+		size_t m_nMaxSnapshotStreams = 0;
+		// Receive window of the connection, see SetReceiveWindow().
+		size_t m_nWindowBytes = 0;
+		uint32_t m_nWindowMessages = 0;
 	private:
 		// Thread safe queue for all message Objects. These are Owned messages, for they can come form the server and other clients?
 		// Also this is different from the queues that are inside connection object. So is this even used?
-		TsQueue<sOwnedMessage<T>> m_qMessagesIn;
+		incoming_queue<T> m_qMessagesIn;
 	};
 }
@@ -0,0 +1,106 @@
+#pragma once
+#include "include.h"
+#include "Message.h"
+
+namespace net
+{
+	// Routing between the servers of a cluster, see server_interface::StartCluster(). Servers are linked by
+	// connections carrying batches of entries, each entry a message and where it goes on the receiving node.
+	namespace cluster
+	{
+		enum class eRoute : uint8_t
+		{
+			// First entry on a link, the target is the sender's node ID.
+			hello,
+			// To the client with the target's global ID.
+			client,
+			// To every client of the node.
+			all,
+			// To the subscribers of the target topic on the node.
+			topic,
+			// The sender has subscribers to the target topic from now on, or no longer has any.
+			subscribe,
+			unsubscribe
+		};
+
+		// Batches are sent once they reach this size, or right after the messages that are routed together.
+		constexpr size_t nMaxBatchBytes = 32 * 1024;
+
+		// Node ID in the upper half, the client's ID on its node in the lower half.
+		inline uint64_t GlobalId(uint32_t nNode, uint32_t nClient)
+		{
+			return (static_cast<uint64_t>(nNode) << 32) | nClient;
+		}
+
+		inline uint32_t NodeOf(uint64_t nGlobalId)
+		{
+			return static_cast<uint32_t>(nGlobalId >> 32);
+		}
+
+		inline uint32_t ClientOf(uint64_t nGlobalId)
+		{
+			return static_cast<uint32_t>(nGlobalId);
+		}
+
+		template <typename T>
+		struct sEntry
+		{
+			eRoute route = eRoute::hello;
+			uint64_t nTarget = 0;
+			std::shared_ptr<const sMessage<T>> pMessage;
+		};
+
+		// Appends an entry to a batch: route and target, then the message header, body size and body if any.
+		template <typename T>
+		void WriteEntry(std::vector<uint8_t>& batch, eRoute route, uint64_t nTarget, const sMessage<T>* pMessage = nullptr)
+		{
+			auto Write = [&batch](const void* pData, size_t nSize)
+			{
+				batch.insert(batch.end(), static_cast<const uint8_t*>(pData), static_cast<const uint8_t*>(pData) + nSize);
+			};
+
+			uint8_t bMessage = pMessage != nullptr;
+			Write(&route, sizeof(route));
+			Write(&nTarget, sizeof(nTarget));
+			Write(&bMessage, sizeof(bMessage));
+			if (pMessage)
+			{
+				uint32_t nBody = static_cast<uint32_t>(pMessage->body.size());
+				Write(&pMessage->header, sizeof(pMessage->header));
+				Write(&nBody, sizeof(nBody));
+				Write(pMessage->body.data(), pMessage->body.size());
+			}
+		}
+
+		// Reads the entry at nOffset and moves past it. Fails on malformed input.
+		template <typename T>
+		bool ReadEntry(const std::vector<uint8_t>& batch, size_t& nOffset, sEntry<T>& entry)
+		{
+			auto Read = [&batch, &nOffset](void* pData, size_t nSize)
+			{
+				if (batch.size() - nOffset < nSize)
+					return false;
+				std::memcpy(pData, batch.data() + nOffset, nSize);
+				nOffset += nSize;
+				return true;
+			};
+
+			uint8_t bMessage;
+			if (!Read(&entry.route, sizeof(entry.route)) || !Read(&entry.nTarget, sizeof(entry.nTarget)) || !Read(&bMessage, sizeof(bMessage)))
+				return false;
+
+			entry.pMessage = nullptr;
+			if (bMessage)
+			{
+				auto pMessage = std::make_shared<sMessage<T>>();
+				uint32_t nBody;
+				if (!Read(&pMessage->header, sizeof(pMessage->header)) || !Read(&nBody, sizeof(nBody)) || batch.size() - nOffset < nBody)
+					return false;
+				pMessage->body.assign(batch.begin() + nOffset, batch.begin() + nOffset + nBody);
+				nOffset += nBody;
+				entry.pMessage = std::move(pMessage);
+			}
+			return true;
+		}
+	}
+}
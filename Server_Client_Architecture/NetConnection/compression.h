@@ -0,0 +1,247 @@
+#pragma once
+#include "include.h"
+
+namespace net
+{
+	// Codecs a connection can offer for compressing the bodies it sends.
+	enum class eCompression : uint8_t
+	{
+		none,
+		// Built in LZ77 codec with a token format close to LZ4 and a history kept across messages.
+		lz
+	};
+
+	// FNV-1a hash of a compression dictionary. Sent with a compression offer, so the peer can tell
+	// if it primes its history with the same dictionary.
+	inline uint32_t DictionaryHash(const std::vector<uint8_t>& dictionary)
+	{
+		uint32_t nHash = 2166136261u;
+		for (uint8_t byte : dictionary)
+		{
+			nHash ^= byte;
+			nHash *= 16777619u;
+		}
+		return nHash;
+	}
+
+	// A streaming LZ77 context. Every body that goes through it is appended to the history the next one
+	// is matched against, so even small messages compress well when they resemble the previous ones.
+	// Both ends of a connection keep one context per lane and feed it the same bodies in the same order,
+	// which keeps the two histories identical.
+	class lz_context
+	{
+	public:
+		// Starts a new history primed with the dictionary. Must be the same dictionary on both ends.
+		void Reset(const std::vector<uint8_t>& dictionary)
+		{
+			m_history.assign(dictionary.begin(), dictionary.end());
+			m_nBase = 0;
+			m_hashTable.assign(nHashSize, 0);
+
+			for (size_t p = 0; p + nMinMatch <= m_history.size(); p++)
+				m_hashTable[Hash(Read32(p))] = p + 1;
+
+			Trim();
+		}
+
+		// Compresses the input into the output buffer. If compressing does not pay off, the input is stored as is,
+		// but it still becomes part of the history.
+		void Compress(const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+		{
+			size_t nStart = m_history.size();
+			m_history.insert(m_history.end(), in.begin(), in.end());
+			size_t nEnd = m_history.size();
+
+			out.clear();
+			out.push_back(nModeCompressed);
+
+			size_t p = nStart;
+			size_t nLiteral = nStart;
+			while (p + nMinMatch <= nEnd)
+			{
+				uint32_t nSequence = Read32(p);
+				uint64_t& nSlot = m_hashTable[Hash(nSequence)];
+				uint64_t nCandidate = nSlot;
+				nSlot = m_nBase + p + 1;
+
+				// Hash slots hold absolute positions + 1, so 0 means empty and trimmed positions fall below the base.
+				if (nCandidate > m_nBase)
+				{
+					size_t c = static_cast<size_t>(nCandidate - 1 - m_nBase);
+					if (p - c <= nMaxOffset && Read32(c) == nSequence)
+					{
+						size_t nLength = nMinMatch;
+						while (p + nLength < nEnd && m_history[c + nLength] == m_history[p + nLength])
+							nLength++;
+
+						WriteSequence(out, nLiteral, p, p - c, nLength);
+						p += nLength;
+						nLiteral = p;
+						continue;
+					}
+				}
+				p++;
+			}
+			// The last sequence carries only literals, the decoder stops when it runs out of input after them.
+			WriteSequence(out, nLiteral, nEnd, 0, 0);
+
+			if (out.size() > in.size() + 1)
+			{
+				out.clear();
+				out.push_back(nModeStored);
+				out.insert(out.end(), in.begin(), in.end());
+			}
+
+			Trim();
+		}
+
+		// Decompresses the input into the output buffer. Fails on malformed input or if the result would be
+		// larger than nMaxSize. After a failure the history is no longer in sync with the peer.
+		bool Decompress(const std::vector<uint8_t>& in, std::vector<uint8_t>& out, size_t nMaxSize)
+		{
+			if (in.empty())
+				return false;
+
+			size_t nStart = m_history.size();
+
+			if (in[0] == nModeStored)
+			{
+				if (in.size() - 1 > nMaxSize)
+					return false;
+				m_history.insert(m_history.end(), in.begin() + 1, in.end());
+			}
+			else if (in[0] == nModeCompressed)
+			{
+				size_t ip = 1;
+				while (true)
+				{
+					if (ip >= in.size())
+						return false;
+
+					uint8_t nToken = in[ip++];
+
+					size_t nLiterals = nToken >> 4;
+					if (nLiterals == 15 && !ReadLength(in, ip, nLiterals))
+						return false;
+					if (nLiterals > in.size() - ip || m_history.size() - nStart + nLiterals > nMaxSize)
+						return false;
+
+					m_history.insert(m_history.end(), in.begin() + ip, in.begin() + ip + nLiterals);
+					ip += nLiterals;
+
+					if (ip == in.size())
+						break;
+
+					if (in.size() - ip < 2)
+						return false;
+					size_t nOffset = in[ip] | (in[ip + 1] << 8);
+					ip += 2;
+
+					size_t nLength = nToken & 0x0F;
+					if (nLength == 15 && !ReadLength(in, ip, nLength))
+						return false;
+					nLength += nMinMatch;
+
+					if (nOffset == 0 || nOffset > m_history.size() || m_history.size() - nStart + nLength > nMaxSize)
+						return false;
+
+					// Byte by byte, because a match may overlap the bytes it produces.
+					for (size_t i = 0; i < nLength; i++)
+						m_history.push_back(m_history[m_history.size() - nOffset]);
+				}
+			}
+			else
+			{
+				return false;
+			}
+
+			out.assign(m_history.begin() + nStart, m_history.end());
+			Trim();
+			return true;
+		}
+
+	private:
+		uint32_t Read32(size_t nPosition) const
+		{
+			uint32_t nValue;
+			std::memcpy(&nValue, m_history.data() + nPosition, sizeof(nValue));
+			return nValue;
+		}
+
+		static size_t Hash(uint32_t nSequence)
+		{
+			return (nSequence * 2654435761u) >> (32 - nHashBits);
+		}
+
+		// Writes the literals between nLiteral and nMatch, followed by a match if nLength is not 0.
+		void WriteSequence(std::vector<uint8_t>& out, size_t nLiteral, size_t nMatch, size_t nOffset, size_t nLength) const
+		{
+			size_t nLiterals = nMatch - nLiteral;
+			size_t nMatchCode = nLength > 0 ? nLength - nMinMatch : 0;
+
+			out.push_back(static_cast<uint8_t>((std::min<size_t>(nLiterals, 15) << 4) | std::min<size_t>(nMatchCode, 15)));
+			if (nLiterals >= 15)
+				WriteLength(out, nLiterals - 15);
+
+			out.insert(out.end(), m_history.begin() + nLiteral, m_history.begin() + nMatch);
+
+			if (nLength > 0)
+			{
+				out.push_back(static_cast<uint8_t>(nOffset & 0xFF));
+				out.push_back(static_cast<uint8_t>(nOffset >> 8));
+				if (nMatchCode >= 15)
+					WriteLength(out, nMatchCode - 15);
+			}
+		}
+
+		// Lengths that do not fit into the token continue in bytes of 255 and end with a smaller byte.
+		static void WriteLength(std::vector<uint8_t>& out, size_t nLength)
+		{
+			while (nLength >= 255)
+			{
+				out.push_back(255);
+				nLength -= 255;
+			}
+			out.push_back(static_cast<uint8_t>(nLength));
+		}
+
+		static bool ReadLength(const std::vector<uint8_t>& in, size_t& ip, size_t& nLength)
+		{
+			uint8_t nByte;
+			do
+			{
+				if (ip >= in.size())
+					return false;
+				nByte = in[ip++];
+				nLength += nByte;
+			} while (nByte == 255);
+			return true;
+		}
+
+		// Drops history that is out of reach of any match once it grows to twice the window.
+		void Trim()
+		{
+			if (m_history.size() > 2 * nMaxOffset)
+			{
+				size_t nDrop = m_history.size() - nMaxOffset;
+				m_history.erase(m_history.begin(), m_history.begin() + nDrop);
+				m_nBase += nDrop;
+			}
+		}
+
+	private:
+		static constexpr uint8_t nModeCompressed = 0;
+		static constexpr uint8_t nModeStored = 1;
+		static constexpr size_t nMinMatch = 4;
+		static constexpr size_t nMaxOffset = 65535;
+		static constexpr size_t nHashBits = 12;
+		static constexpr size_t nHashSize = size_t(1) << nHashBits;
+
+		// Recent bytes that went through this context, matches point back into it.
+		std::vector<uint8_t> m_history;
+		// Absolute stream position of the first byte in the history.
+		uint64_t m_nBase = 0;
+		// Last position of each hashed 4 byte sequence, only used when compressing.
+		std::vector<uint64_t> m_hashTable;
+	};
+}
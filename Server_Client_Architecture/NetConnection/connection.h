@@ -16,11 +16,17 @@ namespace net
 			client
 		};
 		// A constructor, gets primarily called form server and client implementations.
+		// The socket should be created on a strand of the context (asio::make_strand). Every handler of this connection
+		// runs on the socket's executor, so with a strand the connection stays consistent while many threads run the context.
 		connection(owner parent, asio::io_context& asioContext,
 			asio::ip::tcp::socket socket, TsQueue<sOwnedMessage<T>>& qIn)
-			: m_asioContext(asioContext), m_socket(std::move(socket)), m_qMessagesIn(qIn)
+			: m_socket(std::move(socket)), m_asioContext(asioContext), m_qMessagesIn(qIn), m_timerReceive(m_socket.get_executor()),
+			m_timerRead(m_socket.get_executor()), m_timerBackOff(m_socket.get_executor())
 		{
 			m_nOwnerType = parent;
+			m_vecHeadersOut.reserve(nMaxFramesPerWrite);
+			// Clients number their streams odd, servers even, so both ends can open streams at once.
+			m_nNextStream = parent == owner::client ? 1 : 2;
 		}
 
 		virtual ~connection()
@@ -33,190 +39,2157 @@ namespace net
 		{
 			if (m_nOwnerType == owner::server)
 			{
-				if (m_socket.is_open())
+				// A stream reads nothing itself, its connection does.
+				if (m_bStream)
 				{
 					id = uid;
-					ReadHeader();
 				}
+				else if (m_socket.is_open())
+				{
+					id = uid;
+					asio::post(m_socket.get_executor(), [this]() { ReadHeader(); });
+				}
+			}
+		}
+
+		// Server side counterpart of Detach() in the process taking over. The socket was assigned a handle released by Detach(),
+		// this puts back the state that came with it and carries on reading where the previous process stopped.
+		bool ResumeFromHandOff(uint32_t uid, const std::vector<uint8_t>& state)
+		{
+			if (m_nOwnerType != owner::server || !m_socket.is_open())
+				return false;
+
+			size_t nPosition = 0;
+			auto Read = [&state, &nPosition](void* pData, size_t nSize)
+			{
+				if (state.size() - nPosition < nSize)
+					return false;
+				std::memcpy(pData, state.data() + nPosition, nSize);
+				nPosition += nSize;
+				return true;
+			};
+			auto ReadMessage = [&Read](sMessage<T>& message, uint32_t nMaxSize)
+			{
+				uint32_t nSize;
+				if (!Read(&message.header, sizeof(sMessageHeader<T>)) || !Read(&nSize, sizeof(nSize)) || nSize > nMaxSize)
+					return false;
+				message.body.resize(nSize);
+				return Read(message.body.data(), nSize);
+			};
+
+			uint8_t bReadingBody;
+			uint32_t nReadDone;
+			if (!Read(&bReadingBody, sizeof(bReadingBody)) || !Read(&nReadDone, sizeof(nReadDone)))
+				return false;
+			if (!ReadMessage(m_msgTemporaryIn, std::numeric_limits<uint16_t>::max()))
+				return false;
+			for (auto& msgPartial : m_msgPartialIn)
+			{
+				if (!ReadMessage(msgPartial, std::numeric_limits<uint32_t>::max()))
+					return false;
+			}
+
+			if (bReadingBody ? nReadDone > m_msgTemporaryIn.body.size() : nReadDone > sizeof(sMessageHeader<T>))
+				return false;
+
+			id = uid;
+			asio::post(m_socket.get_executor(),
+				[this, bReadingBody, nReadDone]()
+				{
+					if (bReadingBody)
+						ReadBody(nReadDone);
+					else
+						ReadHeader(nReadDone);
+				});
+			return true;
+		}
+
+		// Called from the client on a connection.
+		// Sends a async connect request with this socket, that gets picked up by the server's acceptor.
+		// It then primes this socket's context to start reading possible incoming messages from the server.
+		// Messages sent before the connection is established wait on their lanes until it is.
+		bool ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints)
+		{
+			if (m_nOwnerType == owner::client && !endpoints.empty())
+			{
+				m_bConnecting = true;
+				ConnectToEndpoint(endpoints, endpoints.begin());
+				return true;
+			}
+			return false;
+		}
+
+		// Closes the socket on the connection's strand. Returns false if it was not open.
+		bool Disconnect()
+		{
+			if (IsConnected())
+			{
+				asio::post(m_socket.get_executor(), [this]() { Close(); });
+				return true;
+			}
+			return false;
+		}
+
+		// Closes the connection once everything queued so far has been written, with a goodbye frame as the last one,
+		// so the peer can tell it from a failure. Messages sent after the goodbye are dropped.
+		void DisconnectGracefully()
+		{
+			asio::post(m_socket.get_executor(),
+				[this]()
+				{
+					if (!IsConnected() || m_bClosing)
+						return;
+
+					// A stream is closed once its connection wrote what it had queued.
+					if (m_bStream)
+					{
+						m_bClosing = true;
+						if (!HasQueued())
+							Close();
+						return;
+					}
+
+					m_bClosing = true;
+					if (!m_bWritingMessage && !m_bConnecting)
+						OnDrained();
+				});
+		}
+
+		// Client side: numbers messages and keeps the recent ones in pSession, so after a reconnect with the same session
+		// only what the server missed is sent again, and the server does the same. Nothing but control frames is written
+		// until the server answered, then fnHandler learns if the session was resumed. If not, numbering starts over
+		// and the application has to resync. Call before ConnectToServer().
+		void UseSession(std::shared_ptr<session_state<T>> pSession, std::function<void(bool bResumed)> fnHandler = nullptr)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, pSession = std::move(pSession), fnHandler = std::move(fnHandler)]()
+				{
+					m_pSession = pSession;
+					m_fnSessionHandler = fnHandler;
+					m_bSessionPending = true;
+				});
+		}
+
+		// Server side: waits for the client's session request before writing anything but control frames.
+		// fnFindSession returns the session with a token, or nullptr if there is none. Token 0 asks for a new session.
+		void UseSessions(std::function<std::shared_ptr<session_state<T>>(uint64_t nToken)> fnFindSession)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, fnFindSession = std::move(fnFindSession)]()
+				{
+					m_fnFindSession = fnFindSession;
+					m_bSessionPending = true;
+				});
+		}
+
+		// Hands the connection over to another process, see server_interface::HandOff(). Everything queued so far is written,
+		// then reading stops and the socket is released. The handler gets its native handle and the state ResumeFromHandOff()
+		// needs to carry on, both on the connection's strand. Compressed connections keep codec history that is not carried over,
+		// they fail with operation_not_supported, as do connections with a session, streams or a window. Outstanding requests fail, their responses would arrive at the other process.
+		void Detach(std::function<void(std::error_code, asio::ip::tcp::socket::native_handle_type, std::vector<uint8_t>)> fnHandler)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, fnHandler = std::move(fnHandler)]() mutable
+				{
+					if (!m_socket.is_open() || m_bClosing || m_fnDetached)
+					{
+						fnHandler(asio::error::not_connected, {}, {});
+						return;
+					}
+
+					bool bCompressed = std::any_of(m_lzIn.begin(), m_lzIn.end(), [](const auto& context) { return context != nullptr; })
+						|| std::any_of(m_lzOut.begin(), m_lzOut.end(), [](const auto& context) { return context != nullptr; });
+					if (bCompressed || m_pSession || m_bStreams || m_nWindowBytes > 0 || m_bPeerWindow)
+					{
+						fnHandler(asio::error::operation_not_supported, {}, {});
+						return;
+					}
+
+					m_fnDetached = std::move(fnHandler);
+					if (!m_bWritingMessage)
+						StopReadingForDetach();
+				});
+		}
+
+		bool IsConnected() const
+		{
+			return m_bStream ? m_bStreamOpen.load() : m_socket.is_open();
+		}
+
+		uint32_t GetId() const
+		{
+			return id;
+		}
+
+	public:
+		// Posts a function to the context that checks, if we are currently already writing and sending a message,
+		// and if not, it starts writing and sending it. Otherwise it saves it for later.
+		// The message goes to the lane registered for its id with SetPriority().
+		// The copy is ours alone, so it still gets the deadline of its id, see SetExpiry().
+		void Send(const sMessage<T>& message)
+		{
+			auto pMessage = std::make_shared<sMessage<T>>(message);
+			asio::post(m_socket.get_executor(),
+				[this, pMessage]()
+				{
+					StampDeadline(*pMessage, std::chrono::steady_clock::now());
+					auto it = m_mapPriorities.find(pMessage->header.id);
+					QueueMessage(pMessage, it != m_mapPriorities.end() ? it->second : ePriority::normal);
+				});
+		}
+
+		// Same as above, but puts the message on the given priority lane.
+		void Send(const sMessage<T>& message, ePriority priority)
+		{
+			auto pMessage = std::make_shared<sMessage<T>>(message);
+			asio::post(m_socket.get_executor(),
+				[this, pMessage, priority]()
+				{
+					StampDeadline(*pMessage, std::chrono::steady_clock::now());
+					QueueMessage(pMessage, priority);
+				});
+		}
+
+		// Sends a message shared with other connections. The message is not copied, so it must not change afterwards.
+		void Send(std::shared_ptr<const sMessage<T>> pMessage)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, pMessage]()
+				{
+					auto it = m_mapPriorities.find(pMessage->header.id);
+					QueueMessage(pMessage, it != m_mapPriorities.end() ? it->second : ePriority::normal);
+				});
+		}
+
+		// Same as above, but puts the message on the given priority lane.
+		void Send(std::shared_ptr<const sMessage<T>> pMessage, ePriority priority)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, pMessage, priority]()
+				{
+					QueueMessage(pMessage, priority);
+				});
+		}
+
+		// Sends several shared messages with one post. They are all queued before writing starts,
+		// so they go out in as few writes as possible.
+		void SendBatch(std::vector<std::shared_ptr<const sMessage<T>>> vecMessages)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, vecMessages = std::move(vecMessages)]()
+				{
+					m_bBatching = true;
+					for (const auto& pMessage : vecMessages)
+					{
+						auto it = m_mapPriorities.find(pMessage->header.id);
+						QueueMessage(pMessage, it != m_mapPriorities.end() ? it->second : ePriority::normal);
+					}
+					m_bBatching = false;
+					StartWriting();
+				});
+		}
+
+		// Sets the default lane for messages with this id. Messages without a registered lane are sent as normal.
+		void SetPriority(T msgId, ePriority priority)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, msgId, priority]()
+				{
+					m_mapPriorities[msgId] = priority;
+				});
+		}
+
+		// Messages with this id expire once they waited longer than ttl, a zero ttl takes the expiry away. Incoming ones
+		// get their deadline as they are queued for handling, outgoing ones as they are sent with a copy, see Send().
+		// Shared messages keep the deadline they were made with. An expired message is dropped before it is written,
+		// or before it is handled by whoever drains the incoming queue and checks sMessage::Expired().
+		void SetExpiry(T msgId, std::chrono::steady_clock::duration ttl)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, msgId, ttl]()
+				{
+					if (ttl > std::chrono::steady_clock::duration::zero())
+						m_mapExpiry[msgId] = ttl;
+					else
+						m_mapExpiry.erase(msgId);
+				});
+		}
+
+		// Outgoing messages dropped so far because they expired before they were written.
+		uint64_t ExpiredOut() const
+		{
+			return m_nExpiredOut;
+		}
+
+		// Sets the largest piece of a body written at once. Bigger bodies are split into fragments, and between
+		// two fragments a message from a higher lane can get in, so it does not wait for the whole transfer.
+		void SetChunkSize(uint16_t nChunkSize)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, nChunkSize]()
+				{
+					m_nChunkSize = std::max<uint16_t>(nChunkSize, 1);
+				});
+		}
+
+		// Records every complete message received and sent into the capture, nullptr stops recording.
+		void UseCapture(std::shared_ptr<capture_log> pCapture)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, pCapture = std::move(pCapture)]()
+				{
+					m_pCapture = pCapture;
+				});
+		}
+
+		// Makes this connection a link between two servers of a cluster, see server_interface::StartCluster().
+		// Batches sent with SendLink() on the other end are handed to fnHandler on the connection's strand.
+		// Call before ConnectToServer() or ConnectToClient(), so the handler is there before anything is read.
+		void UseAsLink(std::function<void(const std::vector<uint8_t>& batch)> fnHandler)
+		{
+			m_fnLinkHandler = std::move(fnHandler);
+		}
+
+		// Sends a batch of routed messages over a link, as a control frame so it goes ahead of everything else.
+		void SendLink(std::vector<uint8_t> vecBatch)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, vecBatch = std::move(vecBatch)]() mutable
+				{
+					sMessage<T> message;
+					message.body = std::move(vecBatch);
+					SendControl(message, eControl::cluster);
+				});
+		}
+
+		// Lets the peer open streams on this connection, see OpenStream(). Every stream the peer opens is handed to fnAccept,
+		// which returns false to turn it down. Call before ConnectToServer() or ConnectToClient(), so nothing is read before.
+		void UseStreams(std::function<bool(std::shared_ptr<connection<T>>)> fnAccept)
+		{
+			m_bStreams = true;
+			m_fnStreamAccept = std::move(fnAccept);
+		}
+
+		// Opens a stream, a logical connection carried by this one. The handle returned is used like any connection,
+		// and messages the peer sends on the stream are queued with the handle as their remote. Many streams share the
+		// socket, and they take turns on each lane, a frame at a time, so a busy stream does not hold up the others.
+		// The messages of a stream keep their order. A stream sends at most nStreamWindow bytes ahead of what the peer
+		// handled, so a stream the peer does not keep up with waits while the others go on. Control frames stay on the
+		// connection itself, compression, sessions and snapshots do not apply to streams. The peer must UseStreams().
+		std::shared_ptr<connection<T>> OpenStream()
+		{
+			auto pStream = MakeStream(m_nNextStream.fetch_add(2));
+
+			asio::post(m_socket.get_executor(),
+				[this, pStream]()
+				{
+					if (!m_socket.is_open())
+					{
+						pStream->Close();
+						return;
+					}
+
+					m_bStreams = true;
+					m_mapStreams[pStream->m_nStreamId] = pStream;
+					sMessage<T> open;
+					open << pStream->m_nStreamId;
+					SendControl(open, eControl::streamOpen);
+				});
+			return pStream;
+		}
+
+		// Every complete message from the peer goes to fnHandler on the connection's strand as it is, requests and
+		// responses included, instead of being handled by this connection. Pass nullptr to remove it.
+		void SetSpliceHandler(std::function<void(sMessage<T>&)> fnHandler)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, fnHandler = std::move(fnHandler)]()
+				{
+					m_fnSpliceHandler = fnHandler;
+				});
+		}
+
+		// Calls fnHandler on the connection's strand once the connection is closed, whatever closed it,
+		// or right away if it is closed already.
+		void SetCloseHandler(std::function<void()> fnHandler)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, fnHandler = std::move(fnHandler)]()
+				{
+					if (m_bClosed)
+						fnHandler();
+					else
+						m_fnCloseHandler = fnHandler;
+				});
+		}
+
+		// Sets the most bytes gathered into one write. Frames waiting on the lanes go out together, which saves
+		// system calls when many small messages are sent. 0 writes every frame on its own.
+		void SetWriteBatch(size_t nMaxBytes)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, nMaxBytes]()
+				{
+					m_nMaxWriteBytes = nMaxBytes;
+				});
+		}
+
+		// Marks messages with this id as replaceable (latest value wins). A newer replaceable message takes the place
+		// of an unsent one with the same id, so a slow client gets fewer but always the freshest updates.
+		// Requests and responses are left alone, each of them is waited for.
+		void SetReplaceable(T msgId, bool bReplaceable = true)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, msgId, bReplaceable]()
+				{
+					if (bReplaceable)
+						m_setReplaceableIds.insert(msgId);
+					else
+						m_setReplaceableIds.erase(msgId);
+				});
+		}
+
+		// Sets the dictionary this side primes its compression histories with. The peer has to use the same one,
+		// otherwise compression offers are declined.
+		void SetCompressionDictionary(const std::vector<uint8_t>& dictionary)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, dictionary]()
+				{
+					m_vecDictionary = dictionary;
+				});
+		}
+
+		// Body bytes of the messages sent compressed so far, before and after compression.
+		std::pair<uint64_t, uint64_t> CompressedBytes() const
+		{
+			return { m_nCompressedFrom, m_nCompressedTo };
+		}
+
+		// Offers the peer to compress bodies larger than nThreshold bytes sent from this side.
+		// Compression starts once the peer accepts, until then bodies go out as they are.
+		void EnableCompression(eCompression codec = eCompression::lz, uint16_t nThreshold = 128)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, codec, nThreshold]()
+				{
+					// Resetting the histories while compressed bodies are in flight would break the peer's decoding,
+					// and so would a second accept, so there is one offer at a time.
+					if (m_compressionOut != eCompression::none || m_compressionOffered != eCompression::none || codec == eCompression::none)
+						return;
+
+					m_nCompressionThreshold = nThreshold;
+					m_compressionOffered = codec;
+
+					sMessage<T> message;
+					message << codec << DictionaryHash(m_vecDictionary);
+					SendControl(message, eControl::compressionOffer);
+				});
+		}
+
+		// Sends a request and completes with the peer's response, matched by the correlation id in the header.
+		// Any number of requests can be outstanding on a connection at once. If no response arrives within
+		// the timeout, the request completes with asio::error::timed_out.
+		// Takes any asio completion token: a callback void(std::error_code, sMessage<T>), asio::use_future,
+		// or asio::use_awaitable inside a coroutine. Plain callbacks run on the connection's strand, so keep them short.
+		template <typename CompletionToken>
+		auto Request(const sMessage<T>& request, std::chrono::steady_clock::duration timeout, CompletionToken&& token)
+		{
+			return asio::async_initiate<CompletionToken, void(std::error_code, sMessage<T>)>(
+				[this](auto handler, sMessage<T> request, std::chrono::steady_clock::duration timeout)
+				{
+					asio::post(m_socket.get_executor(),
+						[this, handler = std::move(handler), request = std::move(request), timeout]() mutable
+						{
+							// 0 means "no correlation", so it is skipped when the counter wraps around.
+							if (++m_nLastCorrelation == 0)
+								++m_nLastCorrelation;
+							uint32_t nCorrelation = m_nLastCorrelation;
+
+							sPendingRequest& pending = m_mapPendingRequests[nCorrelation];
+							pending.pHandler = std::make_unique<sPendingRequestHandler<decltype(handler)>>(std::move(handler));
+							pending.pTimer = std::make_unique<asio::steady_timer>(m_socket.get_executor(), timeout);
+							pending.pTimer->async_wait(
+								[this, nCorrelation](std::error_code ec)
+								{
+									if (!ec)
+										CompleteRequest(nCorrelation, asio::error::timed_out, {});
+								});
+
+							request.header.correlation = nCorrelation;
+							request.header.flags |= frame::request;
+
+							auto it = m_mapPriorities.find(request.header.id);
+							QueueMessage(std::make_shared<const sMessage<T>>(std::move(request)),
+								it != m_mapPriorities.end() ? it->second : ePriority::normal);
+						});
+				},
+				token, request, timeout);
+		}
+
+		// Sends the response to a request received from the peer.
+		void Reply(const sMessage<T>& request, const sMessage<T>& response)
+		{
+			auto pResponse = std::make_shared<sMessage<T>>(response);
+			pResponse->header.correlation = request.header.correlation;
+			pResponse->header.flags |= frame::response;
+			Send(std::shared_ptr<const sMessage<T>>(std::move(pResponse)));
+		}
+
+		// Sets the largest body accepted from the peer, for ids without a limit of their own. Default is 1 MiB.
+		// Frames over the limit close the connection before their body is allocated.
+		void SetMaxBodySize(size_t nMaxBytes)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, nMaxBytes]()
+				{
+					m_nMaxBodySize = nMaxBytes;
+				});
+		}
+
+		// Sets the largest body accepted from the peer for messages with this id.
+		void SetMaxBodySize(T msgId, size_t nMaxBytes)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, msgId, nMaxBytes]()
+				{
+					m_mapMaxBodySizes[msgId] = nMaxBytes;
+				});
+		}
+
+		// Only ids from idFirst to idLast are accepted from the peer, anything else closes the connection.
+		void SetIdRange(T idFirst, T idLast)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, idFirst, idLast]()
+				{
+					m_bCheckIdRange = true;
+					m_idFirst = idFirst;
+					m_idLast = idLast;
+				});
+		}
+
+		// Sets how many body bytes of a server side connection may wait in the incoming queue at once.
+		// A frame that would go over it closes the connection. Bytes are given back by ReleaseInFlight().
+		void SetInFlightBudget(size_t nMaxBytes)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, nMaxBytes]()
+				{
+					m_nInFlightBudget = nMaxBytes;
+				});
+		}
+
+		// Pauses reading while the bytes of this connection waiting in the incoming queue are at nHigh or more, until they
+		// are back under nLow, and the same for the bytes of all connections sharing pShared. TCP flow control then pushes
+		// back on the peer, instead of the queue growing. Streams only count towards pShared, their connection is paused.
+		// 0 or nullptr for none. Call before ConnectToClient(), so nothing is read before.
+		void UseWatermarks(std::shared_ptr<watermark> pShared, size_t nHigh, size_t nLow)
+		{
+			m_pSharedMarks = std::move(pShared);
+			if (nHigh > 0)
+				m_pReadMarks = std::make_shared<watermark>(nHigh, nLow);
+		}
+
+		// Charges the bodies of the messages queued on this stream to pMarks until their last fragment is in a write,
+		// so whoever fills the stream can park on pMarks, see UseWatermarks(), instead of it growing. Call before Send().
+		void UseSendMarks(std::shared_ptr<watermark> pMarks)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, pMarks = std::move(pMarks)]()
+				{
+					m_pSendMarks = pMarks;
+				});
+		}
+
+		// Sets the options on the socket, right away if it is open, or when ConnectToServer() opens it.
+		// Call before ConnectToServer() or ConnectToClient().
+		void UseSocketOptions(const sSocketOptions& options)
+		{
+			m_socketOptions = options;
+			m_bQuickAck = options.bQuickAck.value_or(false);
+			socket_options::Apply(m_socket, m_socketOptions);
+		}
+
+		// Gives back budget charged for a queued message once it was handled, and the window if it was charged to it.
+		// Called by the server's Update(), and by the client's incoming queue when a message is taken off it.
+		void ReleaseInFlight(size_t nBytes, bool bWindowed = false)
+		{
+			m_nBytesInFlight -= nBytes;
+			if (m_pReadMarks)
+				m_pReadMarks->Release(nBytes);
+			if (m_pSharedMarks)
+				m_pSharedMarks->Release(nBytes);
+
+			// The peer of a stream gets the bytes back for its window.
+			if (m_bStream)
+			{
+				asio::post(m_socket.get_executor(),
+					[pStream = this->shared_from_this(), nBytes]()
+					{
+						pStream->StreamConsumed(nBytes);
+					});
+			}
+			else if (bWindowed)
+			{
+				Credit(nBytes);
+			}
+		}
+
+		// Advertises how much the peer may send ahead of what was handled here, in body bytes and messages. The peer stops
+		// writing once either is used up, and holds its messages until some were handled, see ReleaseInFlight(). Window
+		// updates ride along with the messages going the other way, and are only sent on their own once half the window
+		// waits for one. Control frames are not counted. The window can only grow, and 0 means no window, as before one
+		// was set. The in-flight budget still closes the connection of a peer that does not keep to the window.
+		// A window of 0 messages would never let the peer send anything, it is turned down.
+		void SetReceiveWindow(size_t nBytes, uint32_t nMessages = std::numeric_limits<uint32_t>::max())
+		{
+			if (nMessages == 0)
+			{
+				log::Error("[", id, "] Receive window of 0 messages turned down");
+				return;
+			}
+
+			asio::post(m_socket.get_executor(),
+				[this, nBytes, nMessages]()
+				{
+					// Streams have windows of their own.
+					if (m_bStream || nBytes == 0 || nBytes < m_nWindowBytes || nMessages < m_nWindowMessages)
+						return;
+
+					sMessage<T> grant;
+					grant << static_cast<uint32_t>(std::min<size_t>(nBytes - m_nWindowBytes, std::numeric_limits<uint32_t>::max()))
+						<< (nMessages - m_nWindowMessages);
+					m_nWindowBytes = nBytes;
+					m_nWindowMessages = nMessages;
+					SendControl(grant, eControl::window);
+				});
+		}
+
+		// False while the window the peer advertised is used up, what is sent meanwhile waits in the queue.
+		// Producers can hold off until it is true again instead of piling up messages.
+		bool CanSend() const
+		{
+			return m_nPeerWindowBytes > 0 && m_nPeerWindowMessages > 0;
+		}
+
+		// Asks the peer to hold back its messages on the lane and the ones below it for a while, because we are overloaded.
+		// Its control frames and the messages it is in the middle of sending still come through.
+		void BackOff(std::chrono::milliseconds duration, ePriority lane)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, duration, lane]()
+				{
+					if (m_bStream || m_bGoodbyeSent || !m_socket.is_open())
+						return;
+
+					sMessage<T> request;
+					request << static_cast<uint32_t>(duration.count()) << static_cast<uint8_t>(lane);
+					SendControl(request, eControl::backOff);
+				});
+		}
+
+		// Limits how fast the peer may send, in messages and body bytes per second, with up to a second's worth in a burst.
+		// Over the limit the connection stops reading until it is back under, so TCP flow control slows the peer down.
+		// A rate of 0 means no limit.
+		void SetRateLimit(double dMessagesPerSecond, double dBytesPerSecond)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, dMessagesPerSecond, dBytesPerSecond]()
+				{
+					m_bucketMessages.Configure(dMessagesPerSecond, dMessagesPerSecond);
+					m_bucketBytes.Configure(dBytesPerSecond, dBytesPerSecond);
+				});
+		}
+
+		// Sends the state of a stream, the peer gets it as a message with the id and the whole state as its body.
+		// The peer acks every snapshot. Later ones go out as deltas against the newest state it acked, or in full
+		// if there is none or the delta is not smaller. A newer snapshot replaces an older one of the same stream
+		// that has not started going out yet, the peer only ever needs the latest state. On the wire a snapshot is
+		// a message like any other, so rate limits, body size limits, windows and sessions apply to it as sent.
+		// The peer must AcceptSnapshots().
+		void SendSnapshot(uint32_t nStream, T id, std::shared_ptr<const std::vector<uint8_t>> pState, ePriority priority = ePriority::normal)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, nStream, id, pState = std::move(pState), priority]()
+				{
+					auto& stream = m_mapSnapshotsOut[nStream];
+
+					sMessage<T> message;
+					uint32_t nBase = 0;
+					if (stream.nAcked != 0)
+					{
+						auto it = std::find_if(stream.deqSent.begin(), stream.deqSent.end(),
+							[&stream](const auto& sent) { return sent.first == stream.nAcked; });
+						if (it != stream.deqSent.end() && snapshot::EncodeDelta(*it->second, *pState, message.body))
+							nBase = stream.nAcked;
+					}
+					if (nBase == 0)
+						message.body = *pState;
+
+					stream.nSequence++;
+					stream.deqSent.emplace_back(stream.nSequence, pState);
+					if (stream.deqSent.size() > snapshot::nHistory)
+						stream.deqSent.pop_front();
+
+					message << nBase << stream.nSequence;
+					message.header.id = id;
+					message.header.flags = frame::snapshot;
+					message.header.correlation = nStream;
+					auto pMessage = std::make_shared<const sMessage<T>>(std::move(message));
+
+					auto& qLane = m_qMessagesOut[static_cast<size_t>(priority)];
+					if (qLane.replace_if(
+						[nStream](const std::shared_ptr<const sMessage<T>>& pQueued)
+						{
+							return (pQueued->header.flags & frame::snapshot) && pQueued->header.correlation == nStream;
+						},
+						pMessage, 1))
+					{
+						return;
+					}
+					QueueMessage(pMessage, priority);
+				});
+		}
+
+		// Takes snapshots from the peer on up to nMaxStreams streams, each keeping up to snapshot::nHistory states.
+		// A snapshot on any further stream closes the connection, as does any snapshot before this was called.
+		void AcceptSnapshots(size_t nMaxStreams)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, nMaxStreams]()
+				{
+					m_nMaxSnapshotStreams = nMaxStreams;
+				});
+		}
+
+		// Sets a handler that gets every incoming message right on the connection's strand, before it would be queued.
+		// If it returns false, the message goes to the incoming queue as usual. Pass nullptr to remove it.
+		void SetInlineHandler(std::function<bool(std::shared_ptr<connection<T>>, sMessage<T>&)> fnHandler)
+		{
+			asio::post(m_socket.get_executor(),
+				[this, fnHandler = std::move(fnHandler)]()
+				{
+					m_fnInlineHandler = fnHandler;
+				});
+		}
+
+#if defined(ASIO_HAS_CO_AWAIT)
+		// From now on incoming messages are kept for AsyncReceive() instead of going to the owner's incoming queue.
+		void UseReceive()
+		{
+			asio::post(m_socket.get_executor(),
+				[this]()
+				{
+					m_bUseReceive = true;
+				});
+		}
+
+		// Runs a coroutine on this connection's strand, which is where AsyncReceive() and AsyncSend() must be called from.
+		void Spawn(asio::awaitable<void> session)
+		{
+			asio::co_spawn(m_socket.get_executor(), std::move(session), asio::detached);
+		}
+
+		// Waits for the next message of this connection, for session logic written as a coroutine.
+		// The coroutine has to run on this connection's strand. Throws asio::error::eof once the connection is closed.
+		asio::awaitable<sMessage<T>> AsyncReceive()
+		{
+			while (m_deqInbox.empty())
+			{
+				if (!IsConnected())
+					throw std::system_error(asio::error::eof);
+
+				// Woken up by cancelling the timer when a message arrives or the connection fails.
+				std::error_code ec;
+				m_timerReceive.expires_at(asio::steady_timer::time_point::max());
+				co_await m_timerReceive.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+			}
+
+			sMessage<T> message = std::move(m_deqInbox.front());
+			m_deqInbox.pop_front();
+			co_return message;
+		}
+
+		// Queues the message for sending from a coroutine running on this connection's strand. Completes as soon
+		// as the message is queued, without the post Send() needs to get onto the strand.
+		asio::awaitable<void> AsyncSend(const sMessage<T>& message)
+		{
+			auto it = m_mapPriorities.find(message.header.id);
+			QueueMessage(std::make_shared<const sMessage<T>>(message),
+				it != m_mapPriorities.end() ? it->second : ePriority::normal);
+			co_return;
+		}
+#endif
+
+	private:
+		// Gives up on the connection after a failed read or a frame that breaks the protocol.
+		void FailRead(const char* szReason)
+		{
+			// Reads still pending when we closed the socket ourselves fail as well, that is no error.
+			if (!m_socket.is_open())
+				return;
+
+			static log::rate_limit limit(nErrorLinesPerSecond);
+			log::WriteLimited<log::eLevel::error>(limit, "[", id, "] ", szReason);
+			Close();
+		}
+
+		// Closes the socket and ends everything waiting on it.
+		void Close()
+		{
+			std::error_code ec;
+			m_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+			m_socket.close(ec);
+			if (m_pSession)
+			{
+				// What is still queued goes out on the connection resuming the session, a partly written message from the start.
+				// Messages of a write that did not complete come first, they are already off their lanes.
+				std::vector<std::shared_ptr<const sMessage<T>>> vecUnsent;
+				for (const auto& completed : m_vecCompletedOut)
+				{
+					if (!(completed.second->header.flags & frame::control))
+						vecUnsent.push_back(completed.second);
+				}
+				m_vecCompletedOut.clear();
+				for (auto& qLane : m_qMessagesOut)
+				{
+					while (!qLane.empty())
+					{
+						auto pMessage = qLane.pop_front();
+						if (!(pMessage->header.flags & frame::control))
+							vecUnsent.push_back(std::move(pMessage));
+					}
+				}
+				m_nOutOffset = {};
+				m_pSession->Closed(this, std::move(vecUnsent));
+			}
+			FailPendingRequests();
+			m_timerReceive.cancel();
+			m_timerRead.cancel();
+			m_timerBackOff.cancel();
+
+			// Streams go down with their connection, and the peer learns about a stream closed on this end.
+			// Whatever the stream still had queued is dropped. Its connection may hold the last reference to it,
+			// which has to outlive this call.
+			std::shared_ptr<connection<T>> pSelf;
+			if (m_bStream && m_bStreamOpen.exchange(false))
+			{
+				pSelf = this->shared_from_this();
+				for (auto& qLane : m_qMessagesOut)
+					qLane.clear();
+				m_nOutOffset = {};
+				ReleaseSendMarks(m_nSendMarked);
+				if (auto pParent = m_pParent.lock())
+					pParent->StreamClosed(m_nStreamId);
+			}
+			auto mapStreams = std::move(m_mapStreams);
+			m_mapStreams.clear();
+			for (auto& deqTurns : m_deqStreamTurns)
+				deqTurns.clear();
+			for (auto& [nStream, pStream] : mapStreams)
+				pStream->Close();
+
+			m_bClosed = true;
+			if (m_fnCloseHandler)
+			{
+				auto fnCloseHandler = std::move(m_fnCloseHandler);
+				m_fnCloseHandler = nullptr;
+				fnCloseHandler();
+			}
+		}
+
+		// A stream of this connection, it shares the connection's strand and incoming queue.
+		std::shared_ptr<connection<T>> MakeStream(uint32_t nStream)
+		{
+			auto pStream = std::make_shared<connection<T>>(m_nOwnerType, m_asioContext,
+				asio::ip::tcp::socket(m_socket.get_executor()), m_qMessagesIn);
+			pStream->m_pParent = this->shared_from_this();
+			pStream->m_bStream = true;
+			pStream->m_bStreamOpen = true;
+			pStream->m_nStreamId = nStream;
+			return pStream;
+		}
+
+		// Takes the stream off this connection. Runs on the connection's strand.
+		std::shared_ptr<connection<T>> DropStream(uint32_t nStream)
+		{
+			auto it = m_mapStreams.find(nStream);
+			if (it == m_mapStreams.end())
+				return nullptr;
+
+			auto pStream = std::move(it->second);
+			m_mapStreams.erase(it);
+			for (auto& deqTurns : m_deqStreamTurns)
+				deqTurns.erase(std::remove(deqTurns.begin(), deqTurns.end(), pStream), deqTurns.end());
+			return pStream;
+		}
+
+		// A stream was closed on this end, the peer is told. Runs on the connection's strand.
+		void StreamClosed(uint32_t nStream)
+		{
+			if (!DropStream(nStream) || m_bGoodbyeSent || !m_socket.is_open())
+				return;
+
+			sMessage<T> close;
+			close << nStream;
+			SendControl(close, eControl::streamClose);
+		}
+
+		// Gives the stream a turn on every lane it has messages on, as long as its window is open.
+		void ScheduleStream(const std::shared_ptr<connection<T>>& pStream)
+		{
+			if (pStream->m_nSendWindow == 0)
+				return;
+
+			for (size_t nLane = 0; nLane < m_deqStreamTurns.size(); nLane++)
+			{
+				if (!pStream->m_bStreamTurn[nLane] && !pStream->m_qMessagesOut[nLane].empty())
+				{
+					pStream->m_bStreamTurn[nLane] = true;
+					m_deqStreamTurns[nLane].push_back(pStream);
+				}
+			}
+			StartWriting();
+		}
+
+		// Whose frame goes out next on the lane: the connection's own messages and the streams take turns.
+		// Returns the stream, or nullptr for the connection's own messages.
+		std::shared_ptr<connection<T>> TakeTurn(size_t nLane)
+		{
+			bool bOwn = !m_qMessagesOut[nLane].empty() && !WindowBlocks(nLane);
+			bool bStreams = !m_bSessionPending && !m_deqStreamTurns[nLane].empty();
+			if (bOwn && (!bStreams || !m_bStreamTurnNext[nLane]))
+			{
+				m_bStreamTurnNext[nLane] = true;
+				return nullptr;
+			}
+
+			m_bStreamTurnNext[nLane] = false;
+			auto pStream = std::move(m_deqStreamTurns[nLane].front());
+			m_deqStreamTurns[nLane].pop_front();
+			pStream->m_bStreamTurn[nLane] = false;
+			return pStream;
+		}
+
+		// The stream handled messages of nBytes. Once enough came together, the peer gets them back for its window.
+		// Runs on the connection's strand.
+		void StreamConsumed(size_t nBytes)
+		{
+			m_nCreditOwed += nBytes;
+			if (m_nCreditOwed < nStreamWindow / 4)
+				return;
+
+			auto pParent = m_pParent.lock();
+			if (pParent && m_bStreamOpen)
+			{
+				m_nReceiveWindow += m_nCreditOwed;
+				sMessage<T> update;
+				update << m_nStreamId << static_cast<uint32_t>(m_nCreditOwed);
+				pParent->SendControl(update, eControl::streamWindow);
+			}
+			m_nCreditOwed = 0;
+		}
+
+		// Are messages left on any lane?
+		bool HasQueued()
+		{
+			return std::any_of(m_qMessagesOut.begin(), m_qMessagesOut.end(), [](auto& qLane) { return !qLane.empty(); });
+		}
+
+		// A message of nBytes was handled, the peer gets it back for its window with the next write. If no write comes
+		// along, the window update goes out on its own once half the window waits for it, or all of a window of one.
+		// Called from any thread.
+		void Credit(size_t nBytes)
+		{
+			size_t nWindowBytes = m_nWindowBytes;
+			uint32_t nWindowMessages = m_nWindowMessages;
+			if (nWindowBytes == 0)
+				return;
+
+			size_t nBytesDue = std::max<size_t>(1, nWindowBytes / 2);
+			uint32_t nMessagesDue = std::max<uint32_t>(1, nWindowMessages / 2);
+			size_t nOwedBytes = m_nCreditBytes.fetch_add(nBytes) + nBytes;
+			uint32_t nOwedMessages = m_nCreditMessages.fetch_add(1) + 1;
+			if ((nOwedBytes >= nBytesDue && nOwedBytes - nBytes < nBytesDue)
+				|| (nOwedMessages >= nMessagesDue && nOwedMessages - 1 < nMessagesDue))
+			{
+				asio::post(m_socket.get_executor(), [this]() { FlushCredit(); });
+			}
+		}
+
+		// Sends the window handed back since the last update, if any. Runs on the connection's strand.
+		void FlushCredit()
+		{
+			uint32_t nBytes = static_cast<uint32_t>(m_nCreditBytes.exchange(0));
+			uint32_t nMessages = m_nCreditMessages.exchange(0);
+			if ((nBytes > 0 || nMessages > 0) && !m_bGoodbyeSent && m_socket.is_open())
+			{
+				sMessage<T> update;
+				update << nBytes << nMessages;
+				SendControl(update, eControl::window);
+			}
+		}
+
+		// The front message of the lane waits for the peer's window, or for the back-off the peer asked for. A message
+		// that started going out is finished, and control frames never wait.
+		bool WindowBlocks(size_t nLane)
+		{
+			auto& qLane = m_qMessagesOut[nLane];
+			if (qLane.empty() || m_nOutOffset[nLane] > 0 || (qLane.front()->header.flags & frame::control))
+				return false;
+
+			return !CanSend() || nLane >= m_nBackOffLane;
+		}
+
+		bool WindowHolds()
+		{
+			for (size_t nLane = 0; nLane < m_qMessagesOut.size(); nLane++)
+			{
+				if (WindowBlocks(nLane))
+					return true;
+			}
+			return false;
+		}
+
+		// Puts a frame read for a stream together with the ones before it, and delivers the message once it is complete.
+		// Frames of streams closed in the meantime are dropped.
+		void ReceiveStreamFrame()
+		{
+			auto it = m_mapStreams.find(m_msgTemporaryIn.header.stream);
+			if (it == m_mapStreams.end())
+				return;
+
+			auto pStream = it->second;
+			pStream->m_nReceiveWindow -= m_msgTemporaryIn.header.size;
+			size_t nLane = (m_msgTemporaryIn.header.flags & frame::laneMask) >> frame::laneShift;
+			if (!Reassemble(pStream->m_msgPartialIn[nLane]))
+				return;
+
+			// Messages that wait for Update() give the bytes back once handled, all others right away.
+			size_t nBody = m_msgTemporaryIn.body.size();
+			if (!pStream->Dispatch(m_msgTemporaryIn, nBody))
+				pStream->StreamConsumed(nBody);
+		}
+
+		// Charges a frame from the peer to the rate limits. Control frames are free.
+		void ChargeRateLimit(const sMessageHeader<T>& header)
+		{
+			if (header.flags & frame::control)
+				return;
+
+			m_bucketBytes.Consume(header.size);
+			if (!(header.flags & frame::more))
+				m_bucketMessages.Consume(1);
+		}
+
+		// Largest body accepted for messages with this id.
+		size_t MaxBodySize(T msgId) const
+		{
+			auto it = m_mapMaxBodySizes.find(msgId);
+			return it != m_mapMaxBodySizes.end() ? it->second : m_nMaxBodySize;
+		}
+
+		// Largest body accepted for the message the header starts, with room for the trailer of a snapshot.
+		size_t MaxBodySize(const sMessageHeader<T>& header) const
+		{
+			return MaxBodySize(header.id) + ((header.flags & frame::snapshot) ? snapshot::nTrailer : 0);
+		}
+
+		// Checks a frame header before anything is allocated for its body. The peer is not trusted,
+		// so everything the header claims is compared with the limits set for this connection.
+		bool ValidateHeader(const sMessageHeader<T>& header) const
+		{
+			// Frames of a stream are checked against the limits of the stream, and must fit its window.
+			if (header.stream != 0)
+			{
+				if (!m_bStreams || (header.flags & (frame::control | frame::compressed)))
+					return false;
+
+				auto it = m_mapStreams.find(header.stream);
+				if (it == m_mapStreams.end())
+					return header.size <= m_nMaxBodySize;
+				return header.size <= it->second->m_nReceiveWindow && it->second->ValidateFrame(header);
+			}
+			return ValidateFrame(header);
+		}
+
+		// Checks a frame against the limits of this connection.
+		bool ValidateFrame(const sMessageHeader<T>& header) const
+		{
+			size_t nLane = (header.flags & frame::laneMask) >> frame::laneShift;
+			const sMessage<T>& msgPartial = m_msgPartialIn[nLane];
+			size_t nBody = msgPartial.body.size() + header.size;
+
+			// Fragments of one message keep the id of the first one.
+			if (!msgPartial.body.empty() && header.id != msgPartial.header.id)
+				return false;
+
+			if (header.flags & frame::control)
+				return nBody <= m_nMaxBodySize;
+
+			if (m_bCheckIdRange && (header.id < m_idFirst || m_idLast < header.id))
+				return false;
+
+			if (nBody > MaxBodySize(header))
+				return false;
+
+			if ((header.flags & frame::snapshot)
+				&& m_mapSnapshotsIn.count(header.correlation) == 0 && m_mapSnapshotsIn.size() >= m_nMaxSnapshotStreams)
+			{
+				return false;
+			}
+
+			if ((header.flags & frame::compressed) && !m_lzIn[nLane])
+				return false;
+
+			if (m_nOwnerType == owner::server && m_nBytesInFlight + nBody > m_nInFlightBudget)
+				return false;
+
+			return true;
+		}
+
+		// Completes an outstanding request with the response or an error, unless it has already completed.
+		void CompleteRequest(uint32_t nCorrelation, std::error_code ec, sMessage<T> response)
+		{
+			auto it = m_mapPendingRequests.find(nCorrelation);
+			if (it == m_mapPendingRequests.end())
+				return;
+
+			auto pHandler = std::move(it->second.pHandler);
+			it->second.pTimer->cancel();
+			m_mapPendingRequests.erase(it);
+
+			pHandler->Complete(ec, std::move(response), m_socket.get_executor());
+		}
+
+		// Fails all outstanding requests, once the connection is gone no response can arrive any more.
+		void FailPendingRequests()
+		{
+			while (!m_mapPendingRequests.empty())
+				CompleteRequest(m_mapPendingRequests.begin()->first, asio::error::connection_aborted, {});
+		}
+
+		// Tries the endpoints in turn, starting with it. The socket is opened and gets its options before it connects,
+		// the buffer sizes only count for the window the connection is set up with then.
+		void ConnectToEndpoint(asio::ip::tcp::resolver::results_type endpoints, asio::ip::tcp::resolver::results_type::iterator it)
+		{
+			std::error_code ec;
+			m_socket.close(ec);
+			m_socket.open(it->endpoint().protocol(), ec);
+			if (!ec)
+				socket_options::Apply(m_socket, m_socketOptions);
+
+			m_socket.async_connect(it->endpoint(),
+				[this, endpoints, it](std::error_code ec)
+				{
+					// Closing the socket while connecting stops here as well.
+					if (ec && m_socket.is_open() && std::next(it) != endpoints.end())
+					{
+						ConnectToEndpoint(endpoints, std::next(it));
+						return;
+					}
+
+					m_bConnecting = false;
+					if (!ec)
+					{
+						if (m_pSession)
+						{
+							sMessage<T> request;
+							request << m_pSession->GetToken() << m_pSession->ReceivedCount() << m_pSession->ReplayFrom();
+							SendControl(request, eControl::sessionRequest);
+						}
+						ReadHeader();
+						StartWriting();
+						if (m_bClosing && !m_bWritingMessage)
+							OnDrained();
+					}
+					// No endpoint left to try, the socket is closed so the connection counts as down.
+					else if (m_socket.is_open())
+					{
+						static log::rate_limit limit(nErrorLinesPerSecond);
+						log::WriteLimited<log::eLevel::error>(limit, "[", id, "] Connect fail: ", ec);
+						Close();
+					}
+				});
+		}
+
+		// Starts assynchronously reading a Header of a first message in temporary message in queue, if the body of message
+		// is bigger than 0, we start reading the body. Otherwise we register another job to read header of the next message.
+		// nOffset is how much of the header is already there, when resuming a connection taken over from another process.
+		void ReadHeader(size_t nOffset = 0)
+		{
+			// Detaching with nothing left to write, so we stop right here.
+			if (m_fnDetached && !m_bWritingMessage)
+			{
+				OnReadDetached(false, nOffset);
+				return;
+			}
+
+			// Over the rate limit, the next header is read once the buckets are out of debt.
+			auto delay = std::max(m_bucketMessages.Delay(), m_bucketBytes.Delay());
+			if (nOffset == 0 && delay > std::chrono::steady_clock::duration::zero())
+			{
+				m_timerRead.expires_after(delay);
+				m_timerRead.async_wait(
+					[this](std::error_code ec)
+					{
+						if (m_fnDetached && ec == asio::error::operation_aborted)
+							OnReadDetached(false, 0);
+						else if (!ec && m_socket.is_open())
+							ReadHeader();
+					});
+				return;
+			}
+
+			// Too much waits for Update(), the next header is read once enough of it was handled.
+			if (nOffset == 0 && ParkReading())
+				return;
+
+			if (m_bQuickAck)
+				socket_options::QuickAck(m_socket, true);
+
+			asio::async_read(m_socket, asio::buffer(reinterpret_cast<uint8_t*>(&m_msgTemporaryIn.header) + nOffset, sizeof(sMessageHeader<T>) - nOffset),
+				[this, nOffset](std::error_code ec, std::size_t length)
+				{
+					if (m_fnDetached && ec == asio::error::operation_aborted)
+					{
+						OnReadDetached(false, nOffset + length);
+					}
+					else if (!ec)
+					{
+						if (!ValidateHeader(m_msgTemporaryIn.header))
+						{
+							FailRead("Invalid header!");
+							return;
+						}
+
+						ChargeRateLimit(m_msgTemporaryIn.header);
+
+						m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
+
+						if (m_msgTemporaryIn.header.size > 0)
+						{
+							ReadBody();
+						}
+						// if it has no body...
+						else
+						{
+							AddToIncomingMessageQueue();
+						}
+					}
+					else
+					{
+						FailRead("Read header fail!");
+					}
+				});
+		}
+
+		// Starts asynchronously reading a body. We just add it to message queue.
+		void ReadBody(size_t nOffset = 0)
+		{
+			if (m_fnDetached && !m_bWritingMessage)
+			{
+				OnReadDetached(true, nOffset);
+				return;
+			}
+
+			asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data() + nOffset, m_msgTemporaryIn.body.size() - nOffset),
+				[this, nOffset](std::error_code ec, std::size_t length)
+				{
+					if (m_fnDetached && ec == asio::error::operation_aborted)
+					{
+						OnReadDetached(true, nOffset + length);
+					}
+					else if (!ec)
+					{
+						AddToIncomingMessageQueue();
+					}
+					else
+					{
+						FailRead("Read body fail!");
+					}
+				});
+		}
+
+		// Nothing is left to write while detaching, so the pending read is cancelled. Its handler gets the bytes read so far.
+		void StopReadingForDetach()
+		{
+			std::error_code ec;
+			m_socket.cancel(ec);
+			m_timerRead.cancel();
+			m_timerBackOff.cancel();
+			if (std::exchange(m_bReadParked, false))
+				OnReadDetached(false, 0);
+		}
+
+		// Parks reading if a watermark is over its high mark, see UseWatermarks(). Returns false if reading goes on.
+		bool ParkReading()
+		{
+			if (!m_pReadMarks && !m_pSharedMarks)
+				return false;
+
+			// A connection that goes away while parked is not kept alive by the watermark.
+			auto fnResume = [pWeakSelf = std::weak_ptr<connection<T>>(this->shared_from_this())]()
+			{
+				auto pSelf = pWeakSelf.lock();
+				if (!pSelf)
+					return;
+
+				asio::post(pSelf->m_socket.get_executor(),
+					[pSelf]()
+					{
+						if (std::exchange(pSelf->m_bReadParked, false) && pSelf->m_socket.is_open())
+							pSelf->ReadHeader();
+					});
+			};
+			m_bReadParked = (m_pReadMarks && m_pReadMarks->Park(fnResume)) || (m_pSharedMarks && m_pSharedMarks->Park(fnResume));
+			return m_bReadParked;
+		}
+
+		// Reading stopped for a detach, nRead bytes of the header or body were read. Packs up the read state
+		// and releases the socket to the detach handler.
+		void OnReadDetached(bool bReadingBody, size_t nRead)
+		{
+			std::vector<uint8_t> state;
+			auto Write = [&state](const void* pData, size_t nSize)
+			{
+				const uint8_t* pBytes = static_cast<const uint8_t*>(pData);
+				state.insert(state.end(), pBytes, pBytes + nSize);
+			};
+			auto WriteMessage = [&Write](const sMessage<T>& message)
+			{
+				uint32_t nSize = static_cast<uint32_t>(message.body.size());
+				Write(&message.header, sizeof(sMessageHeader<T>));
+				Write(&nSize, sizeof(nSize));
+				Write(message.body.data(), nSize);
+			};
+
+			uint8_t nReadingBody = bReadingBody ? 1 : 0;
+			uint32_t nReadDone = static_cast<uint32_t>(nRead);
+			Write(&nReadingBody, sizeof(nReadingBody));
+			Write(&nReadDone, sizeof(nReadDone));
+			WriteMessage(m_msgTemporaryIn);
+			for (const auto& msgPartial : m_msgPartialIn)
+				WriteMessage(msgPartial);
+
+			std::error_code ec;
+			auto nativeHandle = m_socket.release(ec);
+
+			FailPendingRequests();
+			m_timerReceive.cancel();
+
+			auto fnHandler = std::move(m_fnDetached);
+			m_fnDetached = nullptr;
+			fnHandler(ec, nativeHandle, std::move(state));
+		}
+
+		// Sends a control frame on the highest priority lane. Runs on the connection's strand.
+		void SendControl(sMessage<T>& message, eControl op)
+		{
+			message << op;
+			message.header.flags = frame::control;
+			QueueMessage(std::make_shared<const sMessage<T>>(std::move(message)), ePriority::control);
+		}
+
+		// Handles a control frame received from the peer. Returns false if the connection has to be dropped.
+		bool HandleControl(sMessage<T>& message)
+		{
+			eControl op;
+			message >> op;
+
+			switch (op)
+			{
+			case eControl::compressionOffer:
+			{
+				uint32_t nDictionaryHash;
+				eCompression codec;
+				message >> nDictionaryHash >> codec;
+
+				sMessage<T> reply;
+				if (codec == eCompression::lz && nDictionaryHash == DictionaryHash(m_vecDictionary))
+				{
+					for (auto& context : m_lzIn)
+					{
+						context = std::make_unique<lz_context>();
+						context->Reset(m_vecDictionary);
+					}
+					reply << codec;
+					SendControl(reply, eControl::compressionAccept);
+				}
+				else
+				{
+					SendControl(reply, eControl::compressionDecline);
+				}
+				return true;
+			}
+			case eControl::compressionAccept:
+			{
+				eCompression codec;
+				message >> codec;
+
+				// Only the answer to our offer counts.
+				if (codec != m_compressionOffered)
+					return true;
+				m_compressionOffered = eCompression::none;
+
+				for (auto& context : m_lzOut)
+				{
+					context = std::make_unique<lz_context>();
+					context->Reset(m_vecDictionary);
+				}
+				m_compressionOut = codec;
+				return true;
+			}
+			case eControl::compressionDecline:
+				m_compressionOffered = eCompression::none;
+				return true;
+			case eControl::goodbye:
+				Close();
+				return true;
+			case eControl::sessionRequest:
+			{
+				uint64_t nToken, nPeerReceived, nPeerReplayFrom;
+				message >> nPeerReplayFrom >> nPeerReceived >> nToken;
+
+				if (!m_fnFindSession || !m_bSessionPending)
+					return false;
+
+				// Resumes only if both ends still have everything the other one missed.
+				std::vector<std::shared_ptr<const sMessage<T>>> vecReplay;
+				auto pSession = nToken != 0 ? m_fnFindSession(nToken) : nullptr;
+				bool bResumed = pSession && pSession->ReceivedCount() >= nPeerReplayFrom
+					&& pSession->Resume(this, nPeerReceived, vecReplay);
+				if (!bResumed)
+				{
+					pSession = m_fnFindSession(0);
+					pSession->Reset(this, pSession->GetToken());
+				}
+				m_pSession = pSession;
+
+				sMessage<T> accept;
+				accept << m_pSession->GetToken() << m_pSession->ReceivedCount() << static_cast<uint8_t>(bResumed);
+				SendControl(accept, eControl::sessionAccept);
+				Replay(vecReplay);
+				return true;
+			}
+			case eControl::sessionAccept:
+			{
+				uint8_t bResumed;
+				uint64_t nToken, nPeerReceived;
+				message >> bResumed >> nPeerReceived >> nToken;
+
+				if (!m_pSession || !m_bSessionPending)
+					return false;
+
+				std::vector<std::shared_ptr<const sMessage<T>>> vecReplay;
+				if (!bResumed)
+					m_pSession->Reset(this, nToken);
+				else if (!m_pSession->Resume(this, nPeerReceived, vecReplay))
+					return false;
+
+				Replay(vecReplay);
+				if (m_fnSessionHandler)
+					m_fnSessionHandler(bResumed != 0);
+				return true;
+			}
+			case eControl::ack:
+			{
+				uint64_t nCount;
+				message >> nCount;
+				if (m_pSession)
+					m_pSession->Acked(this, nCount);
+				return true;
+			}
+			case eControl::snapshotAck:
+			{
+				uint32_t nSequence;
+				message >> nSequence;
+
+				auto it = m_mapSnapshotsOut.find(message.header.correlation);
+				if (it == m_mapSnapshotsOut.end())
+					return true;
+
+				auto& stream = it->second;
+				if (nSequence == 0)
+				{
+					stream.nAcked = 0;
+				}
+				else if (nSequence > stream.nAcked)
+				{
+					stream.nAcked = nSequence;
+					while (!stream.deqSent.empty() && stream.deqSent.front().first < nSequence)
+						stream.deqSent.pop_front();
+				}
+				return true;
+			}
+			case eControl::cluster:
+			{
+				// Only links take batches, a client sending one breaks the protocol.
+				if (!m_fnLinkHandler)
+					return false;
+
+				m_fnLinkHandler(message.body);
+				return true;
+			}
+			case eControl::streamOpen:
+			{
+				uint32_t nStream;
+				message >> nStream;
+
+				// Only connections that take streams from the peer, and streams the peer can number.
+				if (!m_fnStreamAccept || nStream == 0 || (nStream % 2 == 1) != (m_nOwnerType == owner::server)
+					|| m_mapStreams.count(nStream) > 0)
+				{
+					return false;
+				}
+
+				auto pStream = MakeStream(nStream);
+				m_mapStreams[nStream] = pStream;
+				if (!m_fnStreamAccept(pStream))
+					pStream->Close();
+				return true;
+			}
+			case eControl::streamWindow:
+			{
+				uint32_t nStream, nBytes;
+				message >> nBytes >> nStream;
+				if (!m_bStreams)
+					return false;
+
+				auto it = m_mapStreams.find(nStream);
+				if (it != m_mapStreams.end())
+				{
+					it->second->m_nSendWindow += nBytes;
+					ScheduleStream(it->second);
+				}
+				return true;
+			}
+			case eControl::streamClose:
+			{
+				uint32_t nStream;
+				message >> nStream;
+				if (!m_bStreams)
+					return false;
+
+				if (auto pStream = DropStream(nStream))
+					pStream->Close();
+				return true;
+			}
+			case eControl::window:
+			{
+				uint32_t nBytes, nMessages;
+				message >> nMessages >> nBytes;
+
+				// Nothing held back before the peer's first window, it starts from what it grants.
+				if (!m_bPeerWindow)
+				{
+					m_bPeerWindow = true;
+					m_nPeerWindowBytes = 0;
+					m_nPeerWindowMessages = 0;
+				}
+				m_nPeerWindowBytes += nBytes;
+				m_nPeerWindowMessages += nMessages;
+				StartWriting();
+				return true;
+			}
+			case eControl::backOff:
+			{
+				uint32_t nMilliseconds;
+				uint8_t nLane;
+				message >> nLane >> nMilliseconds;
+
+				// A later back-off replaces the one still running.
+				m_nBackOffLane = std::min<size_t>(nLane, m_qMessagesOut.size());
+				m_timerBackOff.expires_after(std::chrono::milliseconds(nMilliseconds));
+				m_timerBackOff.async_wait(
+					[this](std::error_code ec)
+					{
+						if (ec)
+							return;
+						m_nBackOffLane = m_qMessagesOut.size();
+						StartWriting();
+					});
+				return true;
+			}
 			}
+			return false;
 		}
 
-		// Called from the client on a connection.
-		// Sends a async connect request with this socket, that gets picked up by the server's acceptor.
-		// It then primes this socket's context to start reading possible incoming messages from the server.
-		bool ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints)
+		// The session handshake is done. Messages the peer missed go out first, in their original order, on the
+		// control lane so nothing overtakes them. Then the lanes held back during the handshake are written.
+		void Replay(const std::vector<std::shared_ptr<const sMessage<T>>>& vecReplay)
+		{
+			m_bSessionPending = false;
+			for (const auto& pMessage : vecReplay)
+				QueueMessage(pMessage, ePriority::control);
+
+			StartWriting();
+		}
+
+		// Puts the message on its lane and kicks off writing if the connection is idle. Runs on the connection's strand.
+		void QueueMessage(const std::shared_ptr<const sMessage<T>>& pMessage, ePriority priority)
 		{
-			if (m_nOwnerType == owner::client)
+			// Control frames of a stream stop here, the features built on them work on the connection itself only.
+			if (m_bStream)
 			{
-				asio::async_connect(m_socket, endpoints,
-					[this](std::error_code ec, asio::ip::tcp::endpoint endpoint)
+				if (!m_bStreamOpen || m_bClosing || (pMessage->header.flags & frame::control))
+					return;
+			}
+			else if (m_bGoodbyeSent || !m_socket.is_open())
+			{
+				return;
+			}
+
+			auto& qLane = m_qMessagesOut[static_cast<size_t>(priority)];
+
+			// A replaceable message overwrites its unsent predecessor with the same id. The front one
+			// may already be partially written, so it is skipped. Requests, responses and control frames
+			// each stand for something of their own and are never replaced, nor do they replace anything.
+			// Nor are the messages of a stream charged to send marks, which would miss the one replaced.
+			if (IsReplaceable(*pMessage) && !m_pSendMarks)
+			{
+				if (qLane.replace_if(
+					[this, &pMessage](const std::shared_ptr<const sMessage<T>>& pQueued)
 					{
-						if (!ec)
-						{
-							ReadHeader();
-						}
-					});
+						return pQueued->header.id == pMessage->header.id && IsReplaceable(*pQueued);
+					},
+					pMessage, 1))
+				{
+					return;
+				}
 			}
-		}
+			qLane.push_back(pMessage);
 
-		bool Disconnect()
-		{
-			if (IsConnected())
+			// The frames of a stream are written by its connection.
+			if (m_bStream)
 			{
-				asio::post(m_asioContext, [this]() { m_socket.close(); });
+				if (m_pSendMarks)
+				{
+					m_nSendMarked += pMessage->body.size();
+					m_pSendMarks->Add(pMessage->body.size());
+				}
+				if (auto pParent = m_pParent.lock())
+					pParent->ScheduleStream(this->shared_from_this());
+				return;
 			}
+			StartWriting();
 		}
 
-		bool IsConnected() const
+		// Bytes queued on this stream were written or dropped, see UseSendMarks(). Runs on the connection's strand.
+		void ReleaseSendMarks(size_t nBytes)
 		{
-			if (m_socket)
-				return m_socket.is_open();
-			else
-				return false;
+			if (!m_pSendMarks || nBytes == 0)
+				return;
+			m_nSendMarked -= nBytes;
+			m_pSendMarks->Release(nBytes);
 		}
 
-		uint32_t GetId() const
+		// May the message be coalesced, see SetReplaceable()? Runs on the connection's strand.
+		bool IsReplaceable(const sMessage<T>& message) const
 		{
-			return id;
+			return !(message.header.flags & (frame::control | frame::request | frame::response | frame::snapshot))
+				&& m_setReplaceableIds.count(message.header.id) > 0;
 		}
 
-	public:
-		// Posts a function to the context that checks, if we are currently already writing and sending a message,
-		// and if not, it starts writing and sending it. Otherwise it saves it for later.
-		void Send(const sMessage<T>& message)
+		// Returns the highest priority lane with messages waiting, its own or of a stream, or ePriority::count if all are empty.
+		// During the session handshake only the control lane is written, and nothing before the connection is established.
+		// Lanes whose front message waits for the peer's window are passed over.
+		size_t NextLane()
 		{
-			asio::post(m_asioContext,
-				[this, message]()
-				{
-					bool bWritingMessage = !m_qMessagesOut.empty();
-					m_qMessagesOut.push_back(message);
-					if (!bWritingMessage)
-					{
-						WriteHeader();
-					}
-				});
+			if (m_bConnecting)
+				return m_qMessagesOut.size();
+
+			for (size_t nLane = 0; nLane < m_qMessagesOut.size(); nLane++)
+			{
+				if (m_bSessionPending && nLane != static_cast<size_t>(ePriority::control))
+					break;
+
+				if ((!m_qMessagesOut[nLane].empty() && !WindowBlocks(nLane)) || (!m_bSessionPending && !m_deqStreamTurns[nLane].empty()))
+					return nLane;
+			}
+			return m_qMessagesOut.size();
 		}
 
-	private:
-		// Starts assynchronously reading a Header of a first message in temporary message in queue, if the body of message
-		// is bigger than 0, we start reading the body. Otherwise we register another job to read header of the next message.
-		void ReadHeader()
+		// Kicks off writing if the connection is idle and a lane may be written.
+		void StartWriting()
 		{
-			asio::async_read(m_socket, asio::buffer(&m_msgTemporaryIn.header, sizeof(sMessageHeader<T>)),
-				[this](std::error_code ec, std::size_t length)
+			if (!m_bStream && !m_bWritingMessage && !m_bBatching && NextLane() < m_qMessagesOut.size())
+			{
+				WriteFrames();
+			}
+		}
+
+		// Starts assynchronously writing the frames waiting on the lanes, gathered into a single write of up to
+		// m_nMaxWriteBytes. Every frame comes from the highest priority lane with messages at that point. Bodies larger
+		// than the chunk size are sent as several frames, continuing where the previous fragment of that lane ended.
+		void WriteFrames()
+		{
+			m_bWritingMessage = true;
+			m_vecHeadersOut.clear();
+			m_vecBuffersOut.clear();
+
+			// Window handed back so far goes out with this write.
+			if (m_nCreditBytes > 0 || m_nCreditMessages > 0)
+				FlushCredit();
+
+			auto tNow = std::chrono::steady_clock::now();
+			size_t nBytes = 0;
+			while (m_vecHeadersOut.size() < nMaxFramesPerWrite && (m_vecHeadersOut.empty() || nBytes < m_nMaxWriteBytes))
+			{
+				size_t nLane = NextLane();
+				if (nLane == m_qMessagesOut.size())
+					break;
+
+				// The connection's own messages and its streams take turns, a frame each.
+				std::shared_ptr<connection<T>> pStream = TakeTurn(nLane);
+				connection<T>& source = pStream ? *pStream : *this;
+				std::shared_ptr<const sMessage<T>> pMessage = source.m_qMessagesOut[nLane].front();
+				size_t& nOffset = source.m_nOutOffset[nLane];
+
+				// A message that waited past its deadline is dropped, unless it already started going out.
+				if (nOffset == 0 && !(pMessage->header.flags & frame::control) && pMessage->Expired(tNow))
 				{
-					if (!ec)
+					source.m_qMessagesOut[nLane].pop_front();
+					m_nExpiredOut++;
+					if (pStream)
 					{
-						if (m_msgTemporaryIn.header.size > 0)
-						{
-							m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size);
-							ReadBody();
-						}
-						// if it has no body...
+						pStream->ReleaseSendMarks(pMessage->body.size());
+						if (pStream->m_bClosing && !pStream->HasQueued())
+							pStream->Close();
 						else
-						{
-							AddToIncomingMessageQueue();
-						}
-					}
-					else
-					{
-						std::cout << " Read header fail!\n";
-						m_socket.close();
+							ScheduleStream(pStream);
 					}
-				});
-		}
+					continue;
+				}
 
-		// Starts asynchronously reading a body. We just add it to message queue.
-		void ReadBody()
-		{
-			asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
-				[this](std::error_code ec, std::size_t length)
+				// Bodies are compressed when the message starts going out, so coalescing can still replace it until then.
+				// Messages of streams are not compressed.
+				if (nOffset == 0 && !pStream)
 				{
-					if (!ec)
+					m_pCompressedOut[nLane] = nullptr;
+					if (m_compressionOut != eCompression::none
+						&& !(pMessage->header.flags & frame::control) && pMessage->body.size() > m_nCompressionThreshold)
 					{
-						AddToIncomingMessageQueue();
+						auto pCompressed = std::make_shared<std::vector<uint8_t>>();
+						m_lzOut[nLane]->Compress(pMessage->body, *pCompressed);
+						m_nCompressedFrom += pMessage->body.size();
+						m_nCompressedTo += pCompressed->size();
+						m_pCompressedOut[nLane] = std::move(pCompressed);
 					}
-					else
+				}
+
+				auto pCompressed = pStream ? nullptr : m_pCompressedOut[nLane];
+				const std::vector<uint8_t>& body = pCompressed ? *pCompressed : pMessage->body;
+				size_t nChunk = std::min<size_t>(body.size() - nOffset, m_nChunkSize);
+
+				// A stream sends no more than its window lets it.
+				if (pStream)
+				{
+					nChunk = std::min(nChunk, pStream->m_nSendWindow);
+					pStream->m_nSendWindow -= nChunk;
+				}
+
+				sMessageHeader<T> header = pMessage->header;
+				header.size = static_cast<uint16_t>(nChunk);
+				header.flags = (pMessage->header.flags & ~(frame::more | frame::laneMask | frame::compressed | frame::windowed))
+					| (static_cast<uint16_t>(nLane << frame::laneShift) & frame::laneMask);
+				header.stream = pStream ? pStream->m_nStreamId : 0;
+				if (pCompressed)
+					header.flags |= frame::compressed;
+				if (nOffset + nChunk < body.size())
+					header.flags |= frame::more;
+
+				// The connection's window is charged a message at a time, by the body as the peer handles it. The last
+				// message may go over what was left, the window stays closed then until the peer handled enough.
+				if (!pStream && m_bPeerWindow && !(pMessage->header.flags & frame::control))
+				{
+					if (nOffset == 0)
 					{
-						std::cout << " Read body fail!\n";
-						m_socket.close();
+						m_nPeerWindowBytes -= static_cast<int64_t>(pMessage->body.size());
+						m_nPeerWindowMessages--;
 					}
-				});
-		}
+					header.flags |= frame::windowed;
+				}
 
-		// Starts assynchronously writing a Header of a first message in temporary message out queue, if the body of message
-		// is bigger than 0, we start writing a body. Otherwise we register another job to write header of the next message.
-		void WriteHeader()
-		{
-			asio::async_write(m_socket, asio::buffer(&m_qMessagesOut.front().header, sizeof(sMessageHeader<T>)),
-				[this](std::error_code ec, std::size_t length)
+				// Room for all headers is reserved, so the buffers pointing at them stay valid.
+				m_vecHeadersOut.push_back(header);
+				m_vecBuffersOut.push_back(asio::buffer(&m_vecHeadersOut.back(), sizeof(sMessageHeader<T>)));
+				if (nChunk > 0)
+					m_vecBuffersOut.push_back(asio::buffer(body.data() + nOffset, nChunk));
+				nBytes += sizeof(sMessageHeader<T>) + nChunk;
+
+				// Whatever the buffers point into is kept until the write is done.
+				m_vecKeepOut.push_back(pMessage);
+				if (pCompressed)
+					m_vecKeepOut.push_back(pCompressed);
+
+				nOffset += nChunk;
+				if (pStream)
 				{
-					if (!ec)
+					// Messages of a stream are done with here, sessions and captures are about the connection itself.
+					if (!(header.flags & frame::more))
 					{
-						if (m_qMessagesOut.front().body.size() > 0)
-						{
-							WriteBody();
-						}
-						else
-						{
-							m_qMessagesOut.pop_front();
-
-							if (!m_qMessagesOut.empty())
-							{
-								WriteHeader();
-							}
-						}
+						pStream->m_qMessagesOut[nLane].pop_front();
+						pStream->ReleaseSendMarks(pMessage->body.size());
+						nOffset = 0;
 					}
+
+					// Back in line for the next turn, or closed if it was waiting to get everything out.
+					if (pStream->m_bClosing && !pStream->HasQueued())
+						pStream->Close();
 					else
-					{
-						std::cout << " Write Header fail!\n";
-						m_socket.close();
-					}
+						ScheduleStream(pStream);
+				}
+				else if (!(header.flags & frame::more))
+				{
+					// A message is taken off its lane once its last fragment is in a write.
+					m_vecCompletedOut.emplace_back(nBytes, pMessage);
+					m_qMessagesOut[nLane].pop_front();
+					nOffset = 0;
+					m_pCompressedOut[nLane] = nullptr;
+				}
+			}
+
+			asio::async_write(m_socket, m_vecBuffersOut,
+				[this](std::error_code ec, std::size_t length)
+				{
+					OnFramesWritten(ec, length);
 				});
 		}
-		// Starts asynchronously writing a body. If the Message out queue is not empty after the body is sent, we
-		// register another WriteHeader() to start writing messages left.
-		void WriteBody()
+
+		// Finishes a write of nLength bytes. Messages that went out completely count as sent for the session.
+		// If any lane still has messages, we register another WriteFrames() to write the next frames.
+		void OnFramesWritten(std::error_code ec, size_t nLength)
 		{
-			asio::async_write(m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().body.size()),
-				[this](std::error_code ec, std::size_t length)
+			m_vecKeepOut.clear();
+
+			size_t nSent = 0;
+			while (nSent < m_vecCompletedOut.size() && m_vecCompletedOut[nSent].first <= nLength)
+				nSent++;
+
+			if (m_pCapture)
+			{
+				for (size_t i = 0; i < nSent; i++)
 				{
-					if (!ec)
-					{
-						m_qMessagesOut.pop_front();
+					const auto& pMessage = m_vecCompletedOut[i].second;
+					if (!(pMessage->header.flags & frame::control))
+						m_pCapture->Record(id, eCaptureDirection::out, *pMessage);
+				}
+			}
 
-						if (!m_qMessagesOut.empty())
-						{
-							WriteHeader();
-						}
-					}
-					else
-					{
-						std::cout << " Write body fail!\n";
-						m_socket.close();
-					}
-				});
+			// Complete messages are kept by the session until the peer acks them.
+			bool bStale = false;
+			if (m_pSession)
+			{
+				for (size_t i = 0; i < nSent && !bStale; i++)
+				{
+					const auto& pMessage = m_vecCompletedOut[i].second;
+					bStale = !(pMessage->header.flags & frame::control) && !m_pSession->Sent(this, pMessage);
+				}
+			}
+			m_vecCompletedOut.erase(m_vecCompletedOut.begin(), m_vecCompletedOut.begin() + nSent);
+
+			if (ec || bStale || !m_socket.is_open())
+			{
+				m_bWritingMessage = false;
+				// Another connection resumed the session, this one is stale.
+				if (bStale)
+				{
+					Close();
+				}
+				else if (ec && m_socket.is_open())
+				{
+					static log::rate_limit limit(nErrorLinesPerSecond);
+					log::WriteLimited<log::eLevel::error>(limit, "[", id, "] Write fail: ", ec);
+					Close();
+				}
+				m_vecCompletedOut.clear();
+				return;
+			}
+
+			if (NextLane() < m_qMessagesOut.size())
+			{
+				WriteFrames();
+			}
+			else
+			{
+				m_bWritingMessage = false;
+				// Messages waiting for the peer's window are written once it grants more.
+				if (WindowHolds())
+					return;
+				if (m_bClosing)
+					OnDrained();
+				else if (m_fnDetached)
+					StopReadingForDetach();
+			}
+		}
+
+		// Everything queued is written while closing gracefully. First the goodbye goes out, once that is written too we close.
+		void OnDrained()
+		{
+			if (!m_bGoodbyeSent)
+			{
+				sMessage<T> goodbye;
+				SendControl(goodbye, eControl::goodbye);
+				m_bGoodbyeSent = true;
+				return;
+			}
+			Close();
 		}
 		// Adds the newly read message to appropriate containers.
+		// Fragments are collected per lane first, and only the complete message is passed on.
 		void AddToIncomingMessageQueue()
 		{
+			// Frames of a stream are put together on the stream, see OpenStream().
+			if (m_msgTemporaryIn.header.stream != 0)
+			{
+				ReceiveStreamFrame();
+				ReadHeader();
+				return;
+			}
+
+			size_t nLane = (m_msgTemporaryIn.header.flags & frame::laneMask) >> frame::laneShift;
+			if (!Reassemble(m_msgPartialIn[nLane]))
+			{
+				ReadHeader();
+				return;
+			}
+
+			if (m_msgTemporaryIn.header.flags & frame::compressed)
+			{
+				std::vector<uint8_t> vecBody;
+				if (!m_lzIn[nLane]->Decompress(m_msgTemporaryIn.body, vecBody, MaxBodySize(m_msgTemporaryIn.header)))
+				{
+					FailRead("Decompression fail!");
+					return;
+				}
+				m_msgTemporaryIn.body = std::move(vecBody);
+				m_msgTemporaryIn.header.size = SizeField(m_msgTemporaryIn.body.size());
+				m_msgTemporaryIn.header.flags &= ~frame::compressed;
+			}
+
+			if (m_msgTemporaryIn.header.flags & frame::control)
+			{
+				if (!HandleControl(m_msgTemporaryIn))
+				{
+					FailRead("Unknown control frame!");
+					return;
+				}
+
+				if (m_socket.is_open())
+					ReadHeader();
+				return;
+			}
+			// Every other message counts towards the session, and every few of them are acked.
+			else if (m_pSession)
+			{
+				uint64_t nAck;
+				if (!m_pSession->Received(this, nAck))
+				{
+					Close();
+					return;
+				}
+				if (nAck > 0)
+				{
+					sMessage<T> ack;
+					ack << nAck;
+					SendControl(ack, eControl::ack);
+				}
+			}
+
+			// Messages that wait for Update() give their window back once handled, all others right away.
+			size_t nBody = m_msgTemporaryIn.body.size();
+			bool bWindowed = m_msgTemporaryIn.header.flags & frame::windowed;
+
+			// A snapshot is delivered carrying the whole state, unless it is dropped for want of its base.
+			bool bDeliver = true;
+			if (m_msgTemporaryIn.header.flags & frame::snapshot)
+			{
+				if (nBody < snapshot::nTrailer)
+				{
+					FailRead("Snapshot fail!");
+					return;
+				}
+				bDeliver = ReceiveSnapshot(m_msgTemporaryIn);
+			}
+
+			if (!(bDeliver && Dispatch(m_msgTemporaryIn, nBody)) && bWindowed)
+				Credit(nBody);
+
+			// Prime the context with the next header to read.
+			ReadHeader();
+		}
+
+		// Adds the frame just read to the fragments collected before it on its lane. Returns true once the message
+		// is complete, it is in m_msgTemporaryIn then.
+		bool Reassemble(sMessage<T>& msgPartial)
+		{
+			if (!(m_msgTemporaryIn.header.flags & frame::more) && msgPartial.body.empty())
+				return true;
+
+			if (msgPartial.body.empty())
+				msgPartial.header = m_msgTemporaryIn.header;
+
+			msgPartial.body.insert(msgPartial.body.end(), m_msgTemporaryIn.body.begin(), m_msgTemporaryIn.body.end());
+
+			if (m_msgTemporaryIn.header.flags & frame::more)
+				return false;
+
+			m_msgTemporaryIn = std::move(msgPartial);
+			m_msgTemporaryIn.header.size = SizeField(m_msgTemporaryIn.body.size());
+			m_msgTemporaryIn.header.flags &= ~frame::more;
+			msgPartial = {};
+			return true;
+		}
+
+		// Gives the message the deadline of its id, if it has an expiry and no deadline yet. Runs on the connection's strand.
+		void StampDeadline(sMessage<T>& message, std::chrono::steady_clock::time_point tNow)
+		{
+			if (m_mapExpiry.empty() || message.deadline != std::chrono::steady_clock::time_point{})
+				return;
+
+			auto it = m_mapExpiry.find(message.header.id);
+			if (it != m_mapExpiry.end())
+				message.deadline = tNow + it->second;
+		}
+
+		// Turns a snapshot from the peer into the message it stands for, with the whole state as its body, and acks it.
+		// Returns false if its base is gone, it is dropped then and the peer sends the next one in full.
+		bool ReceiveSnapshot(sMessage<T>& message)
+		{
+			uint32_t nSequence, nBase;
+			message >> nSequence >> nBase;
+
+			uint32_t nStream = message.header.correlation;
+			auto& stream = m_mapSnapshotsIn[nStream];
+
+			std::vector<uint8_t> state;
+			if (nBase == 0)
+			{
+				state = std::move(message.body);
+			}
+			else
+			{
+				auto it = std::find_if(stream.deqStates.begin(), stream.deqStates.end(),
+					[nBase](const auto& received) { return received.first == nBase; });
+				if (it == stream.deqStates.end()
+					|| !snapshot::DecodeDelta(it->second, message.body.data(), message.body.size(), state, MaxBodySize(message.header.id)))
+				{
+					sMessage<T> ack;
+					ack << uint32_t(0);
+					ack.header.correlation = nStream;
+					SendControl(ack, eControl::snapshotAck);
+					message = {};
+					return false;
+				}
+			}
+
+			// The peer only makes deltas against states newer than the base it just used.
+			while (!stream.deqStates.empty() && stream.deqStates.front().first < nBase)
+				stream.deqStates.pop_front();
+			stream.deqStates.emplace_back(nSequence, state);
+			if (stream.deqStates.size() > snapshot::nHistory)
+				stream.deqStates.pop_front();
+
+			sMessage<T> ack;
+			ack << nSequence;
+			ack.header.correlation = nStream;
+			SendControl(ack, eControl::snapshotAck);
+
+			// Still handed back to the window once handled.
+			sMessageHeader<T> header;
+			header.id = message.header.id;
+			header.flags = message.header.flags & frame::windowed;
+			message.header = header;
+			message.body = std::move(state);
+			message.header.size = SizeField(message.body.size());
+			return true;
+		}
+
+		// Hands a complete message to whoever takes this connection's messages. nBody is its body as the peer sent it,
+		// which budgets and windows are charged with. It only differs from the body for snapshots.
+		// Returns true if the message was charged to the in-flight budget, until Update() handled it, or on a client
+		// until it was taken off the incoming queue.
+		bool Dispatch(sMessage<T>& message, size_t nBody)
+		{
+			if (m_pCapture)
+				m_pCapture->Record(id, eCaptureDirection::in, message);
+
+			// Passed through as it is.
+			if (m_fnSpliceHandler)
+			{
+				m_fnSpliceHandler(message);
+				message = {};
+				return false;
+			}
+
+			// Responses go straight to whoever waits for them.
+			if (message.header.flags & frame::response)
+			{
+				CompleteRequest(message.header.correlation, {}, std::move(message));
+				message = {};
+				return false;
+			}
+
+			// Deadlines do not come over the wire, the one of a message read before into the same buffer must not stay.
+			auto tNow = std::chrono::steady_clock::now();
+			message.deadline = {};
+			StampDeadline(message, tNow);
+
+			// A coroutine waits for this connection's messages, so they skip the shared queue.
+			if (m_bUseReceive)
+			{
+				m_deqInbox.push_back(std::move(message));
+				message = {};
+				m_timerReceive.cancel();
+				return false;
+			}
+
+			// Handled on the spot, which spares the hand-off to the thread calling Update().
+			if (m_fnInlineHandler)
+			{
+				std::shared_ptr<connection<T>> remote = nullptr;
+				if (m_nOwnerType == owner::server || m_bStream)
+					remote = this->shared_from_this();
+
+				if (m_fnInlineHandler(remote, message))
+					return false;
+			}
+
 			// If I am a server...
 			if (m_nOwnerType == owner::server)
 				// Then put this message in a ownedMessage container with a unique ptr to myself.
 			{
 				//sOwnedMessage<T> temp = { this->shared_from_this(), m_msgTemporaryIn };
-				m_qMessagesIn.push_back({ this->shared_from_this(), m_msgTemporaryIn });
+				// The body counts against the in-flight budget until Update() handled it.
+				m_nBytesInFlight += nBody;
+				if (m_pReadMarks)
+					m_pReadMarks->Add(nBody);
+				if (m_pSharedMarks)
+					m_pSharedMarks->Add(nBody);
+				m_qMessagesIn.push_back({ this->shared_from_this(), message, nBody, (message.header.flags & frame::windowed) != 0, tNow });
+				return true;
+			}
+
+			// A stream tells the client which of its streams the message came on.
+			else if (m_bStream)
+			{
+				m_qMessagesIn.push_back({ this->shared_from_this(), message, 0, false, tNow });
 			}
 
 			else
 				// Do not assign my pointer to this message
 			{
 				//sOwnedMessage<T> temp = { nullptr, m_msgTemporaryIn };
-				m_qMessagesIn.push_back({ nullptr, m_msgTemporaryIn });
+				// A client gives the window back once the message is taken off its incoming queue.
+				bool bWindowed = (message.header.flags & frame::windowed) != 0;
+				if (bWindowed)
+					m_nBytesInFlight += nBody;
+				m_qMessagesIn.push_back({ nullptr, message, bWindowed ? nBody : 0, bWindowed, tNow });
+				return bWindowed;
 			}
-
-			// Prime the context with the next header to read.
-			ReadHeader();
+			return false;
 		}
 
 	protected:
@@ -226,16 +2199,187 @@ namespace net
 		asio::io_context& m_asioContext;
 		// A thread safe queue to store outcoming messages.
 		// These do not need to be associated with this connection object.
-		TsQueue<sMessage<T>> m_qMessagesOut;
+		// One queue per priority lane, drained from the highest priority down.
+		// Messages are shared, so a broadcast is held in memory once no matter how many clients it goes to.
+		std::array<TsQueue<std::shared_ptr<const sMessage<T>>>, static_cast<size_t>(ePriority::count)> m_qMessagesOut;
+		// How much of the body of each lane's front message has been written already.
+		std::array<size_t, static_cast<size_t>(ePriority::count)> m_nOutOffset{};
+		// Frames of the write in progress: their headers, the buffers pointing at headers and bodies, and what
+		// the buffers point into. Messages whose last frame is in the write are listed with where they end in it.
+		static constexpr size_t nMaxFramesPerWrite = 64;
+		// Errors of all connections together are logged at most this often, a storm of failing clients could flood the log.
+		static constexpr uint32_t nErrorLinesPerSecond = 20;
+		std::vector<sMessageHeader<T>> m_vecHeadersOut;
+		std::vector<asio::const_buffer> m_vecBuffersOut;
+		std::vector<std::shared_ptr<const void>> m_vecKeepOut;
+		std::vector<std::pair<size_t, std::shared_ptr<const sMessage<T>>>> m_vecCompletedOut;
+		// Most bytes gathered into one write.
+		size_t m_nMaxWriteBytes = 64 * 1024;
+		// Queuing a batch, writing starts once all of it is queued.
+		bool m_bBatching = false;
+		// Client side: the connection to the server is not established yet.
+		bool m_bConnecting = false;
+		// Traffic capture this connection records into, see server_interface::StartCapture().
+		std::shared_ptr<capture_log> m_pCapture;
+		// Set on links between the servers of a cluster.
+		std::function<void(const std::vector<uint8_t>& batch)> m_fnLinkHandler;
+		// Streams carried by this connection by their id, see OpenStream(), and the ones waiting for a turn on each lane.
+		// On every lane the turn goes back and forth between the connection's own messages and the streams.
+		bool m_bStreams = false;
+		std::function<bool(std::shared_ptr<connection<T>>)> m_fnStreamAccept;
+		std::unordered_map<uint32_t, std::shared_ptr<connection<T>>> m_mapStreams;
+		std::array<std::deque<std::shared_ptr<connection<T>>>, static_cast<size_t>(ePriority::count)> m_deqStreamTurns;
+		std::array<bool, static_cast<size_t>(ePriority::count)> m_bStreamTurnNext{};
+		std::atomic<uint32_t> m_nNextStream = 0;
+		// Stream state. The connection owns its streams, they only point back at it.
+		bool m_bStream = false;
+		std::atomic<bool> m_bStreamOpen = false;
+		uint32_t m_nStreamId = 0;
+		std::weak_ptr<connection<T>> m_pParent;
+		std::array<bool, static_cast<size_t>(ePriority::count)> m_bStreamTurn{};
+		// Bytes a stream may send until the peer handled some, bytes the peer may send on it, and bytes handled
+		// that the peer gets back once there are enough of them to be worth a window update.
+		static constexpr size_t nStreamWindow = 256 * 1024;
+		size_t m_nSendWindow = nStreamWindow;
+		size_t m_nReceiveWindow = nStreamWindow;
+		size_t m_nCreditOwed = 0;
+		// Window advertised to the peer, see SetReceiveWindow(), and what was handled since the last window update.
+		std::atomic<size_t> m_nWindowBytes = 0;
+		std::atomic<uint32_t> m_nWindowMessages = 0;
+		std::atomic<size_t> m_nCreditBytes = 0;
+		std::atomic<uint32_t> m_nCreditMessages = 0;
+		// What is left of the window the peer advertised, below 0 if the last message went over. Without one, nothing is held back.
+		bool m_bPeerWindow = false;
+		std::atomic<int64_t> m_nPeerWindowBytes = std::numeric_limits<int64_t>::max();
+		std::atomic<int64_t> m_nPeerWindowMessages = std::numeric_limits<int64_t>::max();
+		// Watermarks on the incoming queue, see UseWatermarks(), and whether reading waits for them.
+		std::shared_ptr<watermark> m_pReadMarks;
+		std::shared_ptr<watermark> m_pSharedMarks;
+		bool m_bReadParked = false;
+		// Watermarks charged with the bytes queued on this stream, see UseSendMarks(), and how many are charged.
+		std::shared_ptr<watermark> m_pSendMarks;
+		size_t m_nSendMarked = 0;
+		// See SetSpliceHandler() and SetCloseHandler().
+		std::function<void(sMessage<T>&)> m_fnSpliceHandler;
+		std::function<void()> m_fnCloseHandler;
+		bool m_bClosed = false;
+		// Closing gracefully, see DisconnectGracefully().
+		bool m_bClosing = false;
+		bool m_bGoodbyeSent = false;
+		// Gets the socket once detached, see Detach().
+		std::function<void(std::error_code, asio::ip::tcp::socket::native_handle_type, std::vector<uint8_t>)> m_fnDetached;
+		// Is a frame being written at the moment?
+		bool m_bWritingMessage = false;
+		// Largest part of a body sent in one frame.
+		uint16_t m_nChunkSize = 4096;
+		// Ids of messages that get coalesced in the outgoing queue. Only touched from the connection's strand.
+		std::unordered_set<T> m_setReplaceableIds;
+		// Default lanes of message ids. Only touched from the connection's strand.
+		std::unordered_map<T, ePriority> m_mapPriorities;
+		// How long messages of an id may wait, see SetExpiry(). Only touched from the connection's strand.
+		std::unordered_map<T, std::chrono::steady_clock::duration> m_mapExpiry;
+		std::atomic<uint64_t> m_nExpiredOut = 0;
+		// Codec of outgoing bodies, set once the peer accepted our offer, and the size from which bodies are compressed.
+		eCompression m_compressionOut = eCompression::none;
+		// Codec offered to the peer and not answered yet.
+		eCompression m_compressionOffered = eCompression::none;
+		uint16_t m_nCompressionThreshold = 128;
+		std::atomic<uint64_t> m_nCompressedFrom = 0;
+		std::atomic<uint64_t> m_nCompressedTo = 0;
+		// Dictionary all compression histories of this connection start with.
+		std::vector<uint8_t> m_vecDictionary;
+		// Compression histories, one per lane and direction, so interleaved fragments do not mix them up.
+		std::array<std::unique_ptr<lz_context>, static_cast<size_t>(ePriority::count)> m_lzOut;
+		std::array<std::unique_ptr<lz_context>, static_cast<size_t>(ePriority::count)> m_lzIn;
+		// Compressed body of each lane's front message, if it was compressed.
+		std::array<std::shared_ptr<const std::vector<uint8_t>>, static_cast<size_t>(ePriority::count)> m_pCompressedOut;
+		// Limits for frames from the peer, checked before their bodies are allocated.
+		size_t m_nMaxBodySize = 1024 * 1024;
+		std::unordered_map<T, size_t> m_mapMaxBodySizes;
+		bool m_bCheckIdRange = false;
+		T m_idFirst{};
+		T m_idLast{};
+		// Body bytes of this connection waiting in the incoming queue, and how many there may be.
+		// Charged on the strand and given back from Update(), hence atomic.
+		std::atomic<size_t> m_nBytesInFlight = 0;
+		size_t m_nInFlightBudget = 16 * 1024 * 1024;
+		// Rate limits for the peer, see SetRateLimit().
+		token_bucket m_bucketMessages;
+		token_bucket m_bucketBytes;
 		// A thread safe queue to store outcoming messages.
 		// This reference is passed in the constructor by the owner, so owner has this queue on him.
 		// server propagates only 1 queue to its connections, so this is shared among them.
 		// client propagates only 1 also, but clients are unique and each client owns its connection.
 		TsQueue<sOwnedMessage<T>>& m_qMessagesIn;
 		sMessage<T> m_msgTemporaryIn;
+		// Messages arriving in fragments are put together here, one per lane.
+		std::array<sMessage<T>, static_cast<size_t>(ePriority::count)> m_msgPartialIn;
 		// Definition of an owner of this connection object
 		owner m_nOwnerType = owner::server;
 		// Unique ID for connections created by the server, because there is more than one.
 		uint32_t id = 0;
+
+		// Type erased completion handler of an outstanding request. Handlers can be move-only, so std::function does not fit.
+		struct sPendingRequestBase
+		{
+			virtual ~sPendingRequestBase() {}
+			virtual void Complete(std::error_code ec, sMessage<T> response, const asio::any_io_executor& executor) = 0;
+		};
+
+		template <typename Handler>
+		struct sPendingRequestHandler : sPendingRequestBase
+		{
+			explicit sPendingRequestHandler(Handler h) : handler(std::move(h)) {}
+
+			// Runs the handler on its own executor, or right here on the connection's strand if it has none.
+			void Complete(std::error_code ec, sMessage<T> response, const asio::any_io_executor& executor) override
+			{
+				auto handlerExecutor = asio::get_associated_executor(handler, executor);
+				asio::dispatch(handlerExecutor,
+					[handler = std::move(handler), ec, response = std::move(response)]() mutable
+					{
+						handler(ec, std::move(response));
+					});
+			}
+
+			Handler handler;
+		};
+
+		struct sPendingRequest
+		{
+			std::unique_ptr<sPendingRequestBase> pHandler;
+			std::unique_ptr<asio::steady_timer> pTimer;
+		};
+
+		// Gets incoming messages on the connection's strand before they are queued.
+		std::function<bool(std::shared_ptr<connection<T>>, sMessage<T>&)> m_fnInlineHandler;
+
+		// Snapshot streams by stream id, see SendSnapshot(). Only touched from the connection's strand.
+		std::unordered_map<uint32_t, sSnapshotStreamOut> m_mapSnapshotsOut;
+		std::unordered_map<uint32_t, sSnapshotStreamIn> m_mapSnapshotsIn;
+		size_t m_nMaxSnapshotStreams = 0;
+
+		// Session of this connection, if sessions are used. Only control frames are written while it is being set up.
+		std::shared_ptr<session_state<T>> m_pSession;
+		bool m_bSessionPending = false;
+		std::function<std::shared_ptr<session_state<T>>(uint64_t nToken)> m_fnFindSession;
+		std::function<void(bool bResumed)> m_fnSessionHandler;
+
+		// Messages kept for AsyncReceive() and the timer it sleeps on while there are none.
+		bool m_bUseReceive = false;
+		std::deque<sMessage<T>> m_deqInbox;
+		asio::steady_timer m_timerReceive;
+		// Reading sleeps on this while the peer is over its rate limit.
+		asio::steady_timer m_timerRead;
+		// Options of the socket, see UseSocketOptions().
+		sSocketOptions m_socketOptions;
+		bool m_bQuickAck = false;
+		// The lanes from m_nBackOffLane down are not written until this expires, the peer asked us to back off.
+		asio::steady_timer m_timerBackOff;
+		size_t m_nBackOffLane = static_cast<size_t>(ePriority::count);
+
+		// Requests waiting for a response, by correlation id. Only touched from the connection's strand.
+		std::unordered_map<uint32_t, sPendingRequest> m_mapPendingRequests;
+		uint32_t m_nLastCorrelation = 0;
 	};
 }
@@ -0,0 +1,227 @@
+#pragma once
+#include "include.h"
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace net
+{
+	// A socket passed from one server process to the next, see server_interface::HandOff().
+	struct sHandOff
+	{
+		enum class eKind : uint32_t
+		{
+			listener,
+			connection,
+			// Marks the end of a hand off, carries no socket.
+			end
+		};
+
+		eKind kind = eKind::end;
+		int nHandle = -1;
+		// Connection ID and the read state the connection carries on from.
+		uint32_t id = 0;
+		std::vector<uint8_t> state;
+	};
+
+	// Moves sockets between processes over a Unix domain socket. Each socket is sent with SCM_RIGHTS
+	// together with a small record, followed by the state of the connection.
+	namespace handoff
+	{
+		struct sRecord
+		{
+			sHandOff::eKind kind;
+			uint32_t id;
+			uint32_t nStateSize;
+		};
+
+		inline bool WriteAll(int nSocket, const uint8_t* pData, size_t nSize)
+		{
+			while (nSize > 0)
+			{
+				ssize_t nWritten = ::write(nSocket, pData, nSize);
+				if (nWritten < 0 && errno == EINTR)
+					continue;
+				if (nWritten <= 0)
+					return false;
+				pData += nWritten;
+				nSize -= nWritten;
+			}
+			return true;
+		}
+
+		inline bool ReadAll(int nSocket, uint8_t* pData, size_t nSize)
+		{
+			while (nSize > 0)
+			{
+				ssize_t nRead = ::read(nSocket, pData, nSize);
+				if (nRead < 0 && errno == EINTR)
+					continue;
+				if (nRead <= 0)
+					return false;
+				pData += nRead;
+				nSize -= nRead;
+			}
+			return true;
+		}
+
+		// Sends one record, with the socket attached to its first byte.
+		inline bool Send(int nSocket, const sHandOff& handOff)
+		{
+			sRecord record{ handOff.kind, handOff.id, static_cast<uint32_t>(handOff.state.size()) };
+
+			iovec io{ &record, sizeof(record) };
+			msghdr msg{};
+			msg.msg_iov = &io;
+			msg.msg_iovlen = 1;
+
+			alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+			if (handOff.nHandle >= 0)
+			{
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+				cmsghdr* pHeader = CMSG_FIRSTHDR(&msg);
+				pHeader->cmsg_level = SOL_SOCKET;
+				pHeader->cmsg_type = SCM_RIGHTS;
+				pHeader->cmsg_len = CMSG_LEN(sizeof(int));
+				std::memcpy(CMSG_DATA(pHeader), &handOff.nHandle, sizeof(int));
+			}
+
+			ssize_t nSent;
+			do
+			{
+				nSent = ::sendmsg(nSocket, &msg, MSG_NOSIGNAL);
+			} while (nSent < 0 && errno == EINTR);
+			if (nSent <= 0)
+				return false;
+
+			// The socket went with the first byte, the rest of the record is plain data.
+			return WriteAll(nSocket, reinterpret_cast<const uint8_t*>(&record) + nSent, sizeof(record) - nSent)
+				&& WriteAll(nSocket, handOff.state.data(), handOff.state.size());
+		}
+
+		inline bool Receive(int nSocket, sHandOff& handOff)
+		{
+			sRecord record;
+
+			iovec io{ &record, sizeof(record) };
+			msghdr msg{};
+			msg.msg_iov = &io;
+			msg.msg_iovlen = 1;
+
+			alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			ssize_t nRead;
+			do
+			{
+				nRead = ::recvmsg(nSocket, &msg, MSG_CMSG_CLOEXEC);
+			} while (nRead < 0 && errno == EINTR);
+			if (nRead <= 0)
+				return false;
+
+			handOff.nHandle = -1;
+			for (cmsghdr* pHeader = CMSG_FIRSTHDR(&msg); pHeader; pHeader = CMSG_NXTHDR(&msg, pHeader))
+			{
+				if (pHeader->cmsg_level == SOL_SOCKET && pHeader->cmsg_type == SCM_RIGHTS)
+					std::memcpy(&handOff.nHandle, CMSG_DATA(pHeader), sizeof(int));
+			}
+
+			if (!ReadAll(nSocket, reinterpret_cast<uint8_t*>(&record) + nRead, sizeof(record) - nRead))
+				return false;
+
+			handOff.kind = record.kind;
+			handOff.id = record.id;
+			handOff.state.resize(record.nStateSize);
+			return ReadAll(nSocket, handOff.state.data(), handOff.state.size());
+		}
+
+		inline bool MakeAddress(const std::string& sPath, sockaddr_un& address)
+		{
+			address = {};
+			address.sun_family = AF_UNIX;
+			if (sPath.size() >= sizeof(address.sun_path))
+				return false;
+			std::memcpy(address.sun_path, sPath.c_str(), sPath.size() + 1);
+			return true;
+		}
+	}
+
+	// Connects to the process waiting in ReceiveHandOff() and passes it the sockets. The sockets are closed
+	// in this process either way, they are only open in the other one after a successful hand off.
+	inline bool SendHandOff(const std::string& sPath, const std::vector<sHandOff>& vecHandOffs)
+	{
+		sockaddr_un address;
+		int nSocket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		bool bSent = nSocket >= 0 && handoff::MakeAddress(sPath, address)
+			&& ::connect(nSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+
+		for (const auto& handOff : vecHandOffs)
+		{
+			bSent = bSent && handoff::Send(nSocket, handOff);
+			if (handOff.nHandle >= 0)
+				::close(handOff.nHandle);
+		}
+		bSent = bSent && handoff::Send(nSocket, sHandOff{});
+
+		// The other side closes the channel once it has read the end record, so this tells that everything arrived.
+		uint8_t nByte;
+		bSent = bSent && ::read(nSocket, &nByte, 1) == 0;
+
+		if (nSocket >= 0)
+			::close(nSocket);
+		return bSent;
+	}
+
+	// Waits at sPath for a process calling SendHandOff(), and takes the sockets it passes.
+	inline bool ReceiveHandOff(const std::string& sPath, std::vector<sHandOff>& vecHandOffs)
+	{
+		sockaddr_un address;
+		if (!handoff::MakeAddress(sPath, address))
+			return false;
+
+		int nListener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (nListener < 0)
+			return false;
+
+		::unlink(sPath.c_str());
+		bool bReceived = ::bind(nListener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+			&& ::listen(nListener, 1) == 0;
+
+		int nSocket = bReceived ? ::accept4(nListener, nullptr, nullptr, SOCK_CLOEXEC) : -1;
+		::close(nListener);
+		::unlink(sPath.c_str());
+		if (nSocket < 0)
+			return false;
+
+		while (true)
+		{
+			sHandOff handOff;
+			if (!handoff::Receive(nSocket, handOff))
+			{
+				bReceived = false;
+				break;
+			}
+			if (handOff.kind == sHandOff::eKind::end)
+				break;
+			vecHandOffs.push_back(std::move(handOff));
+		}
+
+		::close(nSocket);
+
+		if (!bReceived)
+		{
+			for (auto& handOff : vecHandOffs)
+			{
+				if (handOff.nHandle >= 0)
+					::close(handOff.nHandle);
+			}
+			vecHandOffs.clear();
+		}
+		return bReceived;
+	}
+}
+#endif
@@ -5,10 +5,25 @@
 #include <deque>
 #include <optional>
 #include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <array>
 #include <iostream>
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <functional>
+#include <atomic>
+#include <future>
+#include <random>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <cstdio>
+#include <type_traits>
 
 #ifdef _WIN32
 #define _WIN32_WINNT 0x0A00
@@ -21,6 +36,18 @@
 #include <asio/ts/internet.hpp>
 
 // Framework specific
+#include "log.h"
+#include "compression.h"
+#include "tokenBucket.h"
+#include "watermark.h"
+#include "admission.h"
+#include "socketOptions.h"
+#include "handOff.h"
+#include "session.h"
+#include "snapshot.h"
+#include "capture.h"
+#include "cluster.h"
+#include "proxy.h"
 #include "client.h"
 #include "server.h"
 #include "connection.h"
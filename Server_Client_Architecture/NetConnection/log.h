@@ -0,0 +1,357 @@
+#pragma once
+#include "include.h"
+
+// Lowest level that is compiled in, see net::log::eLevel. Lines below it cost nothing, not even the formatting.
+#ifndef NET_LOG_LEVEL
+#define NET_LOG_LEVEL 2
+#endif
+
+namespace net
+{
+	// Logging for the framework. Lines are formatted by the thread logging them into a slot of a lock free ring,
+	// and a background thread writes them out. An I/O thread never waits on the console or a pipe, and if the ring
+	// is full the line is dropped instead, and counted. Errors that can come in storms are rate limited on top.
+	namespace log
+	{
+		enum class eLevel : uint8_t
+		{
+			trace,
+			debug,
+			info,
+			warning,
+			error,
+			off
+		};
+
+		constexpr eLevel threshold = static_cast<eLevel>(NET_LOG_LEVEL);
+
+		inline const char* LevelName(eLevel level)
+		{
+			switch (level)
+			{
+			case eLevel::trace: return "TRACE";
+			case eLevel::debug: return "DEBUG";
+			case eLevel::info: return "INFO";
+			case eLevel::warning: return "WARN";
+			case eLevel::error: return "ERROR";
+			default: return "";
+			}
+		}
+
+		// One formatted line. Longer lines are cut off.
+		struct sLine
+		{
+			static constexpr size_t nMaxText = 240;
+
+			eLevel level = eLevel::info;
+			uint16_t nLength = 0;
+			std::chrono::system_clock::time_point tTime;
+			char text[nMaxText];
+
+			void Append(const char* pText, size_t nText)
+			{
+				nText = std::min<size_t>(nText, nMaxText - nLength);
+				std::memcpy(text + nLength, pText, nText);
+				nLength += static_cast<uint16_t>(nText);
+			}
+		};
+
+		// Formatting of the types the framework logs.
+		inline void Append(sLine& line, const char* szText)
+		{
+			line.Append(szText, std::strlen(szText));
+		}
+
+		inline void Append(sLine& line, std::string_view sText)
+		{
+			line.Append(sText.data(), sText.size());
+		}
+
+		inline void Append(sLine& line, const std::string& sText)
+		{
+			line.Append(sText.data(), sText.size());
+		}
+
+		inline void Append(sLine& line, char c)
+		{
+			line.Append(&c, 1);
+		}
+
+		inline void Append(sLine& line, bool b)
+		{
+			Append(line, b ? "true" : "false");
+		}
+
+		template <typename Integer, typename = std::enable_if_t<std::is_integral_v<Integer>>>
+		void Append(sLine& line, Integer nValue)
+		{
+			char buffer[24];
+			auto result = std::to_chars(buffer, buffer + sizeof(buffer), nValue);
+			line.Append(buffer, result.ptr - buffer);
+		}
+
+		inline void Append(sLine& line, double dValue)
+		{
+			char buffer[32];
+			int nLength = std::snprintf(buffer, sizeof(buffer), "%g", dValue);
+			line.Append(buffer, std::clamp(nLength, 0, static_cast<int>(sizeof(buffer) - 1)));
+		}
+
+		inline void Append(sLine& line, const std::error_code& ec)
+		{
+			Append(line, ec.message());
+		}
+
+		inline void Append(sLine& line, const asio::ip::tcp::endpoint& endpoint)
+		{
+			std::error_code ec;
+			Append(line, endpoint.address().to_string(ec));
+			Append(line, ':');
+			Append(line, endpoint.port());
+		}
+
+		// Bounded multi producer ring of lines with a single consumer, the flusher thread. Each slot carries
+		// a sequence number telling whether it is free for the producer or ready for the consumer.
+		class logger
+		{
+		public:
+			static logger& Instance()
+			{
+				static logger instance;
+				return instance;
+			}
+
+			~logger()
+			{
+				m_bStop = true;
+				if (m_thrFlusher.joinable())
+					m_thrFlusher.join();
+			}
+
+			// Formats a line into a free slot. Returns false if the ring is full, the line is dropped then.
+			template <typename... Args>
+			bool Push(eLevel level, const Args&... args)
+			{
+				size_t nPosition = m_nPushPosition.load(std::memory_order_relaxed);
+				sSlot* pSlot;
+				while (true)
+				{
+					pSlot = &m_vecSlots[nPosition & (nSlots - 1)];
+					size_t nSequence = pSlot->nSequence.load(std::memory_order_acquire);
+					if (nSequence == nPosition)
+					{
+						if (m_nPushPosition.compare_exchange_weak(nPosition, nPosition + 1, std::memory_order_relaxed))
+							break;
+					}
+					else if (nSequence < nPosition)
+					{
+						m_nDropped.fetch_add(1, std::memory_order_relaxed);
+						return false;
+					}
+					else
+					{
+						nPosition = m_nPushPosition.load(std::memory_order_relaxed);
+					}
+				}
+
+				sLine& line = pSlot->line;
+				line.level = level;
+				line.nLength = 0;
+				line.tTime = std::chrono::system_clock::now();
+				(Append(line, args), ...);
+
+				pSlot->nSequence.store(nPosition + 1, std::memory_order_release);
+				return true;
+			}
+
+			// Replaces the function lines are written with, by default std::cout and std::cerr for warnings and errors.
+			void SetSink(std::function<void(const sLine& line)> fnSink)
+			{
+				std::scoped_lock lock(m_muxSink);
+				m_fnSink = std::move(fnSink);
+			}
+
+			// Waits until everything logged so far is written.
+			void Flush()
+			{
+				size_t nPosition = m_nPushPosition.load(std::memory_order_relaxed);
+				while (m_nPopPosition.load(std::memory_order_acquire) < nPosition && m_thrFlusher.joinable())
+					std::this_thread::sleep_for(nFlushInterval);
+			}
+
+			// Lines lost because the ring was full.
+			uint64_t Dropped() const
+			{
+				return m_nDropped.load(std::memory_order_relaxed);
+			}
+
+		private:
+			logger() : m_vecSlots(nSlots)
+			{
+				for (size_t i = 0; i < nSlots; i++)
+					m_vecSlots[i].nSequence.store(i, std::memory_order_relaxed);
+
+				m_thrFlusher = std::thread([this]() { Run(); });
+			}
+
+			void Run()
+			{
+				while (true)
+				{
+					// Told to stop, the lines still in the ring are written before leaving.
+					bool bStop = m_bStop;
+					if (!PopAll() && bStop)
+						break;
+
+					std::this_thread::sleep_for(nFlushInterval);
+				}
+			}
+
+			// Writes out the lines that are ready. Returns false if there were none.
+			bool PopAll()
+			{
+				std::scoped_lock lock(m_muxSink);
+
+				bool bPopped = false;
+				size_t nPosition = m_nPopPosition.load(std::memory_order_relaxed);
+				while (true)
+				{
+					sSlot& slot = m_vecSlots[nPosition & (nSlots - 1)];
+					if (slot.nSequence.load(std::memory_order_acquire) != nPosition + 1)
+						break;
+
+					if (m_fnSink)
+						m_fnSink(slot.line);
+					else
+						Write(slot.line);
+
+					slot.nSequence.store(nPosition + nSlots, std::memory_order_release);
+					m_nPopPosition.store(++nPosition, std::memory_order_release);
+					bPopped = true;
+				}
+
+				if (bPopped)
+				{
+					std::cout.flush();
+					std::cerr.flush();
+				}
+				return bPopped;
+			}
+
+			static void Write(const sLine& line)
+			{
+				std::ostream& out = line.level >= eLevel::warning ? std::cerr : std::cout;
+				out << '[' << LevelName(line.level) << "] ";
+				out.write(line.text, line.nLength);
+				out << '\n';
+			}
+
+		private:
+			static constexpr size_t nSlots = 4096;
+			static constexpr std::chrono::milliseconds nFlushInterval{ 5 };
+
+			struct sSlot
+			{
+				std::atomic<size_t> nSequence{ 0 };
+				sLine line;
+			};
+
+			std::vector<sSlot> m_vecSlots;
+			std::atomic<size_t> m_nPushPosition = 0;
+			std::atomic<size_t> m_nPopPosition = 0;
+			std::atomic<uint64_t> m_nDropped = 0;
+			std::atomic<bool> m_bStop = false;
+			std::mutex m_muxSink;
+			std::function<void(const sLine& line)> m_fnSink;
+			std::thread m_thrFlusher;
+		};
+
+		// Lets through at most a number of lines per second. The lines held back are counted and reported
+		// with the next one let through. Shared by all threads logging at one place.
+		class rate_limit
+		{
+		public:
+			explicit rate_limit(uint32_t nPerSecond) : m_nPerSecond(nPerSecond)
+			{
+			}
+
+			bool Allow(uint32_t& nSuppressed)
+			{
+				int64_t nSecond = std::chrono::duration_cast<std::chrono::seconds>(
+					std::chrono::steady_clock::now().time_since_epoch()).count();
+
+				int64_t nWindow = m_nWindow.load(std::memory_order_relaxed);
+				if (nSecond != nWindow && m_nWindow.compare_exchange_strong(nWindow, nSecond, std::memory_order_relaxed))
+					m_nCount.store(0, std::memory_order_relaxed);
+
+				if (m_nCount.fetch_add(1, std::memory_order_relaxed) < m_nPerSecond)
+				{
+					nSuppressed = m_nSuppressed.exchange(0, std::memory_order_relaxed);
+					return true;
+				}
+				m_nSuppressed.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+
+		private:
+			uint32_t m_nPerSecond;
+			std::atomic<int64_t> m_nWindow = 0;
+			std::atomic<uint32_t> m_nCount = 0;
+			std::atomic<uint32_t> m_nSuppressed = 0;
+		};
+
+		template <eLevel level, typename... Args>
+		void Write(const Args&... args)
+		{
+			if constexpr (level >= threshold && level < eLevel::off)
+				logger::Instance().Push(level, args...);
+		}
+
+		// Same as Write(), but only as often as the rate limit lets it.
+		template <eLevel level, typename... Args>
+		void WriteLimited(rate_limit& limit, const Args&... args)
+		{
+			if constexpr (level >= threshold && level < eLevel::off)
+			{
+				uint32_t nSuppressed;
+				if (!limit.Allow(nSuppressed))
+					return;
+
+				if (nSuppressed > 0)
+					logger::Instance().Push(level, args..., " (", nSuppressed, " more suppressed)");
+				else
+					logger::Instance().Push(level, args...);
+			}
+		}
+
+		template <typename... Args>
+		void Debug(const Args&... args)
+		{
+			Write<eLevel::debug>(args...);
+		}
+
+		template <typename... Args>
+		void Info(const Args&... args)
+		{
+			Write<eLevel::info>(args...);
+		}
+
+		template <typename... Args>
+		void Warning(const Args&... args)
+		{
+			Write<eLevel::warning>(args...);
+		}
+
+		template <typename... Args>
+		void Error(const Args&... args)
+		{
+			Write<eLevel::error>(args...);
+		}
+
+		inline void Flush()
+		{
+			if constexpr (threshold < eLevel::off)
+				logger::Instance().Flush();
+		}
+	}
+}
@@ -0,0 +1,427 @@
+#pragma once
+#include "include.h"
+#include "Message.h"
+
+namespace net
+{
+	// Consistent hashing of keys onto backends. Every backend is put on a ring of 64 bit hashes at many points, and a key
+	// belongs to the backend with the first point at or after the key's hash. When a backend comes or goes, only the keys
+	// next to its points move, all other keys stay with their backend.
+	class hash_ring
+	{
+	public:
+		static constexpr size_t nDefaultPoints = 160;
+
+		// Adds a backend, or changes its number of points. A backend with more points gets a bigger share of the keys.
+		void Add(uint32_t nBackend, size_t nPoints = nDefaultPoints)
+		{
+			Remove(nBackend);
+			for (size_t i = 0; i < nPoints; i++)
+				m_vecPoints.emplace_back(Mix((static_cast<uint64_t>(nBackend) << 32) | i), nBackend);
+			std::sort(m_vecPoints.begin(), m_vecPoints.end());
+		}
+
+		void Remove(uint32_t nBackend)
+		{
+			m_vecPoints.erase(std::remove_if(m_vecPoints.begin(), m_vecPoints.end(),
+				[nBackend](const std::pair<uint64_t, uint32_t>& point) { return point.second == nBackend; }), m_vecPoints.end());
+		}
+
+		bool Empty() const
+		{
+			return m_vecPoints.empty();
+		}
+
+		// The backend the key belongs to. Backends fnUsable turns down are passed over for the next one on the ring,
+		// so their keys spread over the others. Empty if no backend is usable.
+		template <typename Usable>
+		std::optional<uint32_t> Find(uint64_t nKey, Usable&& fnUsable) const
+		{
+			auto it = std::lower_bound(m_vecPoints.begin(), m_vecPoints.end(), std::make_pair(Mix(nKey), uint32_t(0)));
+			for (size_t i = 0; i < m_vecPoints.size(); i++, ++it)
+			{
+				if (it == m_vecPoints.end())
+					it = m_vecPoints.begin();
+				if (fnUsable(it->second))
+					return it->second;
+			}
+			return std::nullopt;
+		}
+
+		// FNV-1a, the same on every machine, so all proxies send a key to the same backend.
+		static uint64_t HashKey(const void* pData, size_t nSize)
+		{
+			uint64_t nHash = 14695981039346656037ull;
+			for (size_t i = 0; i < nSize; i++)
+			{
+				nHash ^= static_cast<const uint8_t*>(pData)[i];
+				nHash *= 1099511628211ull;
+			}
+			return nHash;
+		}
+
+	private:
+		// Spreads close numbers all over the ring.
+		static uint64_t Mix(uint64_t n)
+		{
+			n ^= n >> 30;
+			n *= 0xbf58476d1ce4e5b9ull;
+			n ^= n >> 27;
+			n *= 0x94d049bb133111ebull;
+			n ^= n >> 31;
+			return n;
+		}
+
+		// Points sorted by hash, each with its backend.
+		std::vector<std::pair<uint64_t, uint32_t>> m_vecPoints;
+	};
+
+	// A front-end for a group of servers. Clients connect to the proxy, and each one is routed to a server, its backend,
+	// chosen by consistent hashing of a key. The same key lands on the same backend as long as it is up, so servers can
+	// keep the state of their keys. All clients of a backend share one link to it, on which each client is a stream,
+	// see server_interface::AcceptProxies(). Messages are passed through as they are read, header and body,
+	// without being handled or serialized again by the proxy.
+	template <typename T>
+	class proxy_interface
+	{
+	public:
+		proxy_interface(uint16_t port)
+			: m_asioAcceptor(asio::make_strand(m_asioContext), asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+		{
+		}
+
+		virtual ~proxy_interface()
+		{
+			Stop();
+		}
+
+		// Starts accepting clients, the context is run by nThreads threads.
+		bool Start(size_t nThreads = 1)
+		{
+			try
+			{
+				WaitForClientConnection();
+
+				for (size_t i = 0; i < std::max<size_t>(nThreads, 1); i++)
+					m_vecThreadContext.emplace_back([this]() { m_asioContext.run(); });
+			}
+			catch (std::exception& e)
+			{
+				log::Error("Proxy exception: ", e.what());
+				return false;
+			}
+
+			log::Info("Proxy started!");
+			return true;
+		}
+
+		// Stops the proxy, drops all clients and links and its threads.
+		void Stop()
+		{
+			m_asioContext.stop();
+
+			for (auto& thread : m_vecThreadContext)
+			{
+				if (thread.joinable())
+					thread.join();
+			}
+			m_vecThreadContext.clear();
+
+			log::Info("Proxy stopped!");
+		}
+
+		/// <summary>
+		/// Sets the socket options of clients connecting from now on and of links to backends added from now on,
+		/// see sSocketOptions::Latency() and Throughput() for presets. The buffer sizes are set on the listening socket
+		/// as well, so accepted sockets start with them. Call before Start().
+		/// </summary>
+		/// <param name="options">The options, those left empty keep what the system gives.</param>
+		void SetSocketOptions(const sSocketOptions& options)
+		{
+			m_socketOptions = options;
+			socket_options::Apply(m_asioAcceptor, options);
+		}
+
+		/// <summary>
+		/// Bounds the bytes of each client waiting to go out on its backend's link. Reading from the client pauses
+		/// once nHigh bytes of it are queued, until they are written down to under nLow, and TCP flow control pushes
+		/// back on the client. Applies to clients connecting from now on. Call before Start().
+		/// </summary>
+		void SetSpliceWatermarks(size_t nHigh, size_t nLow)
+		{
+			m_nSpliceHigh = nHigh;
+			m_nSpliceLow = nLow;
+		}
+
+		/// <summary>
+		/// Links the proxy to a server taking proxies with AcceptProxies() on host and port. Clients are routed to it from now on.
+		/// A backend already there under the same ID is replaced, its link is closed once it is drained. A backend whose link
+		/// breaks is passed over until it is added again, and the clients routed to it are dropped.
+		/// </summary>
+		/// <param name="nBackend">The backend's ID, its place on the ring depends on it only</param>
+		/// <param name="nPoints">How many points the backend has on the ring, more points take more keys</param>
+		bool AddBackend(uint32_t nBackend, const std::string& host, const uint16_t port, size_t nPoints = hash_ring::nDefaultPoints)
+		{
+			try
+			{
+				asio::ip::tcp::resolver resolver(m_asioContext);
+				asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
+
+				auto pLink = std::make_shared<connection<T>>(connection<T>::owner::client,
+					m_asioContext, asio::ip::tcp::socket(asio::make_strand(m_asioContext)), m_qMessagesIn);
+				pLink->UseSocketOptions(m_socketOptions);
+				pLink->ConnectToServer(endpoints);
+
+				std::scoped_lock lock(m_muxBackends);
+				auto it = m_mapBackends.find(nBackend);
+				if (it != m_mapBackends.end())
+					Retire(std::move(it->second));
+				m_mapBackends[nBackend] = std::move(pLink);
+				m_ring.Add(nBackend, nPoints);
+			}
+			catch (std::exception& e)
+			{
+				log::Error("Proxy - Backend exception: ", e.what());
+				return false;
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Takes a backend out of the ring, its keys go to the other backends. Its link is closed once it is drained,
+		/// and the clients routed to it are dropped then.
+		/// </summary>
+		void RemoveBackend(uint32_t nBackend)
+		{
+			std::scoped_lock lock(m_muxBackends);
+			auto it = m_mapBackends.find(nBackend);
+			if (it == m_mapBackends.end())
+				return;
+
+			Retire(std::move(it->second));
+			m_mapBackends.erase(it);
+			m_ring.Remove(nBackend);
+		}
+
+		/// <summary>
+		/// Is the backend's link up?
+		/// </summary>
+		bool IsBackendUp(uint32_t nBackend)
+		{
+			std::scoped_lock lock(m_muxBackends);
+			auto it = m_mapBackends.find(nBackend);
+			return it != m_mapBackends.end() && it->second->IsConnected();
+		}
+
+		/// <summary>
+		/// The backend a key is routed to at the moment, empty if no backend is up.
+		/// </summary>
+		std::optional<uint32_t> FindBackend(uint64_t nKey)
+		{
+			std::scoped_lock lock(m_muxBackends);
+			return FindUsable(nKey);
+		}
+
+		/// <summary>
+		/// Number of clients connected to the proxy.
+		/// </summary>
+		size_t ClientCount()
+		{
+			std::scoped_lock lock(m_muxClients);
+			return std::count_if(m_mapClients.begin(), m_mapClients.end(),
+				[](const auto& client) { return client.second->IsConnected(); });
+		}
+
+	protected:
+		// Do something when a client connects. Filters the IP address or similar things
+		virtual bool OnClientConnect(std::shared_ptr<connection<T>> /*client*/)
+		{
+			return true;
+		}
+
+		// The key a client is routed by, from its address and the first message it sent. The client stays with the
+		// backend chosen for it. By default the address, so a client coming back lands on the same backend.
+		virtual uint64_t OnClientKey(const asio::ip::address& address, const sMessage<T>& /*first*/)
+		{
+			std::string sAddress = address.to_string();
+			return hash_ring::HashKey(sAddress.data(), sAddress.size());
+		}
+
+	private:
+		// A client of the proxy and the stream standing for it on its backend's link,
+		// opened with the client's first message. Only touched from the client's strand.
+		struct sClient
+		{
+			std::weak_ptr<connection<T>> pConnection;
+			asio::ip::address address;
+			uint32_t nSession = 0;
+			std::shared_ptr<connection<T>> pProxied;
+			// Charged with the client's bytes queued on pProxied, reading from the client parks on it.
+			std::shared_ptr<watermark> pMarks;
+		};
+
+		void WaitForClientConnection()
+		{
+			m_asioAcceptor.async_accept(asio::make_strand(m_asioContext),
+				[this](std::error_code ec, asio::ip::tcp::socket socket)
+				{
+					if (!ec)
+					{
+						std::error_code ecEndpoint;
+						auto endpoint = socket.remote_endpoint(ecEndpoint);
+
+						auto newconn = std::make_shared<connection<T>>(connection<T>::owner::server,
+							m_asioContext, std::move(socket), m_qMessagesIn);
+
+						if (OnClientConnect(newconn))
+						{
+							newconn->UseSocketOptions(m_socketOptions);
+							auto pClient = std::make_shared<sClient>();
+							pClient->pConnection = newconn;
+							pClient->address = endpoint.address();
+							pClient->nSession = ++m_nSessionCounter;
+							pClient->pMarks = std::make_shared<watermark>(m_nSpliceHigh, m_nSpliceLow);
+							newconn->UseWatermarks(pClient->pMarks, 0, 0);
+
+							newconn->SetSpliceHandler(
+								[this, pClient](sMessage<T>& message)
+								{
+									Route(*pClient, message);
+								});
+							newconn->SetCloseHandler(
+								[pClient]()
+								{
+									// The stream is kept until the client is dropped, its close is still on its way.
+									if (pClient->pProxied)
+										pClient->pProxied->DisconnectGracefully();
+								});
+							// Handlers of a closed connection may still be on their way, so closed clients are
+							// only dropped on the next accept.
+							{
+								std::scoped_lock lock(m_muxClients);
+								for (auto it = m_mapClients.begin(); it != m_mapClients.end();)
+									it = it->second->IsConnected() ? std::next(it) : m_mapClients.erase(it);
+								m_mapClients[pClient->nSession] = newconn;
+							}
+							newconn->ConnectToClient(pClient->nSession);
+						}
+						else
+						{
+							static log::rate_limit limit(nDeniedLinesPerSecond);
+							log::WriteLimited<log::eLevel::warning>(limit, "Proxy - Connection denied!");
+						}
+					}
+					else if (m_asioAcceptor.is_open())
+					{
+						static log::rate_limit limit(nDeniedLinesPerSecond);
+						log::WriteLimited<log::eLevel::error>(limit, "Proxy - New connection error: ", ec);
+					}
+
+					if (m_asioAcceptor.is_open())
+						WaitForClientConnection();
+				});
+		}
+
+		// Passes a message from a client on to its backend, on the client's strand. The first message picks the backend.
+		void Route(sClient& client, sMessage<T>& message)
+		{
+			ePriority priority = LaneOf(message);
+
+			if (!client.pProxied)
+			{
+				std::shared_ptr<connection<T>> pLink;
+				{
+					std::scoped_lock lock(m_muxBackends);
+					if (auto nBackend = FindUsable(OnClientKey(client.address, message)))
+						pLink = m_mapBackends[*nBackend];
+				}
+
+				auto pConnection = client.pConnection.lock();
+				if (!pLink)
+				{
+					static log::rate_limit limit(nDeniedLinesPerSecond);
+					log::WriteLimited<log::eLevel::warning>(limit, "Proxy - No backend for client ", client.nSession);
+					if (pConnection)
+						pConnection->Disconnect();
+					return;
+				}
+
+				// Replies are passed back on the lane they came on.
+				std::weak_ptr<connection<T>> pWeakConnection = pConnection;
+				client.pProxied = pLink->OpenStream();
+				client.pProxied->UseSendMarks(client.pMarks);
+				client.pProxied->SetSpliceHandler(
+					[pWeakConnection](sMessage<T>& reply)
+					{
+						if (auto pConnection = pWeakConnection.lock())
+						{
+							ePriority priority = LaneOf(reply);
+							pConnection->Send(std::make_shared<const sMessage<T>>(std::move(reply)), priority);
+						}
+					});
+				client.pProxied->SetCloseHandler(
+					[pWeakConnection]()
+					{
+						if (auto pConnection = pWeakConnection.lock())
+							pConnection->Disconnect();
+					});
+			}
+
+			client.pProxied->Send(std::make_shared<const sMessage<T>>(std::move(message)), priority);
+		}
+
+		// The first usable backend for the key on the ring. Called with m_muxBackends locked.
+		std::optional<uint32_t> FindUsable(uint64_t nKey)
+		{
+			return m_ring.Find(nKey,
+				[this](uint32_t nBackend)
+				{
+					auto it = m_mapBackends.find(nBackend);
+					return it != m_mapBackends.end() && it->second->IsConnected();
+				});
+		}
+
+		// Closes a backend's link once it is drained. It is kept until then, its handlers are still running.
+		// Called with m_muxBackends locked.
+		void Retire(std::shared_ptr<connection<T>> pLink)
+		{
+			m_vecRetired.erase(std::remove_if(m_vecRetired.begin(), m_vecRetired.end(),
+				[](const std::shared_ptr<connection<T>>& pRetired) { return !pRetired->IsConnected(); }), m_vecRetired.end());
+
+			pLink->DisconnectGracefully();
+			m_vecRetired.push_back(std::move(pLink));
+		}
+
+		static ePriority LaneOf(const sMessage<T>& message)
+		{
+			return static_cast<ePriority>((message.header.flags & frame::laneMask) >> frame::laneShift);
+		}
+
+	protected:
+		// Needed by the connections, though nothing is queued in it, every message is passed through.
+		TsQueue<sOwnedMessage<T>> m_qMessagesIn;
+		asio::io_context m_asioContext;
+		std::vector<std::thread> m_vecThreadContext;
+		asio::ip::tcp::acceptor m_asioAcceptor;
+		// See SetSpliceWatermarks().
+		size_t m_nSpliceHigh = 1024 * 1024;
+		size_t m_nSpliceLow = 512 * 1024;
+		// Denied and failed accepts are logged at most this often.
+		static constexpr uint32_t nDeniedLinesPerSecond = 20;
+
+		// Links to the backends by ID, and the ring they are placed on.
+		std::mutex m_muxBackends;
+		std::unordered_map<uint32_t, std::shared_ptr<connection<T>>> m_mapBackends;
+		hash_ring m_ring;
+		// Links of removed or replaced backends, until they are closed.
+		std::vector<std::shared_ptr<connection<T>>> m_vecRetired;
+
+		// Connected clients by session. Sessions are only handed out on the acceptor's strand.
+		std::mutex m_muxClients;
+		std::unordered_map<uint32_t, std::shared_ptr<connection<T>>> m_mapClients;
+		uint32_t m_nSessionCounter = 0;
+
+		// Options of the clients' sockets and the backend links, see SetSocketOptions().
+		sSocketOptions m_socketOptions;
+	};
+}
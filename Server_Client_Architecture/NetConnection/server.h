@@ -3,6 +3,38 @@
 
 namespace net
 {
+	// How the ticks of a server went, see server_interface::EndTick().
+	struct sTickMetrics
+	{
+		uint64_t nTicks = 0;
+		// Ticks that took longer than the tick interval, and how much longer all of them took together.
+		uint64_t nOverruns = 0;
+		std::chrono::steady_clock::duration totalOverrun{};
+		std::chrono::steady_clock::duration lastDuration{};
+		std::chrono::steady_clock::duration maxDuration{};
+	};
+
+	// Messages dropped because they waited past their deadline, see server_interface::SetMessageExpiry().
+	struct sExpiryMetrics
+	{
+		// Dropped by Update() instead of handled.
+		uint64_t nExpiredIn = 0;
+		// Dropped by the connections instead of written, including clients that are gone by now.
+		uint64_t nExpiredOut = 0;
+	};
+
+	// How the overload protection of a server went, see server_interface::SetOverloadControl().
+	struct sOverloadMetrics
+	{
+		bool bOverloaded = false;
+		// How long the last message handled waited in the incoming queue.
+		std::chrono::steady_clock::duration delay{};
+		// Messages dropped instead of handled, clients turned away, and the times clients were asked to back off.
+		uint64_t nShed = 0;
+		uint64_t nRejected = 0;
+		uint64_t nBackOffs = 0;
+	};
+
 	// The server interface that can be started and ended, it accepts an acceptor through a constructor,
 	// and then waits for connections of clients, and for all these connections creates a
 	// connection object endpoint owned by the server, used to communicate with the other side.
@@ -11,44 +43,294 @@ namespace net
 	{
 	public:
 		server_interface(uint16_t port)
-			: m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+			: m_asioAcceptor(asio::make_strand(m_asioContext), asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)),
+			m_asioClusterAcceptor(asio::make_strand(m_asioContext)), m_asioProxyAcceptor(asio::make_strand(m_asioContext))
+		{
+		}
+
+		// A server without a listening socket, for taking over from another process with TakeOver().
+		server_interface()
+			: m_asioAcceptor(asio::make_strand(m_asioContext)), m_asioClusterAcceptor(asio::make_strand(m_asioContext)),
+			m_asioProxyAcceptor(asio::make_strand(m_asioContext))
 		{
 		}
 
 		virtual ~server_interface()
 		{
 			Stop();
+
+			// The connections' sockets belong to the context, which goes before the members holding them.
+			m_qMessagesIn.clear();
+			m_deqConnections.clear();
+			m_mapTopics.clear();
+			m_mapSessions.clear();
+			m_mapDispatch.clear();
+			m_deqDispatchTurns.clear();
+			m_vecLinks.clear();
+			m_vecProxyLinks.clear();
+			m_mapTickBatches.clear();
 		}
 
-		// Start the server
-		bool Start()
+		// Start the server. Pass false if connections are taken with AsyncAccept() instead of the accept loop.
+		// The context is run by nThreads threads. Each connection has its own strand, so its handlers never overlap,
+		// while different connections are served in parallel.
+		bool Start(bool bAcceptConnections = true, size_t nThreads = 1)
 		{
 			try
 			{
 				// Issue a task to do before starting the worker
-				WaitForClientConnection();
+				if (bAcceptConnections)
+					WaitForClientConnection();
+				else
+					// Nothing else keeps the context running until the first coroutine is spawned.
+					m_workGuard.emplace(m_asioContext.get_executor());
 
-				m_threadContext = std::thread([this]() {m_asioContext.run(); });
+				for (size_t i = 0; i < std::max<size_t>(nThreads, 1); i++)
+					m_vecThreadContext.emplace_back([this]() {m_asioContext.run(); });
 			}
-			catch (std::exception e)
+			catch (std::exception& e)
 			{
-				std::cerr << "Server exception: " << e.what() << "\n";
+				log::Error("Server exception: ", e.what());
 				return false;
 			}
 
-			std::cout << "Server started!\n";
+			log::Info("Server started!");
 			return true;
 		}
-		// Stop the server, drops all clients and its thread.
+		// Stop the server, drops all clients and its threads.
 		void Stop()
 		{
+			m_workGuard.reset();
 			m_asioContext.stop();
 
-			if (m_threadContext.joinable())
-				m_threadContext.join();
+			for (auto& thread : m_vecThreadContext)
+			{
+				if (thread.joinable())
+					thread.join();
+			}
+			m_vecThreadContext.clear();
+
+			log::Info("Server stopped!");
+		}
+
+		/// <summary>
+		/// Stops the server gracefully. No new clients are accepted, and the listening socket is first offered to
+		/// OnHandOffListener(). Every client then gets what is still queued for it followed by a goodbye frame,
+		/// all in parallel on the server's threads. Clients still not done when the timeout runs out are dropped.
+		/// </summary>
+		/// <param name="drainTimeout">How long to wait for the clients' outgoing queues to empty.</param>
+		void Stop(std::chrono::steady_clock::duration drainTimeout)
+		{
+			auto tDeadline = std::chrono::steady_clock::now() + drainTimeout;
+
+			if (!m_vecThreadContext.empty())
+			{
+				asio::post(m_asioAcceptor.get_executor(),
+					[this]()
+					{
+						m_bAccepting = false;
+						if (!OnHandOffListener(m_asioAcceptor))
+						{
+							std::error_code ec;
+							m_asioAcceptor.close(ec);
+						}
+					});
+
+				asio::post(m_asioClusterAcceptor.get_executor(),
+					[this]()
+					{
+						std::error_code ec;
+						m_asioClusterAcceptor.close(ec);
+					});
+
+				asio::post(m_asioProxyAcceptor.get_executor(),
+					[this]()
+					{
+						std::error_code ec;
+						m_asioProxyAcceptor.close(ec);
+					});
+
+				// Links to other nodes and proxies are drained like clients. Proxy links come after the clients,
+				// so they still carry what the proxied clients get before their close.
+				std::deque<std::shared_ptr<connection<T>>> deqConnections;
+				{
+					std::scoped_lock lock(m_muxConnections, m_muxCluster);
+					deqConnections = m_deqConnections;
+					for (auto& pLink : m_vecLinks)
+						deqConnections.push_back(pLink->pConnection);
+					deqConnections.insert(deqConnections.end(), m_vecProxyLinks.begin(), m_vecProxyLinks.end());
+				}
+
+				for (auto& client : deqConnections)
+					client->DisconnectGracefully();
+
+				auto IsDrained = [&deqConnections]()
+				{
+					return std::none_of(deqConnections.begin(), deqConnections.end(),
+						[](const std::shared_ptr<connection<T>>& client) { return client->IsConnected(); });
+				};
+
+				while (!IsDrained() && std::chrono::steady_clock::now() < tDeadline)
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+
+			Stop();
+		}
+
+#if !defined(_WIN32)
+		/// <summary>
+		/// Hands the listening socket and all clients over to a process waiting in TakeOver() at sPath, then stops.
+		/// Clients stay connected and the new process carries on reading their frames where this one stopped, even
+		/// in the middle of a frame. What is queued for a client is written before its socket is passed on.
+		/// Compressed connections cannot be passed on and are closed. Messages not yet handled by Update()
+		/// are still in the incoming queue, but replies to them are lost.
+		/// </summary>
+		/// <param name="sPath">Path of the Unix domain socket the new process listens on.</param>
+		/// <param name="timeout">How long to wait for the clients' outgoing queues to empty.</param>
+		/// <returns>Whether the new process got the sockets.</returns>
+		bool HandOff(const std::string& sPath, std::chrono::steady_clock::duration timeout)
+		{
+			if (m_vecThreadContext.empty())
+				return false;
+
+			auto tDeadline = std::chrono::steady_clock::now() + timeout;
+
+			auto pListener = std::make_shared<std::promise<sHandOff>>();
+			std::future<sHandOff> listener = pListener->get_future();
+			asio::post(m_asioAcceptor.get_executor(),
+				[this, pListener]()
+				{
+					m_bAccepting = false;
+
+					sHandOff handOff;
+					handOff.kind = sHandOff::eKind::listener;
+					std::error_code ec;
+					handOff.nHandle = m_asioAcceptor.is_open() ? m_asioAcceptor.release(ec) : -1;
+					pListener->set_value(handOff);
+				});
+
+			std::deque<std::shared_ptr<connection<T>>> deqConnections;
+			{
+				std::scoped_lock lock(m_muxConnections);
+				deqConnections = m_deqConnections;
+			}
+
+			// All clients are detached in parallel, each on its own strand.
+			std::vector<std::future<sHandOff>> vecDetached;
+			for (auto& client : deqConnections)
+			{
+				auto pDetached = std::make_shared<std::promise<sHandOff>>();
+				vecDetached.push_back(pDetached->get_future());
+
+				client->Detach(
+					[client, pDetached](std::error_code ec, asio::ip::tcp::socket::native_handle_type nHandle, std::vector<uint8_t> state)
+					{
+						sHandOff handOff;
+						handOff.kind = sHandOff::eKind::connection;
+						if (!ec)
+						{
+							handOff.nHandle = nHandle;
+							handOff.id = client->GetId();
+							handOff.state = std::move(state);
+						}
+						else if (ec == asio::error::operation_not_supported)
+						{
+							client->DisconnectGracefully();
+						}
+						pDetached->set_value(std::move(handOff));
+					});
+			}
+
+			std::vector<sHandOff> vecHandOffs;
+			sHandOff listenerHandOff = listener.get();
+			if (listenerHandOff.nHandle >= 0)
+				vecHandOffs.push_back(std::move(listenerHandOff));
+			for (auto& detached : vecDetached)
+			{
+				// A client that could not be detached in time is dropped with the rest on Stop().
+				if (detached.wait_until(tDeadline) != std::future_status::ready)
+					continue;
+
+				sHandOff handOff = detached.get();
+				if (handOff.nHandle >= 0)
+					vecHandOffs.push_back(std::move(handOff));
+			}
+
+			bool bHandedOff = SendHandOff(sPath, vecHandOffs);
+			log::Info("Server - Hand off ", bHandedOff ? "done" : "failed", ", ", vecHandOffs.size(), " sockets");
+
+			Stop();
+			return bHandedOff;
+		}
+
+		/// <summary>
+		/// Waits at sPath for a process calling HandOff(), and takes over its listening socket and clients.
+		/// Use on a server created without a port, before Start(). Clients taken over go through OnClientConnect()
+		/// like new ones, and keep their IDs.
+		/// </summary>
+		/// <param name="sPath">Path of the Unix domain socket to listen on.</param>
+		/// <returns>Whether the sockets arrived.</returns>
+		bool TakeOver(const std::string& sPath)
+		{
+			std::vector<sHandOff> vecHandOffs;
+			if (!ReceiveHandOff(sPath, vecHandOffs))
+				return false;
+
+			for (auto& handOff : vecHandOffs)
+			{
+				std::error_code ec;
+				if (handOff.kind == sHandOff::eKind::listener)
+				{
+					m_asioAcceptor.assign(asio::ip::tcp::v4(), handOff.nHandle, ec);
+					if (ec)
+						::close(handOff.nHandle);
+					continue;
+				}
+
+				asio::ip::tcp::socket socket(asio::make_strand(m_asioContext));
+				socket.assign(asio::ip::tcp::v4(), handOff.nHandle, ec);
+				if (ec)
+				{
+					::close(handOff.nHandle);
+					continue;
+				}
+
+				std::shared_ptr<connection<T>> newconn =
+					std::make_shared<connection<T>>(connection<T>::owner::server,
+						m_asioContext, std::move(socket), m_qMessagesIn);
+
+				if (!OnClientConnect(newconn))
+					continue;
+
+				if (m_bInlineDispatch)
+					newconn->SetInlineHandler(InlineHandler());
+				if (m_dClientMessageRate > 0.0 || m_dClientByteRate > 0.0)
+					newconn->SetRateLimit(m_dClientMessageRate, m_dClientByteRate);
+				newconn->UseWatermarks(m_pIncomingMarks, m_nClientHighMark, m_nClientLowMark);
+				newconn->UseSocketOptions(m_socketOptions);
+
+				// New clients must not get an ID that is taken already.
+				uint32_t nNextId = nIDCounter;
+				while (nNextId <= handOff.id && !nIDCounter.compare_exchange_weak(nNextId, handOff.id + 1))
+				{
+				}
+
+				if (!newconn->ResumeFromHandOff(handOff.id, handOff.state))
+				{
+					newconn->Disconnect();
+					continue;
+				}
+
+				std::scoped_lock lock(m_muxConnections);
+				if (m_pCapture)
+					newconn->UseCapture(m_pCapture);
+				m_deqConnections.push_back(newconn);
+			}
 
-			std::cout << "Server stopped!\n";
+			log::Info("Server - Took over ", m_deqConnections.size(), " clients");
+			return true;
 		}
+#endif
 
 		/// <summary>
 		/// This behemoth primes the context with a function to { wait for client connections, and then
@@ -58,40 +340,73 @@ namespace net
 		/// </summary>
 		void WaitForClientConnection()
 		{
-			m_asioAcceptor.async_accept(
+			// Every accepted socket gets a strand of its own.
+			m_asioAcceptor.async_accept(asio::make_strand(m_asioContext),
 				[this](std::error_code ec, asio::ip::tcp::socket socket)
 				{
 					if (!ec)
 					{
-						std::cout << "Server - New connection: " << socket.remote_endpoint() << "\n";
+						std::error_code ecEndpoint;
+						log::Info("Server - New connection: ", socket.remote_endpoint(ecEndpoint));
 						// Initialize new connection object, set its parent to server
 						std::shared_ptr<connection<T>> newconn =
 							std::make_shared<connection<T>>(connection<T>::owner::server,
 								m_asioContext, std::move(socket), m_qMessagesIn);
 
+						// Overloaded, new clients are turned away so the ones already in keep getting answers in time.
+						if (m_pAdmission && m_pAdmission->IsOverloaded())
+						{
+							m_nRejected++;
+							static log::rate_limit limit(nDeniedLinesPerSecond);
+							log::WriteLimited<log::eLevel::warning>(limit, "Server - Overloaded, connection denied!");
+						}
 						// deny a connection happens here
-						if (OnClientConnect(newconn))
+						else if (OnClientConnect(newconn))
 						{
+							if (m_bInlineDispatch)
+								newconn->SetInlineHandler(InlineHandler());
+							if (m_dClientMessageRate > 0.0 || m_dClientByteRate > 0.0)
+								newconn->SetRateLimit(m_dClientMessageRate, m_dClientByteRate);
+							if (m_nMaxReplayBytes > 0)
+								newconn->UseSessions(SessionFinder());
+							if (m_bAcceptStreams)
+								newconn->UseStreams(StreamAcceptor());
+							if (m_nClientWindowBytes > 0)
+								newconn->SetReceiveWindow(m_nClientWindowBytes, m_nClientWindowMessages);
+							newconn->UseWatermarks(m_pIncomingMarks, m_nClientHighMark, m_nClientLowMark);
+							newconn->UseSocketOptions(m_socketOptions);
+
 							// add it to the deque of connection objects;
-							m_deqConnections.push_back(std::move(newconn));
+							{
+								std::scoped_lock lock(m_muxConnections);
+								if (m_pCapture)
+									newconn->UseCapture(m_pCapture);
+								m_deqConnections.push_back(newconn);
+							}
 							// Call the connectToClient function on this connection.
 							// It assigns a new unique ID to this connection, and primes the context
 							// of this socket associated with this connection with the ReadHeader()
 							// function, so it starts reading incoming messages on this socket.
-							m_deqConnections.back()->ConnectToClient(nIDCounter++);
+							newconn->ConnectToClient(nIDCounter++);
 
-							std::cout << "ID: " << m_deqConnections.back()->GetId() << " Connection Approved!\n";
+							log::Info("ID: ", newconn->GetId(), " Connection Approved!");
 						}
 						else
 						{
-							std::cout << " Connection denied!\n";
+							static log::rate_limit limit(nDeniedLinesPerSecond);
+							log::WriteLimited<log::eLevel::warning>(limit, "Connection denied!");
 						}
 					}
-					else
+					else if (m_bAccepting)
 					{
-						std::cout << "Server - New connection error: " << ec.message() << "\n";
+						static log::rate_limit limit(nDeniedLinesPerSecond);
+						log::WriteLimited<log::eLevel::error>(limit, "Server - New connection error: ", ec);
 					}
 
+					// Stopped accepting on the way to a graceful stop or hand off.
+					if (!m_bAccepting || !m_asioAcceptor.is_open())
+						return;
+
 					// this puts another work to do for the worker of our server on the stack, so we can anticipate another connection
 					WaitForClientConnection();
 				});
@@ -106,97 +421,1398 @@ namespace net
 		{
 			if (client && client->IsConnected())
 			{
-				client->Send(message);
+				SendOnTick(client, Share(message));
 			}
 			else
 			{
 				// If we cannot send for some reason, client is considered AWOL and cleanup ensues.
-				OnClientDisconnect(client);
-				client.reset();
-				m_deqConnections.erase(
-					std::remove(m_deqConnections.begin(), m_deqConnections.end(), client), m_deqConnections.end());
+				RemoveClient(client);
+			}
+		}
+
+		/// <summary>
+		/// Sends a message to a client by its global ID, see GetGlobalId(). A client of another node in the cluster
+		/// gets it through the link to that node. Nothing is sent if the client or its node is gone.
+		/// </summary>
+		/// <param name="nGlobalId">The global ID of the client</param>
+		/// <param name="message">The message to send</param>
+		void MessageClient(uint64_t nGlobalId, const sMessage<T>& message)
+		{
+			uint32_t nNode = cluster::NodeOf(nGlobalId);
+			if (nNode == m_nNodeId)
+			{
+				if (auto client = FindClient(cluster::ClientOf(nGlobalId)))
+					MessageClient(client, message);
+				return;
+			}
+
+			std::scoped_lock lock(m_muxCluster);
+			if (auto pLink = FindLink(nNode))
+			{
+				RouteToLink(*pLink, cluster::eRoute::client, nGlobalId, message);
+			}
+			else
+			{
+				static log::rate_limit limit(nDeniedLinesPerSecond);
+				log::WriteLimited<log::eLevel::warning>(limit, "Server - No link to node ", nNode);
 			}
 		}
 
 		/// <summary>
 		/// Sends a global message to all clients, can ignore supplied client and will ignore all nullptr clients.
+		/// In a cluster the clients of the other nodes get it as well.
 		/// </summary>
 		/// <param name="message">The message to send to everyone</param>
 		/// <param name="pIgnoreClient">The ignored client.</param>
 		void MessageAllClients(const sMessage<T>& message, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
 		{
-			bool bInvalidClientExists = false;
+			// Every client gets the same copy of the message
+			auto pMessage = Share(message);
+			auto vecInvalidClients = MessageLocalClients(pMessage, pIgnoreClient);
 
-			for (auto& client : m_deqConnections)
 			{
-				if (client && client->IsConnected())
+				std::scoped_lock lock(m_muxCluster);
+				for (auto pLink : NodeLinks())
+					RouteToLink(*pLink, cluster::eRoute::all, 0, message);
+			}
+
+			// and cleanup of invalid clients, outside the lock so OnClientDisconnect() may send messages
+			for (auto& client : vecInvalidClients)
+				RemoveClient(client);
+		}
+
+		/// <summary>
+		/// Adds the client to the subscribers of a topic. Subscribing twice has no effect.
+		/// </summary>
+		/// <param name="client">The client connection object</param>
+		/// <param name="nTopic">The topic, e.g. a room or a region of the map</param>
+		void Subscribe(std::shared_ptr<connection<T>> client, uint32_t nTopic)
+		{
+			std::scoped_lock lock(m_muxConnections);
+
+			auto& vecTopics = m_mapClientTopics[client->GetId()];
+			if (std::find(vecTopics.begin(), vecTopics.end(), nTopic) != vecTopics.end())
+				return;
+
+			vecTopics.push_back(nTopic);
+			auto& vecSubscribers = m_mapTopics[nTopic];
+			if (vecSubscribers.empty())
+				AnnounceTopic(nTopic, true);
+			vecSubscribers.push_back(std::move(client));
+		}
+
+		/// <summary>
+		/// Removes the client from the subscribers of a topic.
+		/// </summary>
+		/// <param name="client">The client connection object</param>
+		/// <param name="nTopic">The topic</param>
+		void Unsubscribe(std::shared_ptr<connection<T>> client, uint32_t nTopic)
+		{
+			std::scoped_lock lock(m_muxConnections);
+
+			auto itClient = m_mapClientTopics.find(client->GetId());
+			if (itClient == m_mapClientTopics.end())
+				return;
+
+			auto& vecTopics = itClient->second;
+			auto itTopic = std::find(vecTopics.begin(), vecTopics.end(), nTopic);
+			if (itTopic == vecTopics.end())
+				return;
+
+			// Order does not matter in either list, so the removed entry is swapped with the last one.
+			*itTopic = vecTopics.back();
+			vecTopics.pop_back();
+			if (vecTopics.empty())
+				m_mapClientTopics.erase(itClient);
+
+			RemoveSubscriber(nTopic, client.get());
+		}
+
+		/// <summary>
+		/// Removes the client from every topic it is subscribed to.
+		/// </summary>
+		/// <param name="client">The client connection object</param>
+		void UnsubscribeAll(std::shared_ptr<connection<T>> client)
+		{
+			if (!client)
+				return;
+
+			std::scoped_lock lock(m_muxConnections);
+
+			auto itClient = m_mapClientTopics.find(client->GetId());
+			if (itClient == m_mapClientTopics.end())
+				return;
+
+			for (uint32_t nTopic : itClient->second)
+				RemoveSubscriber(nTopic, client.get());
+
+			m_mapClientTopics.erase(itClient);
+		}
+
+		/// <summary>
+		/// Sends a message to all subscribers of a topic. The message is copied once and shared by all of them.
+		/// In a cluster it also goes to the nodes with subscribers to the topic.
+		/// </summary>
+		/// <param name="nTopic">The topic to publish to</param>
+		/// <param name="message">The message to send</param>
+		/// <param name="pIgnoreClient">The ignored client, usually the one the update came from.</param>
+		void Publish(uint32_t nTopic, const sMessage<T>& message, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
+		{
+			auto pMessage = Share(message);
+			auto vecInvalidClients = PublishLocal(nTopic, pMessage, pIgnoreClient);
+
+			{
+				std::scoped_lock lock(m_muxCluster);
+				for (auto pLink : NodeLinks())
 				{
-					if (client != pIgnoreClient)
-						client->Send(message);
+					if (pLink->setTopics.count(nTopic) > 0)
+						RouteToLink(*pLink, cluster::eRoute::topic, nTopic, message);
 				}
-				else
+			}
+
+			// Cleanup is done after the loop, it changes the subscriber list we iterate over.
+			for (auto& client : vecInvalidClients)
+				RemoveClient(client);
+		}
+
+		/// <summary>
+		/// Sends the state of a stream to a client, see connection::SendSnapshot(). The client gets a message with
+		/// the id and the whole state, while on the wire only the changes since the last state it acked are sent.
+		/// The client must AcceptSnapshots().
+		/// </summary>
+		/// <param name="client">The client to send to</param>
+		/// <param name="nStream">The stream, each stream has its own history of states</param>
+		/// <param name="id">Id of the message the client gets</param>
+		/// <param name="state">The state</param>
+		void SendSnapshot(std::shared_ptr<connection<T>> client, uint32_t nStream, T id, const std::vector<uint8_t>& state)
+		{
+			if (client && client->IsConnected())
+			{
+				client->SendSnapshot(nStream, id, std::make_shared<const std::vector<uint8_t>>(state));
+			}
+			else
+			{
+				RemoveClient(client);
+			}
+		}
+
+		/// <summary>
+		/// Sends the state of a topic to all its subscribers as a snapshot, with the topic as the stream.
+		/// The state is copied once and shared, but each subscriber gets a delta against the last state it acked.
+		/// The subscribers must AcceptSnapshots().
+		/// </summary>
+		/// <param name="nTopic">The topic to publish to</param>
+		/// <param name="id">Id of the message the subscribers get</param>
+		/// <param name="state">The state</param>
+		void PublishSnapshot(uint32_t nTopic, T id, const std::vector<uint8_t>& state)
+		{
+			auto pState = std::make_shared<const std::vector<uint8_t>>(state);
+			std::vector<std::shared_ptr<connection<T>>> vecInvalidClients;
+
+			{
+				std::scoped_lock lock(m_muxConnections);
+
+				auto itTopic = m_mapTopics.find(nTopic);
+				if (itTopic == m_mapTopics.end())
+					return;
+
+				for (auto& client : itTopic->second)
 				{
-					// Invalid client gets recognized, we do not send a message to this one
-					OnClientDisconnect(client);
-					client.reset();
-					bInvalidClientExists = true;
+					if (client->IsConnected())
+						client->SendSnapshot(nTopic, id, pState);
+					else
+						vecInvalidClients.push_back(client);
 				}
 			}
 
-			if (bInvalidClientExists)
-				// and cleanup of invalid client
-				m_deqConnections.erase(
-					std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end());
+			for (auto& client : vecInvalidClients)
+				RemoveClient(client);
 		}
 
-	protected:
-		// Do something when a client connects. Filters the IP address or similar things
-		virtual bool OnClientConnect(std::shared_ptr<connection<T>> client)
+		/// <summary>
+		/// Turns inline dispatch on or off. When on, every message is first offered to OnMessageInline() on the
+		/// I/O thread as soon as it is read, instead of waiting in the queue for Update(). Handlers then run
+		/// concurrently with whatever thread calls Update(), so they must only touch state that is safe for that.
+		/// </summary>
+		/// <param name="bInline">Handle messages on the I/O thread?</param>
+		void SetInlineDispatch(bool bInline)
 		{
-			return false;
+			m_bInlineDispatch = bInline;
+
+			std::scoped_lock lock(m_muxConnections);
+			for (auto& client : m_deqConnections)
+			{
+				if (client)
+					client->SetInlineHandler(bInline ? InlineHandler() : nullptr);
+			}
 		}
-		// Do something when a client disconnects
-		virtual void OnClientDisconnect(std::shared_ptr<connection<T>> client)
+
+		/// <summary>
+		/// Sets the rate limit for clients connecting from now on. A client over it is not read from
+		/// until it is back under, see connection::SetRateLimit(). Call before Start().
+		/// </summary>
+		/// <param name="dMessagesPerSecond">Messages per second a client may send, 0 for no limit.</param>
+		/// <param name="dBytesPerSecond">Body bytes per second a client may send, 0 for no limit.</param>
+		void SetClientRateLimit(double dMessagesPerSecond, double dBytesPerSecond)
 		{
+			m_dClientMessageRate = dMessagesPerSecond;
+			m_dClientByteRate = dBytesPerSecond;
 		}
-	public:
+
 		/// <summary>
-		/// This function is called in a loop from your Main() function to keep server running.
-		/// Goes through all the obtained messages, calls their respective handler.
-		/// Meant to be used from the outside.
+		/// Sets watermarks on the body bytes waiting in the incoming queue for Update(), for all clients together and for each
+		/// client. Once the bytes reach a high mark, the clients it is about are not read from until the bytes are back under
+		/// the low mark, so TCP flow control pushes back on them and the queue stays bounded when Update() falls behind.
+		/// Call before Start().
 		/// </summary>
-		/// <param name="nMaxMessages">The n maximum messages.</param>
-		void Update(size_t nMaxMessages = -1)
+		/// <param name="nHigh">Bytes of all clients at which reading pauses, 0 for no limit.</param>
+		/// <param name="nLow">Bytes of all clients under which reading resumes.</param>
+		/// <param name="nClientHigh">Bytes of one client at which reading it pauses, 0 for no limit.</param>
+		/// <param name="nClientLow">Bytes of one client under which reading it resumes.</param>
+		void SetIncomingWatermarks(size_t nHigh, size_t nLow, size_t nClientHigh = 0, size_t nClientLow = 0)
 		{
-			size_t nMessagecount = 0;
-			while (nMessagecount < nMaxMessages && !m_qMessagesIn.empty())
+			m_pIncomingMarks = nHigh > 0 ? std::make_shared<watermark>(nHigh, nLow) : nullptr;
+			m_nClientHighMark = nClientHigh;
+			m_nClientLowMark = nClientLow;
+		}
+
+		/// <summary>
+		/// Body bytes waiting in the incoming queue for Update(), counted once SetIncomingWatermarks() set a high mark.
+		/// </summary>
+		size_t IncomingBytes() const
+		{
+			return m_pIncomingMarks ? m_pIncomingMarks->Bytes() : 0;
+		}
+
+		/// <summary>
+		/// Gives messages with this id a time to live. Incoming ones waiting longer than that for Update() are dropped
+		/// instead of handled. Outgoing ones sent with MessageClient(), MessageAllClients() or Publish() get a deadline
+		/// and are dropped by the connections if they have not started going out by then. A message that is late is
+		/// useless, so under load stale work is shed and the server catches up sooner. Call before Start().
+		/// </summary>
+		/// <param name="msgId">The message id</param>
+		/// <param name="ttl">How long the messages stay useful, zero for no expiry.</param>
+		void SetMessageExpiry(T msgId, std::chrono::steady_clock::duration ttl)
+		{
+			if (ttl > std::chrono::steady_clock::duration::zero())
+				m_mapExpiry[msgId] = ttl;
+			else
+				m_mapExpiry.erase(msgId);
+		}
+
+		/// <summary>
+		/// Returns how many messages expired so far, see SetMessageExpiry().
+		/// </summary>
+		sExpiryMetrics GetExpiryMetrics()
+		{
+			sExpiryMetrics metrics;
+			metrics.nExpiredIn = m_nExpiredIn;
+			metrics.nExpiredOut = m_nExpiredOutGone;
+
+			std::scoped_lock lock(m_muxConnections);
+			for (auto& client : m_deqConnections)
 			{
-				auto msg = m_qMessagesIn.pop_front();
+				if (client)
+					metrics.nExpiredOut += client->ExpiredOut();
+			}
+			return metrics;
+		}
 
-				OnMessage(msg.remote, msg.message);
+		/// <summary>
+		/// Turns on overload protection. Update() measures how long each message waited in the incoming queue. Once none
+		/// got through under the target for a whole interval, the server is overloaded: messages sent on the shed lane
+		/// and below are dropped instead of handled, new clients are turned away, and every interval the clients are asked
+		/// to hold back their messages on those lanes, see connection::BackOff(). It is over once a message gets through
+		/// under the target or the queue runs empty. Work that is let in is handled in time, instead of everything late.
+		/// Call before Start().
+		/// </summary>
+		/// <param name="target">How long messages may wait, e.g. 5 milliseconds.</param>
+		/// <param name="interval">How long they may wait longer before the server counts as overloaded, e.g. 100 milliseconds.</param>
+		/// <param name="shedFrom">The highest priority lane whose messages are dropped while overloaded.</param>
+		void SetOverloadControl(std::chrono::steady_clock::duration target, std::chrono::steady_clock::duration interval,
+			ePriority shedFrom = ePriority::bulk)
+		{
+			m_pAdmission = std::make_unique<admission_control>(target, interval);
+			m_shedFrom = shedFrom;
+		}
 
-				nMessagecount++;
+		/// <summary>
+		/// Returns how the overload protection went so far, see SetOverloadControl().
+		/// </summary>
+		sOverloadMetrics GetOverloadMetrics() const
+		{
+			sOverloadMetrics metrics;
+			if (m_pAdmission)
+			{
+				metrics.bOverloaded = m_pAdmission->IsOverloaded();
+				metrics.delay = m_pAdmission->Delay();
 			}
+			metrics.nShed = m_nShed;
+			metrics.nRejected = m_nRejected;
+			metrics.nBackOffs = m_nBackOffs;
+			return metrics;
 		}
-	protected:
-		// Do something for specific message when Update() is called on all of them.
-		virtual void OnMessage(std::shared_ptr<connection<T>> client, sMessage<T>& message)
+
+		/// <summary>
+		/// Sets the socket options of clients connecting from now on, see sSocketOptions::Latency() and Throughput()
+		/// for presets. Links to other nodes and from proxies get them as well. The buffer sizes are set on the listening
+		/// sockets too, so accepted sockets start with them. Call before Start().
+		/// </summary>
+		/// <param name="options">The options, those left empty keep what the system gives.</param>
+		void SetSocketOptions(const sSocketOptions& options)
 		{
+			m_socketOptions = options;
+			socket_options::Apply(m_asioAcceptor, options);
+			socket_options::Apply(m_asioClusterAcceptor, options);
+			socket_options::Apply(m_asioProxyAcceptor, options);
 		}
 
-	protected:
-		// Thread safe queue for incoming message packets
-		TsQueue<sOwnedMessage<T>> m_qMessagesIn;
-		// deque of connections that came in
-		std::deque<std::shared_ptr<connection<T>>> m_deqConnections;
-		// Server specific context
-		asio::io_context m_asioContext;
-		// Server owned thread for the context.
-		std::thread m_threadContext;
-		// The acceptor object that will be filled with a function to handle incoming connections form clients.
-		asio::ip::tcp::acceptor m_asioAcceptor;
+		/// <summary>
+		/// Sets the receive window for clients connecting from now on, see connection::SetReceiveWindow(). A client sends
+		/// no more than the window ahead of what Update() handled, the rest waits on the client's end, so the incoming queue
+		/// stays bounded however far Update() falls behind. Keep it below the in-flight budget. Call before Start().
+		/// </summary>
+		/// <param name="nBytes">Body bytes a client may have waiting for Update(), 0 for no window.</param>
+		/// <param name="nMessages">Messages a client may have waiting for Update(), at least 1.</param>
+		void SetClientWindow(size_t nBytes, uint32_t nMessages = std::numeric_limits<uint32_t>::max())
+		{
+			if (nMessages == 0)
+			{
+				log::Error("Server - Client window of 0 messages turned down");
+				return;
+			}
+			m_nClientWindowBytes = nBytes;
+			m_nClientWindowMessages = nMessages;
+		}
+
+		/// <summary>
+		/// Turns on sessions for clients connecting from now on. Clients must use them too, see client_interface::EnableSession().
+		/// A client that reconnects resumes its session, and each side gets only the messages it missed.
+		/// Sessions of clients that do not come back are forgotten after the timeout. Call before Start().
+		/// </summary>
+		/// <param name="nMaxReplayBytes">How many bytes of sent messages to keep per client for a resume.</param>
+		/// <param name="timeout">How long a session waits for its client to come back.</param>
+		void EnableSessions(size_t nMaxReplayBytes, std::chrono::steady_clock::duration timeout)
+		{
+			m_nMaxReplayBytes = nMaxReplayBytes;
+			m_sessionTimeout = timeout;
+		}
+
+		/// <summary>
+		/// Turns fair dispatch on or off. When on, Update() takes turns between clients with deficit round robin,
+		/// each turn a client may use up to nQuantum bytes of messages, so one busy client cannot hold up
+		/// the others. Messages of one client stay in order. Only call from the thread that calls Update().
+		/// </summary>
+		/// <param name="nQuantum">Bytes per client and turn, 0 to handle messages in arrival order.</param>
+		void SetFairDispatch(size_t nQuantum)
+		{
+			m_nDispatchQuantum = nQuantum;
+		}
+
+		/// <summary>
+		/// Makes this server a node of a cluster. Other nodes link to it on nPort, and it links to them with ConnectToNode().
+		/// Every node must link to every other one. Clients are then addressed by their global ID across the cluster,
+		/// and messages for clients of other nodes are routed over the links, batched per link. Call before Start().
+		/// Two nodes may both link to each other. Both then send over the link the lower node ID opened and keep the
+		/// other one as a spare, which takes over if the first one breaks. Messages reach a node once its hello came in.
+		/// </summary>
+		/// <param name="nNodeId">The node's ID, unique in the cluster and not 0</param>
+		/// <param name="nPort">The port other nodes link to</param>
+		bool StartCluster(uint32_t nNodeId, uint16_t nPort)
+		{
+			m_nNodeId = nNodeId;
+
+			std::error_code ec;
+			asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), nPort);
+			m_asioClusterAcceptor.open(endpoint.protocol(), ec);
+			if (!ec)
+				m_asioClusterAcceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true), ec);
+			socket_options::Apply(m_asioClusterAcceptor, m_socketOptions);
+			if (!ec)
+				m_asioClusterAcceptor.bind(endpoint, ec);
+			if (!ec)
+				m_asioClusterAcceptor.listen(asio::socket_base::max_listen_connections, ec);
+			if (ec)
+			{
+				log::Error("Server - Cluster port ", nPort, ": ", ec);
+				return false;
+			}
+
+			WaitForNodeConnection();
+			return true;
+		}
+
+		/// <summary>
+		/// Links this node to another node of the cluster, listening with StartCluster() on host and port.
+		/// A link that breaks is not opened again, call this again to do so.
+		/// </summary>
+		bool ConnectToNode(const std::string& host, const uint16_t port)
+		{
+			try
+			{
+				asio::ip::tcp::resolver resolver(m_asioContext);
+				asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
+
+				auto pConnection = std::make_shared<connection<T>>(connection<T>::owner::client,
+					m_asioContext, asio::ip::tcp::socket(asio::make_strand(m_asioContext)), m_qMessagesIn);
+				pConnection->UseSocketOptions(m_socketOptions);
+				auto pLink = MakeLink(pConnection);
+				pLink->bDialed = true;
+				// Connecting opens the socket, the first batch is then held until the connection is established.
+				pConnection->ConnectToServer(endpoints);
+				AddLink(std::move(pLink));
+			}
+			catch (std::exception& e)
+			{
+				log::Error("Server - Link exception: ", e.what());
+				return false;
+			}
+			return true;
+		}
+
+		/// <summary>
+		/// Is there a link to the node?
+		/// </summary>
+		bool IsLinked(uint32_t nNode)
+		{
+			std::scoped_lock lock(m_muxCluster);
+			return FindLink(nNode) != nullptr;
+		}
+
+		/// <summary>
+		/// The client's ID across the cluster, made of this node's ID and the client's ID. Without a cluster it is the client's ID.
+		/// </summary>
+		uint64_t GetGlobalId(const std::shared_ptr<connection<T>>& client) const
+		{
+			return cluster::GlobalId(m_nNodeId, client->GetId());
+		}
+
+		/// <summary>
+		/// Lets clients open streams on their connection, see connection::OpenStream(). Every stream shows up as a connection
+		/// of its own and goes through OnClientConnect(), OnMessage() and the rest like any other client, while its messages
+		/// travel over the client's connection. Streams do not survive the connection, resuming its session brings none back.
+		/// Call before Start().
+		/// </summary>
+		/// <param name="bAccept">Take streams from clients?</param>
+		void AcceptStreams(bool bAccept)
+		{
+			m_bAcceptStreams = bAccept;
+		}
+
+		/// <summary>
+		/// Takes links from front-end proxies on nPort, see proxy_interface. Every client a proxy routes here shows up
+		/// as a stream of the proxy's link, see AcceptStreams(). Rate limits, sessions and capture are left to the proxy's end.
+		/// Call before Start().
+		/// </summary>
+		/// <param name="nPort">The port proxies link to</param>
+		bool AcceptProxies(uint16_t nPort)
+		{
+			std::error_code ec;
+			asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), nPort);
+			m_asioProxyAcceptor.open(endpoint.protocol(), ec);
+			if (!ec)
+				m_asioProxyAcceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true), ec);
+			socket_options::Apply(m_asioProxyAcceptor, m_socketOptions);
+			if (!ec)
+				m_asioProxyAcceptor.bind(endpoint, ec);
+			if (!ec)
+				m_asioProxyAcceptor.listen(asio::socket_base::max_listen_connections, ec);
+			if (ec)
+			{
+				log::Error("Server - Proxy port ", nPort, ": ", ec);
+				return false;
+			}
+
+			WaitForProxyConnection();
+			return true;
+		}
+
+		/// <summary>
+		/// Starts capturing the traffic of all clients into a file, for replaying it later with ReplayCapture().
+		/// Every complete message received and sent is recorded from the I/O thread with a timestamp and the client ID.
+		/// The file is sized to nMaxBytes up front, messages that do not fit anymore are dropped.
+		/// </summary>
+		/// <param name="sPath">The capture file, replaced if it exists</param>
+		/// <param name="nMaxBytes">The largest the capture may grow</param>
+		bool StartCapture(const std::string& sPath, size_t nMaxBytes)
+		{
+			auto pCapture = std::make_shared<capture_log>();
+			if (!pCapture->Open<T>(sPath, nMaxBytes))
+			{
+				log::Error("[SERVER] Cannot open capture ", sPath);
+				return false;
+			}
+
+			std::scoped_lock lock(m_muxConnections);
+			m_pCapture = pCapture;
+			for (auto& client : m_deqConnections)
+				client->UseCapture(pCapture);
+			return true;
+		}
+
+		/// <summary>
+		/// Stops capturing. The file is complete once the connections still recording into it are done.
+		/// Returns how many messages did not fit into it.
+		/// </summary>
+		uint64_t StopCapture()
+		{
+			std::scoped_lock lock(m_muxConnections);
+			if (!m_pCapture)
+				return 0;
+
+			uint64_t nDropped = m_pCapture->Dropped();
+			for (auto& client : m_deqConnections)
+				client->UseCapture(nullptr);
+			m_pCapture = nullptr;
+			return nDropped;
+		}
+
+		/// <summary>
+		/// Sets the tick rate of the server's simulation, 0 turns ticks off. While on, messages sent with MessageClient(),
+		/// MessageAllClients() and Publish() are collected per client and go out together at the end of the tick,
+		/// in one post and as few writes as possible. The game loop calls EndTick() once per tick.
+		/// </summary>
+		/// <param name="dTicksPerSecond">Ticks per second, 0 to send every message right away.</param>
+		void SetTickRate(double dTicksPerSecond)
+		{
+			// Messages collected so far go out before switching, so none wait for a tick that never ends.
+			FlushTick();
+
+			std::scoped_lock lock(m_muxTick);
+			m_tickInterval = dTicksPerSecond > 0.0
+				? std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / dTicksPerSecond))
+				: std::chrono::steady_clock::duration::zero();
+			m_tTickStart = std::chrono::steady_clock::now();
+		}
+
+		/// <summary>
+		/// Ends the current tick: sends every client the messages collected for it, then waits until the next tick starts.
+		/// A tick that took longer than the tick interval counts as an overrun, and the next one starts right away.
+		/// Only call from the thread running the game loop.
+		/// </summary>
+		void EndTick()
+		{
+			FlushTick();
+
+			std::chrono::steady_clock::time_point tNext;
+			{
+				std::scoped_lock lock(m_muxTick);
+				if (m_tickInterval == std::chrono::steady_clock::duration::zero())
+					return;
+
+				auto tNow = std::chrono::steady_clock::now();
+				auto duration = tNow - m_tTickStart;
+				m_tickMetrics.nTicks++;
+				m_tickMetrics.lastDuration = duration;
+				m_tickMetrics.maxDuration = std::max(m_tickMetrics.maxDuration, duration);
+				if (duration > m_tickInterval)
+				{
+					// Late ticks are not made up for, the schedule starts over from now.
+					m_tickMetrics.nOverruns++;
+					m_tickMetrics.totalOverrun += duration - m_tickInterval;
+					m_tTickStart = tNow;
+					return;
+				}
+
+				m_tTickStart += m_tickInterval;
+				tNext = m_tTickStart;
+			}
+			std::this_thread::sleep_until(tNext);
+		}
+
+		/// <summary>
+		/// Returns how ticks went so far, see EndTick().
+		/// </summary>
+		sTickMetrics GetTickMetrics()
+		{
+			std::scoped_lock lock(m_muxTick);
+			return m_tickMetrics;
+		}
+
+#if defined(ASIO_HAS_CO_AWAIT)
+		/// <summary>
+		/// Runs a coroutine on the server's context, e.g. a loop calling AsyncAccept() and spawning a session
+		/// coroutine per client with connection::Spawn(). Sessions talk to their client through AsyncReceive() and AsyncSend().
+		/// </summary>
+		/// <param name="session">The coroutine to run</param>
+		void Spawn(asio::awaitable<void> session)
+		{
+			asio::co_spawn(m_asioContext, std::move(session), asio::detached);
+		}
+
+		/// <summary>
+		/// Waits for the next client that OnClientConnect() approves. Its messages are delivered to
+		/// AsyncReceive() instead of the incoming queue. Use with Start(false).
+		/// </summary>
+		asio::awaitable<std::shared_ptr<connection<T>>> AsyncAccept()
+		{
+			while (true)
+			{
+				asio::ip::tcp::socket socket = co_await m_asioAcceptor.async_accept(asio::make_strand(m_asioContext), asio::use_awaitable);
+
+				std::shared_ptr<connection<T>> newconn =
+					std::make_shared<connection<T>>(connection<T>::owner::server,
+						m_asioContext, std::move(socket), m_qMessagesIn);
+
+				if (OnClientConnect(newconn))
+				{
+					newconn->UseReceive();
+					if (m_dClientMessageRate > 0.0 || m_dClientByteRate > 0.0)
+						newconn->SetRateLimit(m_dClientMessageRate, m_dClientByteRate);
+					if (m_nMaxReplayBytes > 0)
+						newconn->UseSessions(SessionFinder());
+					if (m_bAcceptStreams)
+						newconn->UseStreams(StreamAcceptor());
+					if (m_nClientWindowBytes > 0)
+						newconn->SetReceiveWindow(m_nClientWindowBytes, m_nClientWindowMessages);
+					newconn->UseWatermarks(m_pIncomingMarks, m_nClientHighMark, m_nClientLowMark);
+					newconn->UseSocketOptions(m_socketOptions);
+					{
+						std::scoped_lock lock(m_muxConnections);
+						if (m_pCapture)
+							newconn->UseCapture(m_pCapture);
+						m_deqConnections.push_back(newconn);
+					}
+					newconn->ConnectToClient(nIDCounter++);
+					co_return newconn;
+				}
+			}
+		}
+#endif
+
+	private:
+		// A link to another node of the cluster.
+		struct sLink
+		{
+			std::shared_ptr<connection<T>> pConnection;
+			// The node on the other end, 0 until its hello arrived.
+			uint32_t nNode = 0;
+			// Opened by this node with ConnectToNode()?
+			bool bDialed = false;
+			// Topics the node has subscribers to.
+			std::unordered_set<uint32_t> setTopics;
+			// Entries waiting for the next batch.
+			std::vector<uint8_t> vecPending;
+			bool bFlushPosted = false;
+		};
+
+		// Sends the message to the local clients, except the ignored one. Returns the clients found disconnected.
+		std::vector<std::shared_ptr<connection<T>>> MessageLocalClients(const std::shared_ptr<const sMessage<T>>& pMessage,
+			const std::shared_ptr<connection<T>>& pIgnoreClient)
+		{
+			std::vector<std::shared_ptr<connection<T>>> vecInvalidClients;
+
+			std::scoped_lock lock(m_muxConnections);
+			for (auto& client : m_deqConnections)
+			{
+				if (client && client->IsConnected())
+				{
+					if (client != pIgnoreClient)
+						SendOnTick(client, pMessage);
+				}
+				else
+				{
+					// Invalid client gets recognized, we do not send a message to this one
+					vecInvalidClients.push_back(client);
+				}
+			}
+			return vecInvalidClients;
+		}
+
+		// Sends the message to the local subscribers of the topic, except the ignored one. Returns the clients found disconnected.
+		std::vector<std::shared_ptr<connection<T>>> PublishLocal(uint32_t nTopic, const std::shared_ptr<const sMessage<T>>& pMessage,
+			const std::shared_ptr<connection<T>>& pIgnoreClient)
+		{
+			std::vector<std::shared_ptr<connection<T>>> vecInvalidClients;
+
+			std::scoped_lock lock(m_muxConnections);
+			auto itTopic = m_mapTopics.find(nTopic);
+			if (itTopic == m_mapTopics.end())
+				return vecInvalidClients;
+
+			for (auto& client : itTopic->second)
+			{
+				if (client->IsConnected())
+				{
+					if (client != pIgnoreClient)
+						SendOnTick(client, pMessage);
+				}
+				else
+				{
+					vecInvalidClients.push_back(client);
+				}
+			}
+			return vecInvalidClients;
+		}
+
+		std::shared_ptr<connection<T>> FindClient(uint32_t nId)
+		{
+			std::scoped_lock lock(m_muxConnections);
+			auto it = std::find_if(m_deqConnections.begin(), m_deqConnections.end(),
+				[nId](const std::shared_ptr<connection<T>>& client) { return client && client->GetId() == nId; });
+			return it != m_deqConnections.end() ? *it : nullptr;
+		}
+
+		// Accept loop for links from other nodes.
+		void WaitForNodeConnection()
+		{
+			m_asioClusterAcceptor.async_accept(asio::make_strand(m_asioContext),
+				[this](std::error_code ec, asio::ip::tcp::socket socket)
+				{
+					if (!ec)
+					{
+						std::error_code ecEndpoint;
+						log::Info("Server - New link: ", socket.remote_endpoint(ecEndpoint));
+
+						auto pConnection = std::make_shared<connection<T>>(connection<T>::owner::server,
+							m_asioContext, std::move(socket), m_qMessagesIn);
+						pConnection->UseSocketOptions(m_socketOptions);
+						auto pLink = MakeLink(pConnection);
+						pConnection->ConnectToClient();
+						AddLink(std::move(pLink));
+					}
+
+					if (m_asioClusterAcceptor.is_open())
+						WaitForNodeConnection();
+				});
+		}
+
+		// Accept loop for links from proxies.
+		void WaitForProxyConnection()
+		{
+			m_asioProxyAcceptor.async_accept(asio::make_strand(m_asioContext),
+				[this](std::error_code ec, asio::ip::tcp::socket socket)
+				{
+					if (!ec)
+					{
+						std::error_code ecEndpoint;
+						log::Info("Server - New proxy: ", socket.remote_endpoint(ecEndpoint));
+
+						auto pLink = std::make_shared<connection<T>>(connection<T>::owner::server,
+							m_asioContext, std::move(socket), m_qMessagesIn);
+						pLink->UseStreams(StreamAcceptor());
+						pLink->UseWatermarks(m_pIncomingMarks, 0, 0);
+						pLink->UseSocketOptions(m_socketOptions);
+						{
+							std::scoped_lock lock(m_muxConnections);
+							m_vecProxyLinks.erase(std::remove_if(m_vecProxyLinks.begin(), m_vecProxyLinks.end(),
+								[](const std::shared_ptr<connection<T>>& pLink) { return !pLink->IsConnected(); }), m_vecProxyLinks.end());
+							m_vecProxyLinks.push_back(pLink);
+						}
+						pLink->ConnectToClient();
+					}
+
+					if (m_asioProxyAcceptor.is_open())
+						WaitForProxyConnection();
+				});
+		}
+
+		// Takes the streams a client or proxy opens as clients of their own, see AcceptStreams().
+		std::function<bool(std::shared_ptr<connection<T>>)> StreamAcceptor()
+		{
+			return [this](std::shared_ptr<connection<T>> client)
+			{
+				return AcceptStream(std::move(client));
+			};
+		}
+
+		// A stream was opened on a connection, on the connection's strand.
+		bool AcceptStream(std::shared_ptr<connection<T>> client)
+		{
+			if (!OnClientConnect(client))
+			{
+				static log::rate_limit limit(nDeniedLinesPerSecond);
+				log::WriteLimited<log::eLevel::warning>(limit, "Stream denied!");
+				return false;
+			}
+
+			if (m_bInlineDispatch)
+				client->SetInlineHandler(InlineHandler());
+			client->UseWatermarks(m_pIncomingMarks, 0, 0);
+			{
+				std::scoped_lock lock(m_muxConnections);
+				m_deqConnections.push_back(client);
+			}
+			client->ConnectToClient(nIDCounter++);
+
+			log::Info("ID: ", client->GetId(), " Stream Approved!");
+			return true;
+		}
+
+		// Turns a connection to another node into a link, before it starts reading.
+		std::shared_ptr<sLink> MakeLink(std::shared_ptr<connection<T>> pConnection)
+		{
+			auto pLink = std::make_shared<sLink>();
+			pLink->pConnection = std::move(pConnection);
+			pLink->pConnection->UseAsLink(
+				[this, pWeakLink = std::weak_ptr<sLink>(pLink)](const std::vector<uint8_t>& batch)
+				{
+					if (auto pLink = pWeakLink.lock())
+						OnLinkBatch(*pLink, batch);
+				});
+			return pLink;
+		}
+
+		// Starts routing over a new link. The first batch tells the other node who we are and which topics we have subscribers to.
+		void AddLink(std::shared_ptr<sLink> pLink)
+		{
+			std::scoped_lock lock(m_muxConnections, m_muxCluster);
+			cluster::WriteEntry<T>(pLink->vecPending, cluster::eRoute::hello, m_nNodeId);
+			for (auto& [nTopic, vecSubscribers] : m_mapTopics)
+				cluster::WriteEntry<T>(pLink->vecPending, cluster::eRoute::subscribe, nTopic);
+			FlushLink(*pLink);
+
+			m_vecLinks.push_back(std::move(pLink));
+		}
+
+		// Handles a batch from another node, on the link's strand. Messages go to the clients of this node only.
+		void OnLinkBatch(sLink& link, const std::vector<uint8_t>& batch)
+		{
+			size_t nOffset = 0;
+			cluster::sEntry<T> entry;
+			while (nOffset < batch.size())
+			{
+				bool bValid = cluster::ReadEntry(batch, nOffset, entry);
+				if (bValid)
+				{
+					switch (entry.route)
+					{
+					case cluster::eRoute::hello:
+					{
+						std::scoped_lock lock(m_muxCluster);
+						link.nNode = static_cast<uint32_t>(entry.nTarget);
+						break;
+					}
+					case cluster::eRoute::subscribe:
+					case cluster::eRoute::unsubscribe:
+					{
+						std::scoped_lock lock(m_muxCluster);
+						if (entry.route == cluster::eRoute::subscribe)
+							link.setTopics.insert(static_cast<uint32_t>(entry.nTarget));
+						else
+							link.setTopics.erase(static_cast<uint32_t>(entry.nTarget));
+						break;
+					}
+					// Clients found disconnected are left for the next local send to clean up, not the link's thread.
+					case cluster::eRoute::client:
+					{
+						auto client = entry.pMessage ? FindClient(cluster::ClientOf(entry.nTarget)) : nullptr;
+						if (client && client->IsConnected())
+							SendOnTick(client, entry.pMessage);
+						bValid = entry.pMessage != nullptr;
+						break;
+					}
+					case cluster::eRoute::all:
+						if (entry.pMessage)
+							MessageLocalClients(entry.pMessage, nullptr);
+						bValid = entry.pMessage != nullptr;
+						break;
+					case cluster::eRoute::topic:
+						if (entry.pMessage)
+							PublishLocal(static_cast<uint32_t>(entry.nTarget), entry.pMessage, nullptr);
+						bValid = entry.pMessage != nullptr;
+						break;
+					default:
+						bValid = false;
+					}
+				}
+
+				if (!bValid)
+				{
+					log::Error("Server - Malformed batch from node ", link.nNode);
+					link.pConnection->Disconnect();
+					return;
+				}
+			}
+		}
+
+		// Returns the live link messages to the node take, nullptr if there is none. Drops links that broke.
+		// Called with m_muxCluster locked.
+		sLink* FindLink(uint32_t nNode)
+		{
+			PruneLinks();
+			return ChooseLink(nNode);
+		}
+
+		// One link to each node that said hello, see ChooseLink(). Links that broke are dropped first, and only then
+		// are the links chosen, so none of the pointers returned is to a link dropped on the way.
+		// Called with m_muxCluster locked.
+		std::vector<sLink*> NodeLinks()
+		{
+			PruneLinks();
+
+			std::unordered_set<uint32_t> setNodes;
+			for (auto& pLink : m_vecLinks)
+			{
+				if (pLink->nNode != 0)
+					setNodes.insert(pLink->nNode);
+			}
+
+			std::vector<sLink*> vecLinks;
+			for (uint32_t nNode : setNodes)
+			{
+				if (auto pLink = ChooseLink(nNode))
+					vecLinks.push_back(pLink);
+			}
+			return vecLinks;
+		}
+
+		// Drops links that broke. Called with m_muxCluster locked.
+		void PruneLinks()
+		{
+			m_vecLinks.erase(std::remove_if(m_vecLinks.begin(), m_vecLinks.end(),
+				[](const std::shared_ptr<sLink>& pLink) { return !pLink->pConnection->IsConnected(); }), m_vecLinks.end());
+		}
+
+		// The link messages to the node take, nullptr if there is none. Of two links to the same node the one the lower
+		// node ID opened is taken, so both ends agree on it. Leaves m_vecLinks as it is. Called with m_muxCluster locked.
+		sLink* ChooseLink(uint32_t nNode)
+		{
+			if (nNode == 0)
+				return nullptr;
+
+			sLink* pFound = nullptr;
+			for (auto& pLink : m_vecLinks)
+			{
+				if (pLink->nNode != nNode)
+					continue;
+				uint32_t nDialer = pLink->bDialed ? m_nNodeId : nNode;
+				if (!pFound || nDialer == std::min(m_nNodeId, nNode))
+					pFound = pLink.get();
+			}
+			return pFound;
+		}
+
+		// Adds a message to the link's next batch. Everything routed to the link until the posted flush runs goes out
+		// together, so a burst of messages takes one frame. Called with m_muxCluster locked.
+		void RouteToLink(sLink& link, cluster::eRoute route, uint64_t nTarget, const sMessage<T>& message)
+		{
+			if (!link.pConnection->IsConnected())
+				return;
+
+			cluster::WriteEntry(link.vecPending, route, nTarget, &message);
+			if (link.vecPending.size() >= cluster::nMaxBatchBytes)
+			{
+				FlushLink(link);
+			}
+			else if (!link.bFlushPosted)
+			{
+				link.bFlushPosted = true;
+				asio::post(m_asioContext,
+					[this, pConnection = link.pConnection]()
+					{
+						std::scoped_lock lock(m_muxCluster);
+						auto it = std::find_if(m_vecLinks.begin(), m_vecLinks.end(),
+							[&pConnection](const std::shared_ptr<sLink>& pLink) { return pLink->pConnection == pConnection; });
+						if (it != m_vecLinks.end())
+						{
+							(*it)->bFlushPosted = false;
+							FlushLink(**it);
+						}
+					});
+			}
+		}
+
+		// Called with m_muxCluster locked.
+		void FlushLink(sLink& link)
+		{
+			if (link.vecPending.empty())
+				return;
+
+			link.pConnection->SendLink(std::move(link.vecPending));
+			link.vecPending.clear();
+		}
+
+		// Tells the other nodes that this one has subscribers to the topic now, or none anymore.
+		// Called with m_muxConnections locked.
+		void AnnounceTopic(uint32_t nTopic, bool bSubscribed)
+		{
+			std::scoped_lock lock(m_muxCluster);
+			for (auto& pLink : m_vecLinks)
+			{
+				cluster::WriteEntry<T>(pLink->vecPending, bSubscribed ? cluster::eRoute::subscribe : cluster::eRoute::unsubscribe, nTopic);
+				FlushLink(*pLink);
+			}
+		}
+
+		// Sends the message right away, or collects it until the end of the tick if ticks are on.
+		void SendOnTick(const std::shared_ptr<connection<T>>& client, const std::shared_ptr<const sMessage<T>>& pMessage)
+		{
+			{
+				std::scoped_lock lock(m_muxTick);
+				if (m_tickInterval != std::chrono::steady_clock::duration::zero())
+				{
+					m_mapTickBatches[client].push_back(pMessage);
+					return;
+				}
+			}
+			client->Send(pMessage);
+		}
+
+		// Sends out the messages collected during the tick, one batch per client.
+		void FlushTick()
+		{
+			std::unordered_map<std::shared_ptr<connection<T>>, std::vector<std::shared_ptr<const sMessage<T>>>> mapBatches;
+			{
+				std::scoped_lock lock(m_muxTick);
+				mapBatches.swap(m_mapTickBatches);
+			}
+
+			for (auto& [client, vecMessages] : mapBatches)
+				client->SendBatch(std::move(vecMessages));
+		}
+
+		// Finds sessions for connections resuming one, or makes new ones, see connection::UseSessions().
+		std::function<std::shared_ptr<session_state<T>>(uint64_t nToken)> SessionFinder()
+		{
+			return [this](uint64_t nToken) -> std::shared_ptr<session_state<T>>
+			{
+				std::scoped_lock lock(m_muxConnections);
+
+				if (nToken != 0)
+				{
+					auto it = m_mapSessions.find(nToken);
+					return it != m_mapSessions.end() ? it->second : nullptr;
+				}
+
+				// Sessions that waited too long for their client are dropped whenever a new one starts.
+				auto tNow = std::chrono::steady_clock::now();
+				for (auto it = m_mapSessions.begin(); it != m_mapSessions.end();)
+				{
+					if (it->second->IsExpired(tNow, m_sessionTimeout))
+						it = m_mapSessions.erase(it);
+					else
+						++it;
+				}
+
+				do
+				{
+					nToken = (uint64_t(m_rdSessionTokens()) << 32) | m_rdSessionTokens();
+				} while (nToken == 0 || m_mapSessions.count(nToken) > 0);
+
+				auto pSession = std::make_shared<session_state<T>>(nToken, m_nMaxReplayBytes);
+				m_mapSessions[nToken] = pSession;
+				return pSession;
+			};
+		}
+
+		// Handler given to connections when inline dispatch is on.
+		std::function<bool(std::shared_ptr<connection<T>>, sMessage<T>&)> InlineHandler()
+		{
+			return [this](std::shared_ptr<connection<T>> client, sMessage<T>& message)
+			{
+				return OnMessageInline(client, message);
+			};
+		}
+
+		// Cleanup of a client that went AWOL, it is dropped from all topics and the deque of connections.
+		void RemoveClient(std::shared_ptr<connection<T>> client)
+		{
+			OnClientDisconnect(client);
+			UnsubscribeAll(client);
+
+			std::scoped_lock lock(m_muxConnections);
+			auto it = std::remove(m_deqConnections.begin(), m_deqConnections.end(), client);
+			// What the client dropped still counts once it is gone.
+			if (client && it != m_deqConnections.end())
+				m_nExpiredOutGone += client->ExpiredOut();
+			m_deqConnections.erase(it, m_deqConnections.end());
+		}
+
+		// Drops one entry from the subscriber list of a topic, and the topic itself once nobody listens.
+		// Called with m_muxConnections locked.
+		void RemoveSubscriber(uint32_t nTopic, connection<T>* pClient)
+		{
+			auto itTopic = m_mapTopics.find(nTopic);
+			if (itTopic == m_mapTopics.end())
+				return;
+
+			auto& vecSubscribers = itTopic->second;
+			auto it = std::find_if(vecSubscribers.begin(), vecSubscribers.end(),
+				[pClient](const std::shared_ptr<connection<T>>& subscriber) { return subscriber.get() == pClient; });
+			if (it != vecSubscribers.end())
+			{
+				*it = std::move(vecSubscribers.back());
+				vecSubscribers.pop_back();
+			}
+
+			if (vecSubscribers.empty())
+			{
+				m_mapTopics.erase(itTopic);
+				AnnounceTopic(nTopic, false);
+			}
+		}
+
+	protected:
+		// Do something when a client connects. Filters the IP address or similar things
+		virtual bool OnClientConnect(std::shared_ptr<connection<T>> client)
+		{
+			return false;
+		}
+		// Do something when a client disconnects
+		virtual void OnClientDisconnect(std::shared_ptr<connection<T>> client)
+		{
+		}
+	public:
+		/// <summary>
+		/// This function is called in a loop from your Main() function to keep server running.
+		/// Goes through all the obtained messages, calls their respective handler.
+		/// Meant to be used from the outside.
+		/// </summary>
+		/// <param name="nMaxMessages">The n maximum messages.</param>
+		void Update(size_t nMaxMessages = -1)
+		{
+			if (m_nDispatchQuantum > 0 || !m_deqDispatchTurns.empty())
+			{
+				UpdateFair(nMaxMessages);
+				return;
+			}
+
+			size_t nMessagecount = 0;
+			while (nMessagecount < nMaxMessages && !m_qMessagesIn.empty())
+			{
+				auto msg = m_qMessagesIn.pop_front();
+
+				// Taken now, so the time the message waited is right however long the messages before it took.
+				auto tNow = std::chrono::steady_clock::now();
+				if (!Admit(msg, tNow))
+					m_nShed++;
+				else if (Expired(msg, tNow))
+					m_nExpiredIn++;
+				else
+					OnMessage(msg.remote, msg.message);
+
+				if (msg.remote)
+					msg.remote->ReleaseInFlight(msg.nBudget, msg.bWindowed);
+
+				nMessagecount++;
+			}
+
+			if (m_pAdmission && m_qMessagesIn.empty())
+				m_pAdmission->Drained();
+		}
+	private:
+		// Update() with deficit round robin between clients. Everything queued so far is sorted into the queue
+		// of its client, then clients take turns, each adding the quantum to its deficit and handling messages
+		// while their size fits into it. A client whose queue runs empty leaves the turns and loses its deficit.
+		void UpdateFair(size_t nMaxMessages)
+		{
+			while (!m_qMessagesIn.empty())
+			{
+				auto msg = m_qMessagesIn.pop_front();
+				auto& dispatch = m_mapDispatch[msg.remote];
+				if (dispatch.deqMessages.empty())
+					m_deqDispatchTurns.push_back(msg.remote);
+				dispatch.deqMessages.push_back(std::move(msg));
+			}
+
+			// Turned off while messages were still sorted, these go out with a quantum big enough for any message.
+			size_t nQuantum = m_nDispatchQuantum > 0 ? m_nDispatchQuantum : size_t(-1);
+
+			size_t nMessagecount = 0;
+			while (nMessagecount < nMaxMessages && !m_deqDispatchTurns.empty())
+			{
+				auto remote = std::move(m_deqDispatchTurns.front());
+				m_deqDispatchTurns.pop_front();
+
+				auto& dispatch = m_mapDispatch[remote];
+				dispatch.nDeficit = std::min(dispatch.nDeficit, size_t(-1) - nQuantum) + nQuantum;
+
+				while (nMessagecount < nMaxMessages && !dispatch.deqMessages.empty())
+				{
+					size_t nCost = dispatch.deqMessages.front().message.size();
+					if (nCost > dispatch.nDeficit)
+						break;
+					dispatch.nDeficit -= nCost;
+
+					auto msg = std::move(dispatch.deqMessages.front());
+					dispatch.deqMessages.pop_front();
+
+					auto tNow = std::chrono::steady_clock::now();
+					if (!Admit(msg, tNow))
+						m_nShed++;
+					else if (Expired(msg, tNow))
+						m_nExpiredIn++;
+					else
+						OnMessage(msg.remote, msg.message);
+
+					if (msg.remote)
+						msg.remote->ReleaseInFlight(msg.nBudget, msg.bWindowed);
+
+					nMessagecount++;
+				}
+
+				if (dispatch.deqMessages.empty())
+					m_mapDispatch.erase(remote);
+				else
+					m_deqDispatchTurns.push_back(std::move(remote));
+			}
+
+			if (m_pAdmission && m_deqDispatchTurns.empty() && m_qMessagesIn.empty())
+				m_pAdmission->Drained();
+		}
+
+		// Measures how long the message waited. While overloaded, messages on the shed lanes are dropped, and the clients
+		// are asked to back off once an interval. Returns false if the message is dropped.
+		bool Admit(const sOwnedMessage<T>& msg, std::chrono::steady_clock::time_point tNow)
+		{
+			if (!m_pAdmission || !m_pAdmission->Dequeued(tNow - msg.tQueued, tNow))
+				return true;
+
+			if (tNow >= m_tNextBackOff)
+			{
+				m_tNextBackOff = tNow + m_pAdmission->Interval();
+				auto backOff = std::chrono::duration_cast<std::chrono::milliseconds>(m_pAdmission->Interval());
+
+				std::scoped_lock lock(m_muxConnections);
+				for (auto& client : m_deqConnections)
+				{
+					if (client)
+						client->BackOff(backOff, m_shedFrom);
+				}
+				m_nBackOffs++;
+			}
+
+			size_t nLane = (msg.message.header.flags & frame::laneMask) >> frame::laneShift;
+			return nLane < static_cast<size_t>(m_shedFrom);
+		}
+
+		// Whether the message waited past its deadline, its own or the one of its id.
+		bool Expired(const sOwnedMessage<T>& msg, std::chrono::steady_clock::time_point tNow) const
+		{
+			if (msg.message.Expired(tNow))
+				return true;
+
+			auto it = m_mapExpiry.find(msg.message.header.id);
+			return it != m_mapExpiry.end() && tNow - msg.tQueued > it->second;
+		}
+
+		// Copies an outgoing message once, to be shared by everyone it goes to, with the deadline of its id.
+		std::shared_ptr<const sMessage<T>> Share(const sMessage<T>& message) const
+		{
+			auto pMessage = std::make_shared<sMessage<T>>(message);
+			auto it = m_mapExpiry.find(message.header.id);
+			if (it != m_mapExpiry.end() && message.deadline == std::chrono::steady_clock::time_point{})
+				pMessage->deadline = std::chrono::steady_clock::now() + it->second;
+			return pMessage;
+		}
+
+	protected:
+		// Called on a graceful stop, before the listening socket is closed. Return true if the acceptor was handed off,
+		// e.g. its native handle released to a process taking over the port, and must not be closed here.
+		virtual bool OnHandOffListener(asio::ip::tcp::acceptor& /*acceptor*/)
+		{
+			return false;
+		}
+
+		// Do something for specific message when Update() is called on all of them.
+		virtual void OnMessage(std::shared_ptr<connection<T>> client, sMessage<T>& message)
+		{
+		}
+		// With inline dispatch, called on the I/O thread for every message as soon as it is read.
+		// Return false for messages whose handling blocks or takes long, they then go through Update() and OnMessage().
+		// Leave the message untouched when returning false.
+		virtual bool OnMessageInline(std::shared_ptr<connection<T>> client, sMessage<T>& message)
+		{
+			OnMessage(client, message);
+			return true;
+		}
+
+	protected:
+		// Thread safe queue for incoming message packets
+		TsQueue<sOwnedMessage<T>> m_qMessagesIn;
+		// Guards the deque of connections and the topics, they are used from the I/O threads and from Update().
+		std::mutex m_muxConnections;
+		// deque of connections that came in
+		std::deque<std::shared_ptr<connection<T>>> m_deqConnections;
+		// Subscribers of each topic, kept in a flat list so publishing just walks it.
+		std::unordered_map<uint32_t, std::vector<std::shared_ptr<connection<T>>>> m_mapTopics;
+		// Topics of each client by its ID, so a leaving client is removed without searching every topic.
+		std::unordered_map<uint32_t, std::vector<uint32_t>> m_mapClientTopics;
+		// Server specific context
+		asio::io_context m_asioContext;
+		// Server owned threads for the context.
+		std::vector<std::thread> m_vecThreadContext;
+		// Keeps the context running when there is no accept loop.
+		std::optional<asio::executor_work_guard<asio::io_context::executor_type>> m_workGuard;
+		// The acceptor object that will be filled with a function to handle incoming connections form clients.
+		asio::ip::tcp::acceptor m_asioAcceptor;
+		// Cleared on a graceful stop, so the accept loop ends. Only touched on the acceptor's strand.
+		bool m_bAccepting = true;
+
+		// Are messages handled on the I/O thread? Set by any thread, read by the accept handlers.
+		std::atomic<bool> m_bInlineDispatch = false;
+		// Clients may open streams, see AcceptStreams().
+		bool m_bAcceptStreams = false;
+
+		// Sessions by token, guarded by m_muxConnections. Each token is drawn from the system's random source, which random_device
+		// is with MSVC and libstdc++, so the tokens a client has seen do not tell it the next ones.
+		std::unordered_map<uint64_t, std::shared_ptr<session_state<T>>> m_mapSessions;
+		size_t m_nMaxReplayBytes = 0;
+		std::chrono::steady_clock::duration m_sessionTimeout{};
+		std::random_device m_rdSessionTokens;
+
+		// Denied and failed accepts are logged at most this often.
+		static constexpr uint32_t nDeniedLinesPerSecond = 20;
+
+		// Rate limit given to new clients, 0 for none.
+		double m_dClientMessageRate = 0.0;
+		double m_dClientByteRate = 0.0;
+		// Watermarks of the incoming queue, see SetIncomingWatermarks().
+		std::shared_ptr<watermark> m_pIncomingMarks;
+		size_t m_nClientHighMark = 0;
+		size_t m_nClientLowMark = 0;
+		// Socket options given to new clients.
+		sSocketOptions m_socketOptions;
+		// Receive window given to new clients, 0 for none.
+		size_t m_nClientWindowBytes = 0;
+		uint32_t m_nClientWindowMessages = 0;
+		// Time to live of message ids, see SetMessageExpiry(), and the messages that expired.
+		std::unordered_map<T, std::chrono::steady_clock::duration> m_mapExpiry;
+		std::atomic<uint64_t> m_nExpiredIn = 0;
+		std::atomic<uint64_t> m_nExpiredOutGone = 0;
+		// Overload protection, see SetOverloadControl(). The next back-off is only touched by the thread calling Update().
+		std::unique_ptr<admission_control> m_pAdmission;
+		ePriority m_shedFrom = ePriority::bulk;
+		std::chrono::steady_clock::time_point m_tNextBackOff{};
+		std::atomic<uint64_t> m_nShed = 0;
+		std::atomic<uint64_t> m_nRejected = 0;
+		std::atomic<uint64_t> m_nBackOffs = 0;
+
+		// Fair dispatch state, only touched by the thread calling Update().
+		struct sDispatchQueue
+		{
+			std::deque<sOwnedMessage<T>> deqMessages;
+			size_t nDeficit = 0;
+		};
+		size_t m_nDispatchQuantum = 0;
+		std::unordered_map<std::shared_ptr<connection<T>>, sDispatchQueue> m_mapDispatch;
+		// Clients with messages waiting, in the order of their turns.
+		std::deque<std::shared_ptr<connection<T>>> m_deqDispatchTurns;
+
+		// Cluster state. The links are guarded by m_muxCluster, taken after m_muxConnections if both are needed.
+		uint32_t m_nNodeId = 0;
+		asio::ip::tcp::acceptor m_asioClusterAcceptor;
+		std::mutex m_muxCluster;
+		std::vector<std::shared_ptr<sLink>> m_vecLinks;
+
+		// Links from front-end proxies, guarded by m_muxConnections.
+		asio::ip::tcp::acceptor m_asioProxyAcceptor;
+		std::vector<std::shared_ptr<connection<T>>> m_vecProxyLinks;
+
+		// Traffic capture given to every client, guarded by m_muxConnections.
+		std::shared_ptr<capture_log> m_pCapture;
+
+		// Tick state. Guarded by m_muxTick, because messages are collected from any thread. Taken after
+		// m_muxConnections if both are needed.
+		std::mutex m_muxTick;
+		std::chrono::steady_clock::duration m_tickInterval{};
+		std::chrono::steady_clock::time_point m_tTickStart;
+		sTickMetrics m_tickMetrics;
+		// Messages for each client collected during the current tick.
+		std::unordered_map<std::shared_ptr<connection<T>>, std::vector<std::shared_ptr<const sMessage<T>>>> m_mapTickBatches;
 
 		// clients will be represented by a unique ID
-		uint32_t nIDCounter = 10000;
+		std::atomic<uint32_t> nIDCounter = 10000;
 	};
 }
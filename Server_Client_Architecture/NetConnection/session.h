@@ -0,0 +1,186 @@
+#pragma once
+#include "include.h"
+#include "Message.h"
+
+namespace net
+{
+	// Sequence numbers and the replay buffer of a session. A session outlives its connection, so a client that
+	// reconnects carries on where it left off and both ends send again only what the other one did not get.
+	// Messages are numbered implicitly in the order they complete on the wire, which is the same on both ends,
+	// so no numbers travel with them. Only acks and the resume handshake are sent, as control frames.
+	// Guarded by a mutex, because the connection that owned a session may still be around when a new one takes it.
+	template <typename T>
+	class session_state
+	{
+	public:
+		session_state(uint64_t nToken, size_t nMaxReplayBytes)
+			: m_nToken(nToken), m_nMaxReplayBytes(nMaxReplayBytes)
+		{
+		}
+
+		uint64_t GetToken() const
+		{
+			std::scoped_lock lock(m_mux);
+			return m_nToken;
+		}
+
+		// Starts numbering from scratch under a new token, for a session the peer could not resume.
+		void Reset(const void* pOwner, uint64_t nToken)
+		{
+			std::scoped_lock lock(m_mux);
+			m_nToken = nToken;
+			m_pOwner = pOwner;
+			m_nSent = 0;
+			m_nReceived = 0;
+			m_nReceivedAcked = 0;
+			m_deqReplay.clear();
+			m_nReplayBytes = 0;
+			m_vecUnsent.clear();
+		}
+
+		// Keeps a message the owner has completely written until the peer acks it. The oldest messages
+		// are dropped when the buffer is full, the session then cannot be resumed from before them.
+		// Returns false if pOwner no longer owns the session.
+		bool Sent(const void* pOwner, std::shared_ptr<const sMessage<T>> pMessage)
+		{
+			std::scoped_lock lock(m_mux);
+			if (pOwner != m_pOwner)
+				return false;
+
+			m_nSent++;
+			m_nReplayBytes += pMessage->size();
+			m_deqReplay.push_back(std::move(pMessage));
+
+			while (m_nReplayBytes > m_nMaxReplayBytes && !m_deqReplay.empty())
+			{
+				m_nReplayBytes -= m_deqReplay.front()->size();
+				m_deqReplay.pop_front();
+			}
+			return true;
+		}
+
+		// Counts a message the owner received. nAck is set to the count to acknowledge, or 0 if no ack is due yet.
+		// Returns false if pOwner no longer owns the session.
+		bool Received(const void* pOwner, uint64_t& nAck)
+		{
+			std::scoped_lock lock(m_mux);
+			if (pOwner != m_pOwner)
+				return false;
+
+			m_nReceived++;
+			nAck = 0;
+			if (m_nReceived - m_nReceivedAcked >= nAckInterval)
+			{
+				m_nReceivedAcked = m_nReceived;
+				nAck = m_nReceived;
+			}
+			return true;
+		}
+
+		// The peer has received nCount of our messages, they no longer need to be kept.
+		void Acked(const void* pOwner, uint64_t nCount)
+		{
+			std::scoped_lock lock(m_mux);
+			if (pOwner != m_pOwner)
+				return;
+
+			while (!m_deqReplay.empty() && FirstBuffered() < nCount)
+			{
+				m_nReplayBytes -= m_deqReplay.front()->size();
+				m_deqReplay.pop_front();
+			}
+		}
+
+		// Messages received so far, the peer replays everything after them.
+		uint64_t ReceivedCount() const
+		{
+			std::scoped_lock lock(m_mux);
+			return m_nReceived;
+		}
+
+		// Number of the oldest message still buffered, the peer must have received everything before it.
+		uint64_t ReplayFrom() const
+		{
+			std::scoped_lock lock(m_mux);
+			return FirstBuffered();
+		}
+
+		// Makes pOwner the owner after the peer received nPeerReceived of our messages, and hands out the ones
+		// it missed, in order, followed by those the previous owner never got to write. These count as not sent yet,
+		// the new owner sends them like new ones. Fails if some of them were already dropped from the buffer.
+		// A write can reach the peer and still be cut short by the close before it counts here, so the peer may
+		// have received the first of the unsent messages too. Those are skipped.
+		bool Resume(const void* pOwner, uint64_t nPeerReceived, std::vector<std::shared_ptr<const sMessage<T>>>& vecReplay)
+		{
+			std::scoped_lock lock(m_mux);
+			if (nPeerReceived < FirstBuffered() || nPeerReceived > m_nSent + m_vecUnsent.size())
+				return false;
+
+			m_pOwner = pOwner;
+			m_nReceivedAcked = m_nReceived;
+
+			if (nPeerReceived <= m_nSent)
+			{
+				size_t nSkip = static_cast<size_t>(nPeerReceived - FirstBuffered());
+				vecReplay.assign(m_deqReplay.begin() + nSkip, m_deqReplay.end());
+				vecReplay.insert(vecReplay.end(), m_vecUnsent.begin(), m_vecUnsent.end());
+			}
+			else
+			{
+				size_t nSkip = static_cast<size_t>(nPeerReceived - m_nSent);
+				vecReplay.assign(m_vecUnsent.begin() + nSkip, m_vecUnsent.end());
+			}
+
+			m_vecUnsent.clear();
+			m_deqReplay.clear();
+			m_nReplayBytes = 0;
+			m_nSent = nPeerReceived;
+			return true;
+		}
+
+		// The owner's connection is gone, the session waits for a resume from now on.
+		// vecUnsent are the messages still queued on it, they go out after a resume.
+		void Closed(const void* pOwner, std::vector<std::shared_ptr<const sMessage<T>>> vecUnsent)
+		{
+			std::scoped_lock lock(m_mux);
+			if (pOwner != m_pOwner)
+				return;
+
+			m_vecUnsent = std::move(vecUnsent);
+			m_pOwner = nullptr;
+			m_tClosed = std::chrono::steady_clock::now();
+		}
+
+		// Has the session waited for a resume for longer than the timeout?
+		bool IsExpired(std::chrono::steady_clock::time_point tNow, std::chrono::steady_clock::duration timeout) const
+		{
+			std::scoped_lock lock(m_mux);
+			return m_pOwner == nullptr && tNow - m_tClosed > timeout;
+		}
+
+	private:
+		uint64_t FirstBuffered() const
+		{
+			return m_nSent - m_deqReplay.size();
+		}
+
+	private:
+		// Received messages are acked in batches of this many.
+		static constexpr uint64_t nAckInterval = 16;
+
+		mutable std::mutex m_mux;
+		uint64_t m_nToken = 0;
+		// Connection the session belongs to at the moment, nullptr while it waits for a resume.
+		const void* m_pOwner = nullptr;
+		std::chrono::steady_clock::time_point m_tClosed = std::chrono::steady_clock::now();
+		uint64_t m_nSent = 0;
+		uint64_t m_nReceived = 0;
+		uint64_t m_nReceivedAcked = 0;
+		// The most recently sent messages, the last one is number m_nSent.
+		std::deque<std::shared_ptr<const sMessage<T>>> m_deqReplay;
+		size_t m_nReplayBytes = 0;
+		size_t m_nMaxReplayBytes = 0;
+		// Messages the last owner had queued but not written when it closed.
+		std::vector<std::shared_ptr<const sMessage<T>>> m_vecUnsent;
+	};
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include "include.h"
+
+namespace net
+{
+	// Delta encoding for state snapshots, see connection::SendSnapshot(). A delta is the XOR of the new state with
+	// the base state, stored as runs: how many bytes are unchanged, then how many changed bytes follow and their XOR.
+	// States are compared byte by byte, so fixed layouts where fields stay at the same offset give the smallest deltas.
+	namespace snapshot
+	{
+		// How many snapshots of a stream each end keeps as possible bases for deltas.
+		constexpr size_t nHistory = 32;
+
+		// Bytes a snapshot message carries after the state or delta: the base sequence and the sequence.
+		constexpr size_t nTrailer = 2 * sizeof(uint32_t);
+
+		// Encoded deltas start with the size of the new state, followed by the runs.
+		inline bool EncodeDelta(const std::vector<uint8_t>& base, const std::vector<uint8_t>& state, std::vector<uint8_t>& out)
+		{
+			out.clear();
+			uint32_t nSize = static_cast<uint32_t>(state.size());
+			out.insert(out.end(), reinterpret_cast<const uint8_t*>(&nSize), reinterpret_cast<const uint8_t*>(&nSize) + sizeof(nSize));
+
+			auto Diff = [&base, &state](size_t i) -> uint8_t
+			{
+				return state[i] ^ (i < base.size() ? base[i] : 0);
+			};
+
+			size_t i = 0;
+			while (i < state.size())
+			{
+				size_t nStart = i;
+				while (i < state.size() && i - nStart < 0xFFFF && Diff(i) == 0)
+					i++;
+				uint16_t nSkip = static_cast<uint16_t>(i - nStart);
+
+				nStart = i;
+				while (i < state.size() && i - nStart < 0xFFFF && Diff(i) != 0)
+					i++;
+				uint16_t nLength = static_cast<uint16_t>(i - nStart);
+
+				out.insert(out.end(), reinterpret_cast<const uint8_t*>(&nSkip), reinterpret_cast<const uint8_t*>(&nSkip) + sizeof(nSkip));
+				out.insert(out.end(), reinterpret_cast<const uint8_t*>(&nLength), reinterpret_cast<const uint8_t*>(&nLength) + sizeof(nLength));
+				for (size_t j = nStart; j < i; j++)
+					out.push_back(Diff(j));
+
+				// Not worth it once the delta grows as big as the state itself.
+				if (out.size() >= state.size())
+					return false;
+			}
+			return true;
+		}
+
+		// Rebuilds a state from its base and an encoded delta. Fails on malformed input or states larger than nMaxSize.
+		inline bool DecodeDelta(const std::vector<uint8_t>& base, const uint8_t* pDelta, size_t nDelta, std::vector<uint8_t>& out, size_t nMaxSize)
+		{
+			uint32_t nSize;
+			if (nDelta < sizeof(nSize))
+				return false;
+			std::memcpy(&nSize, pDelta, sizeof(nSize));
+			if (nSize > nMaxSize)
+				return false;
+
+			out.assign(base.begin(), base.begin() + std::min<size_t>(base.size(), nSize));
+			out.resize(nSize, 0);
+
+			size_t ip = sizeof(nSize);
+			size_t i = 0;
+			while (ip < nDelta)
+			{
+				uint16_t nSkip, nLength;
+				if (nDelta - ip < sizeof(nSkip) + sizeof(nLength))
+					return false;
+				std::memcpy(&nSkip, pDelta + ip, sizeof(nSkip));
+				std::memcpy(&nLength, pDelta + ip + sizeof(nSkip), sizeof(nLength));
+				ip += sizeof(nSkip) + sizeof(nLength);
+
+				i += nSkip;
+				if (nLength > nDelta - ip || i + nLength > out.size())
+					return false;
+				for (size_t j = 0; j < nLength; j++)
+					out[i + j] ^= pDelta[ip + j];
+				ip += nLength;
+				i += nLength;
+			}
+			return true;
+		}
+	}
+
+	// Snapshots of one stream sent on a connection. Kept until the peer acks them, because the next delta
+	// is made against the newest state the peer acked.
+	struct sSnapshotStreamOut
+	{
+		uint32_t nSequence = 0;
+		// Sequence the peer acked last, 0 if none, then the next snapshot is sent in full.
+		uint32_t nAcked = 0;
+		std::deque<std::pair<uint32_t, std::shared_ptr<const std::vector<uint8_t>>>> deqSent;
+	};
+
+	// Snapshots of one stream received on a connection, the peer makes deltas against any of them it saw acked.
+	struct sSnapshotStreamIn
+	{
+		std::deque<std::pair<uint32_t, std::vector<uint8_t>>> deqStates;
+	};
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include "include.h"
+
+namespace net
+{
+	// Options set on the sockets of connections, see server_interface::SetSocketOptions() and client_interface::SetSocketOptions().
+	// Options left empty keep what the system gives. Those not known on a platform are skipped there.
+	struct sSocketOptions
+	{
+		// Small frames go out right away instead of waiting for more to fill a packet.
+		std::optional<bool> bNoDelay;
+		// Sizes of the kernel's socket buffers in bytes. Bigger ones keep a fast link busy, smaller ones queue less.
+		std::optional<int> nSendBuffer;
+		std::optional<int> nReceiveBuffer;
+		// Acknowledges every read right away instead of delaying the acks. Linux turns it off again by itself,
+		// so it is set again before every read.
+		std::optional<bool> bQuickAck;
+		// Probes a connection that went quiet, so a peer that vanished is noticed. Idle seconds before the first probe,
+		// seconds between probes, and probes without an answer before the connection is dropped. 0 keeps the system's.
+		std::optional<bool> bKeepAlive;
+		int nKeepAliveIdle = 0;
+		int nKeepAliveInterval = 0;
+		int nKeepAliveCount = 0;
+		// Microseconds a read spins on the device queue before it sleeps. Linux only.
+		std::optional<int> nBusyPoll;
+		// Bytes not sent yet above which the socket does not take more. What is not taken waits in the lanes instead,
+		// where a higher priority message can still overtake it.
+		std::optional<int> nNotSentLowat;
+
+		// Replies as soon as possible: small frames and acks are not held back, little waits unsent in the socket
+		// where nothing can overtake it, and reads spin briefly.
+		static sSocketOptions Latency()
+		{
+			sSocketOptions options;
+			options.bNoDelay = true;
+			options.bQuickAck = true;
+			options.bKeepAlive = true;
+			options.nKeepAliveIdle = 30;
+			options.nKeepAliveInterval = 5;
+			options.nKeepAliveCount = 3;
+			options.nBusyPoll = 50;
+			options.nNotSentLowat = 16 * 1024;
+			return options;
+		}
+
+		// Moves as many bytes as possible: frames and acks are batched, and the buffers cover a fast link with some delay.
+		static sSocketOptions Throughput()
+		{
+			sSocketOptions options;
+			options.bNoDelay = false;
+			options.bQuickAck = false;
+			options.bKeepAlive = true;
+			options.nSendBuffer = 4 * 1024 * 1024;
+			options.nReceiveBuffer = 4 * 1024 * 1024;
+			return options;
+		}
+	};
+
+	namespace socket_options
+	{
+		template <int nLevel, int nName>
+		using integer = asio::detail::socket_option::integer<nLevel, nName>;
+
+		// Options that could not be set are logged at most this often.
+		constexpr uint32_t nFailedLinesPerSecond = 20;
+
+		// Sets one option, a failure is logged and the others are set still.
+		template <typename Socket, typename Option>
+		void Set(Socket& socket, const Option& option, const char* szName)
+		{
+			std::error_code ec;
+			socket.set_option(option, ec);
+			if (ec)
+			{
+				static log::rate_limit limit(nFailedLinesPerSecond);
+				log::WriteLimited<log::eLevel::warning>(limit, "Socket option ", szName, " not set: ", ec);
+			}
+		}
+
+		// Linux only, see sSocketOptions::bQuickAck.
+		inline void QuickAck(asio::ip::tcp::socket& socket, bool bQuickAck)
+		{
+#if defined(TCP_QUICKACK)
+			std::error_code ec;
+			socket.set_option(integer<IPPROTO_TCP, TCP_QUICKACK>(bQuickAck ? 1 : 0), ec);
+#endif
+		}
+
+		// Sets the options that are given on an open socket or acceptor. Acceptors pass the buffer sizes on to the sockets
+		// they accept, which have to have them before the connection is set up for the window to scale to them.
+		template <typename Socket>
+		void Apply(Socket& socket, const sSocketOptions& options)
+		{
+			if (!socket.is_open())
+				return;
+
+			if (options.nSendBuffer)
+				Set(socket, asio::socket_base::send_buffer_size(*options.nSendBuffer), "SO_SNDBUF");
+			if (options.nReceiveBuffer)
+				Set(socket, asio::socket_base::receive_buffer_size(*options.nReceiveBuffer), "SO_RCVBUF");
+
+			if constexpr (std::is_same_v<Socket, asio::ip::tcp::socket>)
+			{
+				if (options.bNoDelay)
+					Set(socket, asio::ip::tcp::no_delay(*options.bNoDelay), "TCP_NODELAY");
+				if (options.bKeepAlive)
+					Set(socket, asio::socket_base::keep_alive(*options.bKeepAlive), "SO_KEEPALIVE");
+				if (options.bKeepAlive.value_or(false))
+				{
+#if defined(TCP_KEEPIDLE)
+					if (options.nKeepAliveIdle > 0)
+						Set(socket, integer<IPPROTO_TCP, TCP_KEEPIDLE>(options.nKeepAliveIdle), "TCP_KEEPIDLE");
+#endif
+#if defined(TCP_KEEPINTVL)
+					if (options.nKeepAliveInterval > 0)
+						Set(socket, integer<IPPROTO_TCP, TCP_KEEPINTVL>(options.nKeepAliveInterval), "TCP_KEEPINTVL");
+#endif
+#if defined(TCP_KEEPCNT)
+					if (options.nKeepAliveCount > 0)
+						Set(socket, integer<IPPROTO_TCP, TCP_KEEPCNT>(options.nKeepAliveCount), "TCP_KEEPCNT");
+#endif
+				}
+#if defined(SO_BUSY_POLL)
+				if (options.nBusyPoll)
+					Set(socket, integer<SOL_SOCKET, SO_BUSY_POLL>(*options.nBusyPoll), "SO_BUSY_POLL");
+#endif
+#if defined(TCP_NOTSENT_LOWAT)
+				if (options.nNotSentLowat)
+					Set(socket, integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT>(*options.nNotSentLowat), "TCP_NOTSENT_LOWAT");
+#endif
+				if (options.bQuickAck)
+					QuickAck(socket, *options.bQuickAck);
+			}
+		}
+	}
+}
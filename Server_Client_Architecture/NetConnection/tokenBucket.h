@@ -0,0 +1,63 @@
+#pragma once
+#include "include.h"
+
+namespace net
+{
+	// A token bucket used for rate limits. It refills at a fixed rate up to its burst size.
+	// Consuming may leave it in debt, Delay() then tells how long until it is paid back.
+	class token_bucket
+	{
+	public:
+		// dRate tokens per second, at most dBurst saved up. A rate of 0 turns the limit off.
+		void Configure(double dRate, double dBurst)
+		{
+			m_dRate = dRate;
+			m_dBurst = dBurst;
+			m_dTokens = dBurst;
+			m_tLast = std::chrono::steady_clock::now();
+		}
+
+		bool IsLimited() const
+		{
+			return m_dRate > 0.0;
+		}
+
+		void Consume(double dTokens)
+		{
+			if (!IsLimited())
+				return;
+
+			Refill();
+			m_dTokens -= dTokens;
+		}
+
+		// Time until the bucket is out of debt, zero if it is not in debt.
+		std::chrono::steady_clock::duration Delay()
+		{
+			if (!IsLimited())
+				return std::chrono::steady_clock::duration::zero();
+
+			Refill();
+			if (m_dTokens >= 0.0)
+				return std::chrono::steady_clock::duration::zero();
+
+			return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(-m_dTokens / m_dRate));
+		}
+
+	private:
+		void Refill()
+		{
+			auto tNow = std::chrono::steady_clock::now();
+			std::chrono::duration<double> elapsed = tNow - m_tLast;
+			m_tLast = tNow;
+			m_dTokens = std::min(m_dBurst, m_dTokens + elapsed.count() * m_dRate);
+		}
+
+	private:
+		double m_dRate = 0.0;
+		double m_dBurst = 0.0;
+		double m_dTokens = 0.0;
+		std::chrono::steady_clock::time_point m_tLast;
+	};
+}
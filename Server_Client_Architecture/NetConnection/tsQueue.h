@@ -66,6 +66,22 @@ namespace net
 			myDeque.pop_front();
 			return item;
 		}
+		// Replace the first element matching the predicate with the input, ignoring the first nSkip elements.
+		// Returns false if nothing matched, so the caller can append the input instead.
+		template <typename Predicate>
+		bool replace_if(Predicate pred, const T& input, size_t nSkip = 0)
+		{
+			std::scoped_lock lock(myMutex);
+			if (nSkip >= myDeque.size())
+				return false;
+
+			auto it = std::find_if(myDeque.begin() + nSkip, myDeque.end(), pred);
+			if (it == myDeque.end())
+				return false;
+
+			*it = input;
+			return true;
+		}
 		// Remove and return the item at the back of the queue.
 		T pop_back()
 		{
@@ -0,0 +1,77 @@
+#pragma once
+#include "include.h"
+
+namespace net
+{
+	// High and low watermarks on the bytes waiting in an incoming queue. Once they reach the high mark, reading pauses,
+	// and it resumes once they are back under the low mark. Connections that find reading paused park a function
+	// to resume them, which is called when that happens. Shared by all connections filling the same queue.
+	class watermark
+	{
+	public:
+		watermark(size_t nHigh, size_t nLow) : m_nHigh(nHigh), m_nLow(std::min(nLow, nHigh))
+		{
+		}
+
+		// Bytes were queued.
+		void Add(size_t nBytes)
+		{
+			size_t nTotal = m_nBytes.fetch_add(nBytes) + nBytes;
+			if (nTotal >= m_nHigh && !m_bPaused)
+			{
+				std::scoped_lock lock(m_muxWaiting);
+				if (m_nBytes >= m_nHigh)
+					m_bPaused = true;
+			}
+		}
+
+		// Queued bytes were handled. Wakes the parked connections once under the low mark. The flag is only looked at
+		// under the lock, where Add() checks the bytes and sets it in one go, so a pause is never missed.
+		void Release(size_t nBytes)
+		{
+			size_t nTotal = m_nBytes.fetch_sub(nBytes) - nBytes;
+			if (nTotal >= m_nLow)
+				return;
+
+			std::vector<std::function<void()>> vecWaiting;
+			{
+				std::scoped_lock lock(m_muxWaiting);
+				if (!m_bPaused || m_nBytes >= m_nLow)
+					return;
+				m_bPaused = false;
+				vecWaiting.swap(m_vecWaiting);
+			}
+			for (auto& fnResume : vecWaiting)
+				fnResume();
+		}
+
+		// Keeps fnResume until reading resumes. Returns false if reading is not paused, the caller goes on reading then.
+		bool Park(std::function<void()> fnResume)
+		{
+			std::scoped_lock lock(m_muxWaiting);
+			if (!m_bPaused)
+				return false;
+
+			m_vecWaiting.push_back(std::move(fnResume));
+			return true;
+		}
+
+		bool IsPaused() const
+		{
+			return m_bPaused;
+		}
+
+		size_t Bytes() const
+		{
+			return m_nBytes;
+		}
+
+	private:
+		const size_t m_nHigh;
+		const size_t m_nLow;
+		std::atomic<size_t> m_nBytes = 0;
+		std::atomic<bool> m_bPaused = false;
+		std::mutex m_muxWaiting;
+		std::vector<std::function<void()>> m_vecWaiting;
+	};
+}
@@ -0,0 +1,484 @@
+#include "Tests.h"
+
+using namespace tests;
+
+namespace
+{
+	// A frame as it goes over the wire, the header followed by nBody bytes.
+	std::vector<uint8_t> RawFrame(eMsg id, uint16_t nSize, size_t nBody)
+	{
+		net::sMessageHeader<eMsg> header;
+		header.id = id;
+		header.size = nSize;
+		std::vector<uint8_t> vecBytes(sizeof(header) + nBody, 0);
+		std::memcpy(vecBytes.data(), &header, sizeof(header));
+		return vecBytes;
+	}
+
+	// Writes the bytes to the server on a plain socket and reads until the server closes the connection or a second
+	// has passed. Returns whether it was closed, and the bytes read.
+	std::pair<bool, std::vector<uint8_t>> SendRaw(uint16_t nPort, const std::vector<uint8_t>& vecBytes)
+	{
+		asio::io_context context;
+		asio::ip::tcp::socket socket(context);
+		socket.connect({ asio::ip::make_address("127.0.0.1"), nPort });
+		asio::write(socket, asio::buffer(vecBytes));
+
+		bool bClosed = false;
+		std::vector<uint8_t> vecRead;
+		std::array<uint8_t, 1024> buffer;
+		std::function<void(std::error_code, size_t)> fnRead = [&](std::error_code ec, size_t nRead)
+		{
+			vecRead.insert(vecRead.end(), buffer.begin(), buffer.begin() + nRead);
+			if (ec)
+				bClosed = true;
+			else
+				socket.async_read_some(asio::buffer(buffer), fnRead);
+		};
+		socket.async_read_some(asio::buffer(buffer), fnRead);
+		context.run_for(std::chrono::seconds(1));
+		return { bClosed, vecRead };
+	}
+}
+
+// A message makes it to the server and back.
+TEST(RoundTrip)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return client.IsConnected(); }));
+
+	client.Connection().Send(MakeMessage(eMsg::echo, 42));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty(); }));
+	CHECK(ValueOf(client.Incoming().pop_front().message) == 42);
+}
+
+// A client that could not reach any endpoint is not connected, nobody listens on the port.
+TEST(ConnectFails)
+{
+	uint16_t nPort = NextPort();
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return !client.IsConnected(); }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	CHECK(!client.IsConnected());
+}
+
+// Replaceable updates queued while the client may not send coalesce to the latest one, the one that started going
+// out aside. Requests with a replaceable id are not coalesced, each of them gets its response.
+TEST(ReplaceableCoalesces)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetClientWindow(1 << 20, 1);
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	client.Connection().Send(MakeMessage(eMsg::echo, 0));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty() && client.Connection().CanSend(); }));
+
+	client.Connection().SetReplaceable(eMsg::data);
+	client.Connection().SetReplaceable(eMsg::call);
+	// Uses up the window, the rest waits on the lane.
+	client.Connection().Send(MakeMessage(eMsg::data, 0));
+
+	std::atomic<int> nAnswered = 0;
+	auto fnCall = [&](uint32_t nValue)
+	{
+		client.Connection().Request(MakeMessage(eMsg::call, nValue), std::chrono::seconds(5),
+			[&nAnswered, nValue](std::error_code ec, net::sMessage<eMsg> response)
+			{
+				if (!ec && ValueOf(response) == nValue)
+					nAnswered++;
+			});
+	};
+	client.Connection().Send(MakeMessage(eMsg::data, 1));
+	fnCall(7);
+	for (uint32_t i = 2; i <= 100; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i));
+	fnCall(8);
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return nAnswered == 2 && server.m_vecReceived.size() >= 3; }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	server.Update();
+	CHECK((server.m_vecReceived == std::vector<uint32_t>{ 0, 1, 100 }));
+}
+
+// Many requests outstanding at once are each answered with their own response, whatever order they complete in.
+TEST(PipelinedRequests)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return client.IsConnected(); }));
+
+	std::atomic<uint32_t> nAnswered = 0;
+	std::atomic<uint32_t> nMismatched = 0;
+	for (uint32_t i = 0; i < 100; i++)
+		client.Connection().Request(MakeMessage(eMsg::call, i), std::chrono::seconds(5),
+			[&, i](std::error_code ec, net::sMessage<eMsg> response)
+			{
+				if (ec || ValueOf(response) != i)
+					nMismatched++;
+				nAnswered++;
+			});
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return nAnswered == 100; }));
+	CHECK(nMismatched == 0);
+}
+
+// A request nobody answers completes with timed_out once its timeout has run out, and not long before.
+TEST(RequestTimesOut)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return client.IsConnected(); }));
+
+	// Data messages are kept by the server, never answered.
+	auto tStart = std::chrono::steady_clock::now();
+	auto response = client.Connection().Request(MakeMessage(eMsg::data, 1), std::chrono::milliseconds(100), asio::use_future);
+	CHECK(PumpUntil([&]() { server.Update(); },
+		[&]() { return response.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }));
+	CHECK(std::chrono::steady_clock::now() - tStart >= std::chrono::milliseconds(100));
+	CHECK(server.m_vecReceived.size() == 1);
+
+	std::error_code ec;
+	try
+	{
+		response.get();
+	}
+	catch (const std::system_error& e)
+	{
+		ec = e.code();
+	}
+	CHECK(ec == asio::error::timed_out);
+}
+
+// A message on a higher lane sent after a big one split into fragments gets in between them, and both arrive whole.
+TEST(HigherLaneOvertakesFragments)
+{
+	// The server does not read until both messages are queued, and the small socket buffers hold only
+	// the first fragments of the big one, so the rest still waits on its lane.
+	std::promise<void> reading;
+	auto fnReading = reading.get_future().share();
+	net::sSocketOptions options;
+	options.nSendBuffer = 16 * 1024;
+	options.nReceiveBuffer = 16 * 1024;
+
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetSocketOptions(options);
+	server.m_fnOnConnect = [fnReading](std::shared_ptr<net::connection<eMsg>>) { fnReading.wait(); };
+	CHECK(server.Start());
+
+	test_client client;
+	client.SetSocketOptions(options);
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return client.IsConnected(); }));
+
+	net::sMessage<eMsg> bulk;
+	bulk.header.id = eMsg::echo;
+	bulk.body.resize(512 * 1024, 0xAB);
+	bulk << uint32_t(1);
+	client.Connection().Send(bulk, net::ePriority::bulk);
+	client.Connection().Send(MakeMessage(eMsg::echo, 2), net::ePriority::high);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	reading.set_value();
+
+	// Echoed in the order the server got them.
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return client.Incoming().count() == 2; }));
+	CHECK(ValueOf(client.Incoming().pop_front().message) == 2);
+	auto answer = client.Incoming().pop_front().message;
+	CHECK(answer.body.size() == bulk.body.size());
+	CHECK(ValueOf(answer) == 1);
+	CHECK(std::all_of(answer.body.begin(), answer.body.end() - sizeof(uint32_t), [](uint8_t n) { return n == 0xAB; }));
+}
+
+// With compression on both ways, bodies over the threshold are compressed and come back as they were,
+// smaller ones go out as they are.
+TEST(CompressionRoundTrip)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.m_fnOnConnect = [](std::shared_ptr<net::connection<eMsg>> client) { client->EnableCompression(net::eCompression::lz, 128); };
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	client.Connection().EnableCompression(net::eCompression::lz, 128);
+
+	// The offers were answered ahead of the answer, so both ends compress from here on.
+	client.Connection().Send(MakeMessage(eMsg::echo, 0));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty(); }));
+	client.Incoming().pop_front();
+
+	net::sMessage<eMsg> big;
+	big.header.id = eMsg::echo;
+	for (uint32_t i = 0; i < 1024; i++)
+		big << (i % 16);
+	client.Connection().Send(MakeMessage(eMsg::echo, 1));
+	client.Connection().Send(big);
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return client.Incoming().count() == 2; }));
+	CHECK(ValueOf(client.Incoming().pop_front().message) == 1);
+	CHECK(client.Incoming().pop_front().message.body == big.body);
+
+	// Only the big body went through the codec, each way, and came out much smaller.
+	for (auto [nFrom, nTo] : { client.Connection().CompressedBytes(), server.LastClient()->CompressedBytes() })
+	{
+		CHECK(nFrom == big.body.size());
+		CHECK(nTo < nFrom / 4);
+	}
+}
+
+// After the connection dropped, connecting again resumes the session, and what the server did not get is sent again.
+TEST(SessionResume)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.EnableSessions(1 << 20, std::chrono::seconds(10));
+	CHECK(server.Start());
+
+	std::vector<bool> vecResumed;
+	std::mutex muxResumed;
+	test_client client;
+	client.EnableSession(1 << 20,
+		[&](bool bResumed)
+		{
+			std::scoped_lock lock(muxResumed);
+			vecResumed.push_back(bResumed);
+		});
+	auto nReported = [&]()
+	{
+		std::scoped_lock lock(muxResumed);
+		return vecResumed.size();
+	};
+
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return nReported() == 1; }));
+	for (uint32_t i = 0; i < 100; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i));
+	client.Connection().Disconnect();
+	CHECK(WaitFor([&]() { return !client.IsConnected(); }));
+
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return nReported() == 2; }));
+	for (uint32_t i = 100; i < 200; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i));
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return server.m_vecReceived.size() >= 200; }));
+	CHECK(server.m_vecReceived.size() == 200);
+	for (uint32_t i = 0; i < 200; i++)
+		CHECK(server.m_vecReceived[i] == i);
+
+	std::scoped_lock lock(muxResumed);
+	CHECK(!vecResumed[0]);
+	CHECK(vecResumed[1]);
+}
+
+// Messages sent on a stream reach the server with the stream as their remote, and the answers come back on it.
+TEST(StreamRoundTrip)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.AcceptStreams(true);
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return client.IsConnected(); }));
+
+	auto pStream = client.OpenStream();
+	CHECK(pStream);
+	pStream->Send(MakeMessage(eMsg::data, 7));
+	pStream->Send(MakeMessage(eMsg::echo, 8));
+	client.Connection().Send(MakeMessage(eMsg::data, 9));
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return server.m_vecReceived.size() == 2 && !client.Incoming().empty(); }));
+	// The stream and the connection take turns, so either can come first.
+	size_t nOnStream = server.m_vecReceived[0] == 7 ? 0 : 1;
+	CHECK(server.m_vecReceived[nOnStream] == 7);
+	CHECK(server.m_vecReceived[1 - nOnStream] == 9);
+	CHECK(server.m_vecSenders[0] != server.m_vecSenders[1]);
+
+	auto answer = client.Incoming().pop_front();
+	CHECK(answer.remote == pStream);
+	CHECK(ValueOf(answer.message) == 8);
+}
+
+// A stream the server does not keep up with stops at its window, while another stream on the same connection
+// goes on. Both are handled in full once the server catches up.
+TEST(StreamFlowControl)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.AcceptStreams(true);
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return client.IsConnected(); }));
+
+	auto MakeBig = [](uint32_t nValue)
+	{
+		net::sMessage<eMsg> message;
+		message.header.id = eMsg::data;
+		message.body.resize(32 * 1024);
+		message << nValue;
+		return message;
+	};
+
+	// A little over 32KB each, so 7 fit in the 256KB window and the 8th only in part.
+	auto pBusy = client.OpenStream();
+	auto pQuiet = client.OpenStream();
+	for (uint32_t i = 0; i < 64; i++)
+		pBusy->Send(MakeBig(i));
+	CHECK(WaitFor([&]() { return server.Queued() == 7; }));
+
+	for (uint32_t i = 0; i < 10; i++)
+		pQuiet->Send(MakeMessage(eMsg::data, 1000 + i));
+	CHECK(WaitFor([&]() { return server.Queued() == 17; }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	CHECK(server.Queued() == 17);
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return server.m_vecReceived.size() == 74; }));
+	std::vector<uint32_t> vecBusy, vecQuiet;
+	for (uint32_t nValue : server.m_vecReceived)
+		(nValue < 1000 ? vecBusy : vecQuiet).push_back(nValue);
+	CHECK(vecBusy.size() == 64 && vecQuiet.size() == 10);
+	for (uint32_t i = 0; i < 64; i++)
+		CHECK(vecBusy[i] == i);
+	for (uint32_t i = 0; i < 10; i++)
+		CHECK(vecQuiet[i] == 1000 + i);
+}
+
+// With a window of one message the client sends the next one once the server handled the last, however few
+// messages there are to carry the window update back.
+TEST(WindowOfOneMessage)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetClientWindow(1 << 20, 1);
+	CHECK(server.Start());
+
+	// The answer comes after the window, so the client keeps to it from then on.
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	client.Connection().Send(MakeMessage(eMsg::echo, 0));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty(); }));
+
+	for (uint32_t i = 0; i < 50; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i));
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return server.m_vecReceived.size() == 50; }));
+	for (uint32_t i = 0; i < 50; i++)
+		CHECK(server.m_vecReceived[i] == i);
+}
+
+// The server sends a client no more than its window ahead of what it took off its incoming queue, and sends
+// the rest as it takes them.
+TEST(ClientReceiveWindow)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start());
+
+	// The answer comes after the window, so the server keeps to it from then on.
+	test_client client;
+	client.SetReceiveWindow(1 << 20, 5);
+	CHECK(client.Connect("127.0.0.1", nPort));
+	client.Connection().Send(MakeMessage(eMsg::echo, 0));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty(); }));
+	client.Incoming().pop_front();
+
+	for (uint32_t i = 0; i < 20; i++)
+		client.Connection().Send(MakeMessage(eMsg::echo, i));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return client.Incoming().count() == 5; }));
+	PumpUntil([&]() { server.Update(); }, []() { return false; }, std::chrono::milliseconds(200));
+	CHECK(client.Incoming().count() == 5);
+
+	for (uint32_t i = 0; i < 20; i++)
+	{
+		CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty(); }));
+		CHECK(client.Incoming().count() <= 5);
+		CHECK(ValueOf(client.Incoming().pop_front().message) == i);
+	}
+}
+
+// Reading pauses while the incoming queue is over the high mark, and every message still arrives once it drains.
+TEST(IncomingWatermarks)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetIncomingWatermarks(4096, 1024);
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	for (uint32_t i = 0; i < 2000; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i));
+
+	CHECK(PumpUntil([&]() { server.Update(10); }, [&]() { return server.m_vecReceived.size() == 2000; }));
+	CHECK(server.IncomingBytes() == 0);
+}
+
+// Both presets connect and carry messages, whichever side uses which.
+TEST(SocketOptionPresets)
+{
+	for (bool bLatencyClient : { true, false })
+	{
+		uint16_t nPort = NextPort();
+		test_server server(nPort);
+		server.SetSocketOptions(bLatencyClient ? net::sSocketOptions::Throughput() : net::sSocketOptions::Latency());
+		CHECK(server.Start());
+
+		test_client client;
+		client.SetSocketOptions(bLatencyClient ? net::sSocketOptions::Latency() : net::sSocketOptions::Throughput());
+		CHECK(client.Connect("127.0.0.1", nPort));
+		CHECK(WaitFor([&]() { return client.IsConnected(); }));
+
+		for (uint32_t i = 0; i < 100; i++)
+			client.Connection().Send(MakeMessage(eMsg::echo, i));
+		CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return client.Incoming().count() == 100; }));
+		for (uint32_t i = 0; i < 100; i++)
+			CHECK(ValueOf(client.Incoming().pop_front().message) == i);
+	}
+}
+
+// Headers over a limit close the connection as soon as they are read, without waiting for a body that never comes.
+// A frame within the limits is answered as usual.
+TEST(BadHeadersClose)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetInlineDispatch(true);
+	server.m_fnOnConnect = [](std::shared_ptr<net::connection<eMsg>> client)
+	{
+		client->SetIdRange(eMsg::echo, eMsg::data);
+		client->SetMaxBodySize(eMsg::data, 16);
+		client->SetInFlightBudget(1024);
+	};
+	CHECK(server.Start());
+
+	auto [bClosed, vecEcho] = SendRaw(nPort, RawFrame(eMsg::echo, 100, 100));
+	CHECK(!bClosed);
+	CHECK(vecEcho.size() == sizeof(net::sMessageHeader<eMsg>) + 100);
+
+	// Over the limit for its id, out of the range of ids and over the budget for bytes in flight.
+	CHECK(SendRaw(nPort, RawFrame(eMsg::data, 17, 0)).first);
+	CHECK(SendRaw(nPort, RawFrame(eMsg::subscribe, 4, 0)).first);
+	CHECK(SendRaw(nPort, RawFrame(eMsg::echo, 2000, 0)).first);
+}
@@ -0,0 +1,102 @@
+#include "Tests.h"
+
+using namespace tests;
+
+namespace tests
+{
+	// Arguments: node ID, client port, cluster port, the peer's node ID and cluster port. Links to the peer and serves
+	// until the link is gone again, or for half a minute if it never comes up.
+	int RunNode(const std::vector<std::string>& vecArgs)
+	{
+		if (vecArgs.size() != 5)
+			return 2;
+
+		uint32_t nNode = static_cast<uint32_t>(std::stoul(vecArgs[0]));
+		uint16_t nPort = static_cast<uint16_t>(std::stoul(vecArgs[1]));
+		uint16_t nClusterPort = static_cast<uint16_t>(std::stoul(vecArgs[2]));
+		uint32_t nPeer = static_cast<uint32_t>(std::stoul(vecArgs[3]));
+		uint16_t nPeerPort = static_cast<uint16_t>(std::stoul(vecArgs[4]));
+
+		test_server node(nPort);
+		if (!node.StartCluster(nNode, nClusterPort) || !node.Start())
+			return 1;
+		node.ConnectToNode("127.0.0.1", nPeerPort);
+
+		bool bLinked = false;
+		auto tDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+		while (std::chrono::steady_clock::now() < tDeadline)
+		{
+			node.Update();
+			if (node.IsLinked(nPeer))
+				bLinked = true;
+			else if (bLinked)
+				break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return 0;
+	}
+}
+
+// Another process of the tests running a node, waited for when it goes out of scope.
+class node_process
+{
+public:
+	node_process(const std::string& sArgs)
+	{
+		std::string sCommand = "\"" + ExecutablePath() + "\" --node " + sArgs;
+		m_thread = std::thread([sCommand]() { std::system(sCommand.c_str()); });
+	}
+
+	~node_process()
+	{
+		m_thread.join();
+	}
+
+private:
+	std::thread m_thread;
+};
+
+// Two nodes in separate processes that both link to each other have two links, but a client still gets
+// every message sent to all clients or to its topic once.
+TEST(ClusterLinkedBothWays)
+{
+	uint16_t nPortA = NextPort(), nClusterA = NextPort();
+	uint16_t nPortB = NextPort(), nClusterB = NextPort();
+
+	// Declared first, so node A is gone and node B sees its link break before the process is waited for.
+	node_process processB("2 " + std::to_string(nPortB) + " " + std::to_string(nClusterB) + " 1 " + std::to_string(nClusterA));
+
+	test_server nodeA(nPortA);
+	CHECK(nodeA.StartCluster(1, nClusterA));
+	CHECK(nodeA.Start());
+
+	// Node B links to A once it is listening itself, then A links back.
+	CHECK(WaitFor([&]() { return nodeA.LinksTo(2) == 1; }, std::chrono::seconds(10)));
+	CHECK(nodeA.ConnectToNode("127.0.0.1", nClusterB));
+	CHECK(WaitFor([&]() { return nodeA.LinksTo(2) == 2; }));
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPortB));
+	client.Connection().Send(MakeMessage(eMsg::subscribe, 5));
+	CHECK(WaitFor([&]() { return !client.Incoming().empty(); }));
+	client.Incoming().pop_front();
+
+	// Node A learns about the subscriber on B over the links.
+	CHECK(PumpUntil([&]() { nodeA.Publish(5, MakeMessage(eMsg::echo, 0)); }, [&]() { return !client.Incoming().empty(); }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	client.Incoming().clear();
+
+	nodeA.MessageAllClients(MakeMessage(eMsg::data, 1));
+	nodeA.Publish(5, MakeMessage(eMsg::data, 2));
+	std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+	int nAll = 0, nTopic = 0;
+	while (!client.Incoming().empty())
+	{
+		uint32_t nValue = ValueOf(client.Incoming().pop_front().message);
+		nAll += nValue == 1;
+		nTopic += nValue == 2;
+	}
+	CHECK(nAll == 1);
+	CHECK(nTopic == 1);
+}
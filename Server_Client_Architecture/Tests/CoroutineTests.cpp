@@ -0,0 +1,82 @@
+#include "Tests.h"
+
+// The coroutine API is only there when the compiler has co_await, which the Tests project turns on.
+#if defined(ASIO_HAS_CO_AWAIT)
+
+using namespace tests;
+
+namespace
+{
+	// Answers every message with its value plus one, until the client goes away.
+	asio::awaitable<void> EchoSession(std::shared_ptr<net::connection<eMsg>> client)
+	{
+		try
+		{
+			while (true)
+			{
+				auto message = co_await client->AsyncReceive();
+				co_await client->AsyncSend(MakeMessage(message.header.id, ValueOf(message) + 1));
+			}
+		}
+		catch (const std::system_error&)
+		{
+		}
+	}
+
+	asio::awaitable<void> AcceptClients(test_server& server, size_t nClients, std::atomic<size_t>& nAccepted)
+	{
+		for (size_t i = 0; i < nClients; i++)
+		{
+			auto client = co_await server.AsyncAccept();
+			client->Spawn(EchoSession(client));
+			nAccepted++;
+		}
+	}
+
+	// Sends the values one at a time, each after the answer to the last one came back, and keeps the answers.
+	asio::awaitable<void> CallServer(test_client& client, uint32_t nFirst, uint32_t nCount, std::vector<uint32_t>& vecAnswers,
+		std::atomic<bool>& bDone)
+	{
+		for (uint32_t i = nFirst; i < nFirst + nCount; i++)
+		{
+			co_await client.Connection().AsyncSend(MakeMessage(eMsg::echo, i));
+			vecAnswers.push_back(ValueOf(co_await client.Connection().AsyncReceive()));
+		}
+		bDone = true;
+	}
+}
+
+// Clients accepted by a coroutine are served by a session coroutine each, and a client coroutine talks to them
+// with AsyncSend() and AsyncReceive(). Nothing goes through the incoming queues.
+TEST(CoroutineSessions)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start(false));
+
+	std::atomic<size_t> nAccepted = 0;
+	server.Spawn(AcceptClients(server, 2, nAccepted));
+
+	test_client clients[2];
+	std::vector<uint32_t> vecAnswers[2];
+	std::atomic<bool> bDone[2] = { false, false };
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		CHECK(clients[i].Connect("127.0.0.1", nPort));
+		clients[i].Connection().UseReceive();
+		clients[i].Spawn(CallServer(clients[i], i * 100, 20, vecAnswers[i], bDone[i]));
+	}
+
+	CHECK(WaitFor([&]() { return bDone[0] && bDone[1]; }));
+	CHECK(nAccepted == 2);
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		CHECK(vecAnswers[i].size() == 20);
+		for (uint32_t j = 0; j < 20; j++)
+			CHECK(vecAnswers[i][j] == i * 100 + j + 1);
+		CHECK(clients[i].Incoming().empty());
+	}
+	CHECK(server.IncomingBytes() == 0);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#include "Tests.h"
+
+using namespace tests;
+
+namespace
+{
+	// Collects the lines written while it lives, instead of them going to the console.
+	class log_capture
+	{
+	public:
+		log_capture()
+		{
+			net::log::logger::Instance().SetSink(
+				[this](const net::log::sLine& line)
+				{
+					std::scoped_lock lock(m_muxLines);
+					m_vecLines.emplace_back(line.level, std::string(line.text, line.nLength));
+				});
+		}
+
+		~log_capture()
+		{
+			net::log::Flush();
+			net::log::logger::Instance().SetSink(nullptr);
+		}
+
+		// The lines written so far that start with the prefix, so lines of other tests still closing do not count.
+		std::vector<std::pair<net::log::eLevel, std::string>> Lines(const std::string& sPrefix)
+		{
+			net::log::Flush();
+			std::scoped_lock lock(m_muxLines);
+			std::vector<std::pair<net::log::eLevel, std::string>> vecLines;
+			for (const auto& line : m_vecLines)
+			{
+				if (line.second.compare(0, sPrefix.size(), sPrefix) == 0)
+					vecLines.push_back(line);
+			}
+			return vecLines;
+		}
+
+	private:
+		std::mutex m_muxLines;
+		std::vector<std::pair<net::log::eLevel, std::string>> m_vecLines;
+	};
+}
+
+// Lines are formatted as given and reach the sink with their level, those below the threshold are not even formatted,
+// and lines too long are cut off.
+TEST(LogLines)
+{
+	log_capture capture;
+	net::log::Info("LogLines ", 42, ' ', true, ' ', 1.5, ' ', std::string("text"));
+	net::log::Debug("LogLines debug");
+	net::log::Warning("LogLines warning");
+	net::log::Error("LogLines ", std::string(1000, 'x'));
+
+	auto vecLines = capture.Lines("LogLines");
+	CHECK(vecLines.size() == 3);
+	CHECK(vecLines[0].first == net::log::eLevel::info);
+	CHECK(vecLines[0].second == "LogLines 42 true 1.5 text");
+	CHECK(vecLines[1].first == net::log::eLevel::warning);
+	CHECK(vecLines[2].first == net::log::eLevel::error);
+	CHECK(vecLines[2].second.size() == net::log::sLine::nMaxText);
+	static_assert(net::log::threshold > net::log::eLevel::debug, "The test expects debug lines to be compiled out");
+}
+
+// A storm of lines at one place lets through only as many a second as the limit says, and the next line let through
+// tells how many were held back.
+TEST(LogRateLimit)
+{
+	log_capture capture;
+	net::log::rate_limit limit(3);
+
+	// Starts early in a second, so the storm does not run into the next one.
+	auto tNow = std::chrono::steady_clock::now().time_since_epoch();
+	std::this_thread::sleep_for(std::chrono::seconds(1) - (tNow - std::chrono::duration_cast<std::chrono::seconds>(tNow)));
+	for (uint32_t i = 0; i < 10; i++)
+		net::log::WriteLimited<net::log::eLevel::error>(limit, "LogRateLimit ", i);
+	CHECK(capture.Lines("LogRateLimit").size() == 3);
+
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+	net::log::WriteLimited<net::log::eLevel::error>(limit, "LogRateLimit ", 10);
+	auto vecLines = capture.Lines("LogRateLimit");
+	CHECK(vecLines.size() == 4);
+	CHECK(vecLines[3].second == "LogRateLimit 10 (7 more suppressed)");
+}
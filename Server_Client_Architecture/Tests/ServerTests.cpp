@@ -0,0 +1,567 @@
+#include "Tests.h"
+
+using namespace tests;
+
+// Publishing reaches the subscribers of the topic only, once each however often they subscribed, until they unsubscribe.
+TEST(PublishToSubscribers)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start());
+
+	auto fnSubscribe = [&server](test_client& client, uint32_t nTopic)
+	{
+		client.Connection().Send(MakeMessage(eMsg::subscribe, nTopic));
+		CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty(); }));
+		client.Incoming().pop_front();
+	};
+
+	test_client clientA;
+	CHECK(clientA.Connect("127.0.0.1", nPort));
+	fnSubscribe(clientA, 5);
+	fnSubscribe(clientA, 5);
+	auto pA = server.LastClient();
+
+	test_client clientB;
+	CHECK(clientB.Connect("127.0.0.1", nPort));
+	fnSubscribe(clientB, 6);
+
+	server.Publish(5, MakeMessage(eMsg::data, 1));
+	server.Publish(6, MakeMessage(eMsg::data, 2));
+	CHECK(WaitFor([&]() { return !clientA.Incoming().empty() && !clientB.Incoming().empty(); }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	CHECK(clientA.Incoming().count() == 1);
+	CHECK(clientB.Incoming().count() == 1);
+	CHECK(ValueOf(clientA.Incoming().pop_front().message) == 1);
+	CHECK(ValueOf(clientB.Incoming().pop_front().message) == 2);
+
+	server.Unsubscribe(pA, 5);
+	server.Publish(5, MakeMessage(eMsg::data, 3));
+	server.Publish(6, MakeMessage(eMsg::data, 4));
+	CHECK(WaitFor([&]() { return !clientB.Incoming().empty(); }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	CHECK(clientA.Incoming().empty());
+	CHECK(ValueOf(clientB.Incoming().pop_front().message) == 4);
+}
+
+namespace
+{
+	// Answers echoes on the I/O thread and leaves everything else to Update().
+	class inline_echo_server : public test_server
+	{
+	public:
+		using test_server::test_server;
+
+	protected:
+		bool OnMessageInline(std::shared_ptr<net::connection<eMsg>> client, net::sMessage<eMsg>& message) override
+		{
+			if (message.header.id != eMsg::echo)
+				return false;
+			client->Send(message);
+			return true;
+		}
+	};
+}
+
+// With inline dispatch messages are handled as they are read, without Update(), also for clients that connected before
+// it was turned on. Those the inline handler turns down still wait for Update().
+TEST(InlineDispatch)
+{
+	uint16_t nPort = NextPort();
+	inline_echo_server server(nPort);
+	CHECK(server.Start());
+
+	test_client clientBefore;
+	CHECK(clientBefore.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return server.LastClient() != nullptr; }));
+	server.SetInlineDispatch(true);
+	test_client clientAfter;
+	CHECK(clientAfter.Connect("127.0.0.1", nPort));
+
+	for (uint32_t i = 0; i < 10; i++)
+	{
+		clientBefore.Connection().Send(MakeMessage(eMsg::echo, i));
+		clientAfter.Connection().Send(MakeMessage(eMsg::echo, 100 + i));
+	}
+	clientAfter.Connection().Send(MakeMessage(eMsg::data, 7));
+	CHECK(WaitFor([&]() { return clientBefore.Incoming().count() == 10 && clientAfter.Incoming().count() == 10; }));
+	for (uint32_t i = 0; i < 10; i++)
+	{
+		CHECK(ValueOf(clientBefore.Incoming().pop_front().message) == i);
+		CHECK(ValueOf(clientAfter.Incoming().pop_front().message) == 100 + i);
+	}
+
+	CHECK(server.m_vecReceived.empty());
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return server.m_vecReceived.size() == 1; }));
+	CHECK(server.m_vecReceived[0] == 7);
+}
+
+// With several I/O threads, clients sending at the same time each get all their echoes back in order, whether they
+// are answered by Update() or inline on whichever I/O thread read them.
+TEST(SeveralIoThreads)
+{
+	for (bool bInline : { false, true })
+	{
+		uint16_t nPort = NextPort();
+		test_server server(nPort);
+		server.SetInlineDispatch(bInline);
+		CHECK(server.Start(true, 4));
+
+		constexpr uint32_t nClients = 4;
+		constexpr uint32_t nMessages = 200;
+		std::vector<std::unique_ptr<test_client>> vecClients;
+		for (uint32_t i = 0; i < nClients; i++)
+		{
+			vecClients.push_back(std::make_unique<test_client>());
+			CHECK(vecClients.back()->Connect("127.0.0.1", nPort));
+		}
+
+		std::vector<std::thread> vecSenders;
+		for (uint32_t i = 0; i < nClients; i++)
+			vecSenders.emplace_back([&client = *vecClients[i], i]()
+				{
+					for (uint32_t j = 0; j < nMessages; j++)
+						client.Connection().Send(MakeMessage(eMsg::echo, i * nMessages + j));
+				});
+		for (auto& thread : vecSenders)
+			thread.join();
+
+		CHECK(PumpUntil([&]() { server.Update(); },
+			[&]() { return std::all_of(vecClients.begin(), vecClients.end(), [](auto& pClient) { return pClient->Incoming().count() == nMessages; }); }));
+		for (uint32_t i = 0; i < nClients; i++)
+			for (uint32_t j = 0; j < nMessages; j++)
+				CHECK(ValueOf(vecClients[i]->Incoming().pop_front().message) == i * nMessages + j);
+	}
+}
+
+// A client over its rate limit is read from no faster than the limit lets it, and everything arrives in the end.
+TEST(ClientRateLimit)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetClientRateLimit(100.0, 0.0);
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	for (uint32_t i = 0; i < 300; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i));
+
+	// A second's worth in a burst, then 100 a second.
+	PumpUntil([&]() { server.Update(); }, []() { return false; }, std::chrono::milliseconds(500));
+	CHECK(server.m_vecReceived.size() >= 100);
+	CHECK(server.m_vecReceived.size() < 200);
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return server.m_vecReceived.size() == 300; }));
+	for (uint32_t i = 0; i < 300; i++)
+		CHECK(server.m_vecReceived[i] == i);
+}
+
+// With fair dispatch a client that sent few messages is not held up behind one that flooded the server: with a
+// quantum of one message they take turns a message each.
+TEST(FairDispatch)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetFairDispatch(MakeMessage(eMsg::data, 0).size());
+	CHECK(server.Start());
+
+	test_client clientFlood;
+	CHECK(clientFlood.Connect("127.0.0.1", nPort));
+	for (uint32_t i = 0; i < 1000; i++)
+		clientFlood.Connection().Send(MakeMessage(eMsg::data, i));
+	CHECK(WaitFor([&]() { return server.Queued() == 1000; }));
+
+	test_client clientFew;
+	CHECK(clientFew.Connect("127.0.0.1", nPort));
+	for (uint32_t i = 0; i < 10; i++)
+		clientFew.Connection().Send(MakeMessage(eMsg::data, 1000 + i));
+	CHECK(WaitFor([&]() { return server.Queued() == 1010; }));
+
+	server.Update(20);
+	CHECK(server.m_vecReceived.size() == 20);
+	CHECK(std::count_if(server.m_vecReceived.begin(), server.m_vecReceived.end(), [](uint32_t n) { return n >= 1000; }) == 10);
+
+	// Each client's messages stay in order.
+	server.Update();
+	CHECK(server.m_vecReceived.size() == 1010);
+	std::vector<uint32_t> vecFlood, vecFew;
+	for (uint32_t n : server.m_vecReceived)
+		(n < 1000 ? vecFlood : vecFew).push_back(n);
+	CHECK(std::is_sorted(vecFlood.begin(), vecFlood.end()));
+	CHECK(std::is_sorted(vecFew.begin(), vecFew.end()));
+}
+
+// Stopping gracefully writes everything still queued for a client, more than the socket buffers hold, and then
+// a goodbye frame as the last one before the server closes the connection.
+TEST(StopDrainsQueues)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start());
+
+	// Read on a plain socket, so the frames can be looked at as they came.
+	asio::io_context context;
+	asio::ip::tcp::socket socket(context);
+	socket.connect({ asio::ip::make_address("127.0.0.1"), nPort });
+	CHECK(WaitFor([&]() { return server.LastClient() != nullptr; }));
+
+	std::vector<uint8_t> vecRead;
+	std::thread reader([&]()
+		{
+			std::error_code ec;
+			asio::read(socket, asio::dynamic_buffer(vecRead), ec);
+		});
+
+	constexpr uint32_t nMessages = 500;
+	for (uint32_t i = 0; i < nMessages; i++)
+	{
+		auto message = MakeMessage(eMsg::data, i);
+		message.body.insert(message.body.begin(), 4096, 0);
+		server.MessageAllClients(message);
+	}
+	server.Stop(std::chrono::seconds(5));
+	reader.join();
+
+	std::vector<uint32_t> vecValues;
+	std::vector<net::sMessageHeader<eMsg>> vecHeaders;
+	std::vector<uint8_t> vecLastBody;
+	for (size_t nPosition = 0; nPosition < vecRead.size();)
+	{
+		CHECK(vecRead.size() - nPosition >= sizeof(net::sMessageHeader<eMsg>));
+		net::sMessageHeader<eMsg> header;
+		std::memcpy(&header, vecRead.data() + nPosition, sizeof(header));
+		nPosition += sizeof(header);
+		CHECK(vecRead.size() - nPosition >= header.size);
+		vecLastBody.assign(vecRead.begin() + nPosition, vecRead.begin() + nPosition + header.size);
+		nPosition += header.size;
+		vecHeaders.push_back(header);
+
+		// The value is at the end of the last fragment.
+		if (!(header.flags & (net::frame::control | net::frame::more)))
+		{
+			net::sMessage<eMsg> message;
+			message.body = vecLastBody;
+			vecValues.push_back(ValueOf(message));
+		}
+	}
+
+	CHECK(vecValues.size() == nMessages);
+	for (uint32_t i = 0; i < nMessages; i++)
+		CHECK(vecValues[i] == i);
+	CHECK(!vecHeaders.empty() && (vecHeaders.back().flags & net::frame::control));
+	CHECK(!vecLastBody.empty() && vecLastBody.back() == static_cast<uint8_t>(net::eControl::goodbye));
+}
+
+namespace
+{
+	std::vector<uint8_t> MakeState(size_t nSize, uint8_t nSeed)
+	{
+		std::vector<uint8_t> state(nSize);
+		for (size_t i = 0; i < nSize; i++)
+			state[i] = static_cast<uint8_t>(i % 7 == 0 ? nSeed : i);
+		return state;
+	}
+}
+
+// Each snapshot published comes out as a message with the whole state, also those sent as deltas against an earlier one.
+TEST(SnapshotRoundTrip)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start());
+
+	test_client client;
+	client.AcceptSnapshots(1);
+	CHECK(client.Connect("127.0.0.1", nPort));
+	client.Connection().Send(MakeMessage(eMsg::subscribe, 3));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty(); }));
+	client.Incoming().pop_front();
+
+	for (uint8_t nSeed = 0; nSeed < 10; nSeed++)
+	{
+		auto state = MakeState(4096, nSeed);
+		server.PublishSnapshot(3, eMsg::data, state);
+		CHECK(WaitFor([&]() { return !client.Incoming().empty(); }));
+		auto message = client.Incoming().pop_front().message;
+		CHECK(message.header.id == eMsg::data);
+		CHECK(message.body == state);
+	}
+}
+
+// Snapshots are held to the limits of the connection taking them: a client that did not accept them, one that gets
+// them on more streams than it accepts and one that gets a state over the body size limit all drop the connection.
+TEST(SnapshotLimits)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	std::vector<std::shared_ptr<net::connection<eMsg>>> vecConnected;
+	std::mutex muxConnected;
+	server.m_fnOnConnect = [&](std::shared_ptr<net::connection<eMsg>> client)
+	{
+		std::scoped_lock lock(muxConnected);
+		vecConnected.push_back(client);
+	};
+	CHECK(server.Start());
+
+	// Sends to the client that connected last, once the server has it.
+	size_t nClients = 0;
+	auto fnSend = [&](test_client& client, std::vector<uint32_t> vecStreams, size_t nSize)
+	{
+		nClients++;
+		std::shared_ptr<net::connection<eMsg>> pClient;
+		CHECK(WaitFor([&]()
+			{
+				std::scoped_lock lock(muxConnected);
+				if (vecConnected.size() == nClients)
+					pClient = vecConnected.back();
+				return pClient != nullptr;
+			}));
+		for (uint32_t nStream : vecStreams)
+			server.SendSnapshot(pClient, nStream, eMsg::data, MakeState(nSize, 0));
+	};
+
+	test_client clientAccepting;
+	clientAccepting.AcceptSnapshots(2);
+	CHECK(clientAccepting.Connect("127.0.0.1", nPort));
+	fnSend(clientAccepting, { 1, 2 }, 100);
+	CHECK(WaitFor([&]() { return clientAccepting.Incoming().count() == 2; }));
+	CHECK(clientAccepting.IsConnected());
+
+	test_client clientNotAccepting;
+	CHECK(clientNotAccepting.Connect("127.0.0.1", nPort));
+	fnSend(clientNotAccepting, { 1 }, 100);
+	CHECK(WaitFor([&]() { return !clientNotAccepting.IsConnected(); }));
+
+	test_client clientTooManyStreams;
+	clientTooManyStreams.AcceptSnapshots(2);
+	CHECK(clientTooManyStreams.Connect("127.0.0.1", nPort));
+	fnSend(clientTooManyStreams, { 1, 2, 3 }, 100);
+	CHECK(WaitFor([&]() { return !clientTooManyStreams.IsConnected(); }));
+	CHECK(clientTooManyStreams.Incoming().count() == 2);
+
+	test_client clientTooBig;
+	clientTooBig.AcceptSnapshots(1);
+	CHECK(clientTooBig.Connect("127.0.0.1", nPort));
+	clientTooBig.Connection().SetMaxBodySize(eMsg::data, 64);
+	fnSend(clientTooBig, { 1 }, 100);
+	CHECK(WaitFor([&]() { return !clientTooBig.IsConnected(); }));
+	CHECK(clientTooBig.Incoming().empty());
+}
+
+// While ticks are on, messages to clients wait for the end of the tick and then all go out in order. A tick that
+// took too long counts as an overrun, one that was quick waits for the next tick to start.
+TEST(TickBatching)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	CHECK(server.Start());
+	server.SetTickRate(5.0);
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return server.LastClient() != nullptr; }));
+	auto pClient = server.LastClient();
+
+	for (uint32_t i = 0; i < 10; i++)
+		server.MessageClient(pClient, MakeMessage(eMsg::data, i));
+	server.MessageAllClients(MakeMessage(eMsg::data, 10));
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	CHECK(client.Incoming().empty());
+
+	server.EndTick();
+	CHECK(WaitFor([&]() { return client.Incoming().count() == 11; }));
+	for (uint32_t i = 0; i <= 10; i++)
+		CHECK(ValueOf(client.Incoming().pop_front().message) == i);
+
+	auto tStart = std::chrono::steady_clock::now();
+	server.EndTick();
+	CHECK(std::chrono::steady_clock::now() - tStart >= std::chrono::milliseconds(100));
+
+	auto metrics = server.GetTickMetrics();
+	CHECK(metrics.nTicks == 2);
+	CHECK(metrics.nOverruns == 1);
+	CHECK(metrics.totalOverrun >= std::chrono::milliseconds(100));
+	CHECK(metrics.maxDuration >= std::chrono::milliseconds(300));
+
+	// Turned off, messages go out right away again.
+	server.SetTickRate(0.0);
+	server.MessageClient(pClient, MakeMessage(eMsg::data, 11));
+	CHECK(WaitFor([&]() { return !client.Incoming().empty(); }));
+}
+
+// A capture records what each client sent and got, and replaying it sends a server the same messages again.
+TEST(CaptureReplay)
+{
+	const std::string sPath = "CaptureReplay.capture";
+	uint16_t nPort = NextPort();
+	{
+		test_server server(nPort);
+		CHECK(server.Start());
+		CHECK(server.StartCapture(sPath, 1 << 20));
+
+		test_client clientA, clientB;
+		CHECK(clientA.Connect("127.0.0.1", nPort));
+		CHECK(clientB.Connect("127.0.0.1", nPort));
+		for (uint32_t i = 0; i < 20; i++)
+			(i % 2 == 0 ? clientA : clientB).Connection().Send(MakeMessage(eMsg::data, i));
+		clientA.Connection().Send(MakeMessage(eMsg::echo, 100));
+		CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return server.m_vecReceived.size() == 20 && !clientA.Incoming().empty(); }));
+		CHECK(server.StopCapture() == 0);
+	}
+
+	std::unordered_map<uint32_t, std::vector<uint32_t>> mapIn;
+	std::vector<uint32_t> vecOut;
+	{
+		net::capture_reader<eMsg> reader;
+		CHECK(reader.Open(sPath));
+		net::sCapturedMessage<eMsg> captured;
+		uint64_t nLastTime = 0;
+		while (reader.Next(captured))
+		{
+			CHECK(captured.nTime >= nLastTime);
+			nLastTime = captured.nTime;
+			if (captured.direction == net::eCaptureDirection::in)
+				mapIn[captured.nConnection].push_back(ValueOf(captured.message));
+			else
+				vecOut.push_back(ValueOf(captured.message));
+		}
+	}
+	CHECK(mapIn.size() == 2);
+	for (const auto& [nConnection, vecValues] : mapIn)
+	{
+		CHECK(vecValues.size() >= 10);
+		uint32_t nParity = vecValues[0] % 2;
+		for (size_t i = 0; i < 10; i++)
+			CHECK(vecValues[i] == 2 * i + nParity);
+	}
+	CHECK((vecOut == std::vector<uint32_t>{ 100 }));
+
+	// Replayed as fast as possible, each captured client on a connection of its own.
+	uint16_t nReplayPort = NextPort();
+	test_server replayed(nReplayPort);
+	CHECK(replayed.Start());
+	std::thread replay([&]() { net::ReplayCapture<eMsg>(sPath, "127.0.0.1", nReplayPort, 0.0); });
+	CHECK(PumpUntil([&]() { replayed.Update(); }, [&]() { return replayed.m_vecReceived.size() == 20; }));
+	replay.join();
+
+	std::unordered_set<std::shared_ptr<net::connection<eMsg>>> setSenders(replayed.m_vecSenders.begin(), replayed.m_vecSenders.end());
+	CHECK(setSenders.size() == 2);
+	auto vecReceived = replayed.m_vecReceived;
+	std::sort(vecReceived.begin(), vecReceived.end());
+	for (uint32_t i = 0; i < 20; i++)
+		CHECK(vecReceived[i] == i);
+	std::remove(sPath.c_str());
+}
+
+// Messages that waited in the incoming queue longer than their id may are dropped by Update() instead of handled,
+// fresh ones still are.
+TEST(IncomingExpiry)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetMessageExpiry(eMsg::data, std::chrono::milliseconds(50));
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	for (uint32_t i = 0; i < 10; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i));
+	CHECK(WaitFor([&]() { return server.Queued() == 10; }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	server.Update();
+	CHECK(server.m_vecReceived.empty());
+	CHECK(server.GetExpiryMetrics().nExpiredIn == 10);
+
+	client.Connection().Send(MakeMessage(eMsg::data, 10));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !server.m_vecReceived.empty(); }));
+	CHECK(server.m_vecReceived[0] == 10);
+	CHECK(server.GetExpiryMetrics().nExpiredIn == 10);
+}
+
+// Messages a client holds back for the server's window are dropped once they waited past their deadline,
+// instead of going out late.
+TEST(OutgoingExpiry)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetClientWindow(1 << 20, 1);
+	CHECK(server.Start());
+
+	// The answer comes after the window, so the client keeps to it from then on.
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	client.Connection().Send(MakeMessage(eMsg::echo, 0));
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return !client.Incoming().empty(); }));
+
+	// The first goes out right away, the others wait for the server to handle it, which takes too long.
+	client.Connection().SetExpiry(eMsg::data, std::chrono::milliseconds(50));
+	for (uint32_t i = 0; i < 20; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i));
+	CHECK(WaitFor([&]() { return server.Queued() == 1; }));
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return client.Connection().ExpiredOut() == 19; }));
+	PumpUntil([&]() { server.Update(); }, []() { return false; }, std::chrono::milliseconds(100));
+	CHECK(server.m_vecReceived.size() == 1);
+	CHECK(server.m_vecReceived[0] == 0);
+}
+
+// Once messages waited over the target for a whole interval, the server is overloaded: bulk messages are dropped while
+// the others are still handled, new clients are turned away, and clients hold back their bulk messages for an interval.
+// It is over once the queue runs empty.
+TEST(OverloadProtection)
+{
+	uint16_t nPort = NextPort();
+	test_server server(nPort);
+	server.SetOverloadControl(std::chrono::milliseconds(5), std::chrono::milliseconds(300));
+	std::atomic<size_t> nAccepted = 0;
+	server.m_fnOnConnect = [&](std::shared_ptr<net::connection<eMsg>>) { nAccepted++; };
+	CHECK(server.Start());
+
+	test_client client;
+	CHECK(client.Connect("127.0.0.1", nPort));
+	for (uint32_t i = 0; i < 10; i++)
+		client.Connection().Send(MakeMessage(eMsg::data, i), net::ePriority::bulk);
+	CHECK(WaitFor([&]() { return server.Queued() == 10; }));
+	client.Connection().Send(MakeMessage(eMsg::data, 100), net::ePriority::normal);
+	CHECK(WaitFor([&]() { return server.Queued() == 11; }));
+
+	// Over the target, but not for an interval yet.
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	server.Update(1);
+	CHECK(!server.GetOverloadMetrics().bOverloaded);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(310));
+	server.Update(1);
+	auto metrics = server.GetOverloadMetrics();
+	CHECK(metrics.bOverloaded);
+	CHECK(metrics.delay >= std::chrono::milliseconds(300));
+	CHECK(metrics.nShed == 1);
+	CHECK(metrics.nBackOffs == 1);
+
+	test_client rejected;
+	CHECK(rejected.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return server.GetOverloadMetrics().nRejected == 1 && !rejected.IsConnected(); }));
+
+	// Held back by the client while the back-off lasts.
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	client.Connection().Send(MakeMessage(eMsg::data, 200), net::ePriority::bulk);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	CHECK(server.Queued() == 9);
+
+	server.Update();
+	metrics = server.GetOverloadMetrics();
+	CHECK(!metrics.bOverloaded);
+	CHECK(metrics.nShed == 9);
+	CHECK(server.m_vecReceived == std::vector<uint32_t>({ 0, 100 }));
+
+	CHECK(PumpUntil([&]() { server.Update(); }, [&]() { return server.m_vecReceived.size() == 3; }));
+	CHECK(server.m_vecReceived[2] == 200);
+
+	test_client admitted;
+	CHECK(admitted.Connect("127.0.0.1", nPort));
+	CHECK(WaitFor([&]() { return nAccepted == 2; }));
+	CHECK(server.GetOverloadMetrics().nRejected == 1);
+}
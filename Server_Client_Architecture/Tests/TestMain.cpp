@@ -0,0 +1,34 @@
+#include "Tests.h"
+
+// Runs every test, or only the ones named as arguments. Returns the number of tests that failed.
+// Started with --node, it is a cluster node for a test in another process instead, see tests::RunNode().
+int main(int argc, char* argv[])
+{
+	tests::ExecutablePath() = argv[0];
+	std::vector<std::string> vecNames(argv + 1, argv + argc);
+	if (!vecNames.empty() && vecNames[0] == "--node")
+		return tests::RunNode({ vecNames.begin() + 1, vecNames.end() });
+
+	int nFailed = 0;
+	int nRun = 0;
+	for (const auto& test : tests::Registry())
+	{
+		if (!vecNames.empty() && std::find(vecNames.begin(), vecNames.end(), test.szName) == vecNames.end())
+			continue;
+
+		nRun++;
+		try
+		{
+			test.fnRun();
+			std::cout << "[PASS] " << test.szName << std::endl;
+		}
+		catch (std::exception& e)
+		{
+			nFailed++;
+			std::cout << "[FAIL] " << test.szName << ": " << e.what() << std::endl;
+		}
+	}
+
+	std::cout << nRun - nFailed << " of " << nRun << " tests passed" << std::endl;
+	return nFailed;
+}
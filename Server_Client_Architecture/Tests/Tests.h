@@ -0,0 +1,191 @@
+#pragma once
+#include "include.h"
+#include "connection.h"
+#include "client.h"
+#include "server.h"
+
+// A small test runner. Every TEST() registers itself, TestMain.cpp runs them all or the ones named on the command line.
+// A test fails by throwing, which CHECK() does when its condition does not hold.
+namespace tests
+{
+	struct sTest
+	{
+		const char* szName;
+		void (*fnRun)();
+	};
+
+	inline std::vector<sTest>& Registry()
+	{
+		static std::vector<sTest> vecTests;
+		return vecTests;
+	}
+
+	struct registrar
+	{
+		registrar(const char* szName, void (*fnRun)())
+		{
+			Registry().push_back({ szName, fnRun });
+		}
+	};
+
+	struct failure : std::runtime_error
+	{
+		using std::runtime_error::runtime_error;
+	};
+
+#define TEST(name) \
+	static void name(); \
+	static tests::registrar name##Registrar(#name, name); \
+	static void name()
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) \
+			throw tests::failure(std::string(__FILE__) + ":" + std::to_string(__LINE__) + ": " #condition); \
+	} while (false)
+
+	// Each server in a test run listens on a port of its own, so one still closing does not get in the way.
+	inline uint16_t NextPort()
+	{
+		static uint16_t nPort = 60400;
+		return nPort++;
+	}
+
+	// Calls fnStep until fnDone holds or the timeout runs out. Returns whether it held.
+	template <typename Step, typename Done>
+	bool PumpUntil(Step fnStep, Done fnDone, std::chrono::steady_clock::duration timeout = std::chrono::seconds(5))
+	{
+		auto tDeadline = std::chrono::steady_clock::now() + timeout;
+		while (!fnDone())
+		{
+			if (std::chrono::steady_clock::now() > tDeadline)
+				return false;
+			fnStep();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return true;
+	}
+
+	template <typename Done>
+	bool WaitFor(Done fnDone, std::chrono::steady_clock::duration timeout = std::chrono::seconds(5))
+	{
+		return PumpUntil([]() {}, fnDone, timeout);
+	}
+
+	enum class eMsg : uint16_t
+	{
+		// Sent back to whoever sent it.
+		echo,
+		// Kept by the server, see test_server::m_vecReceived.
+		data,
+		// Subscribes the sender to the topic in the message.
+		subscribe,
+		// A request, answered with the value it carries.
+		call,
+	};
+
+	inline net::sMessage<eMsg> MakeMessage(eMsg id, uint32_t nValue)
+	{
+		net::sMessage<eMsg> message;
+		message.header.id = id;
+		message << nValue;
+		return message;
+	}
+
+	// Takes the value out of a message made by MakeMessage().
+	inline uint32_t ValueOf(net::sMessage<eMsg> message)
+	{
+		uint32_t nValue = 0;
+		message >> nValue;
+		return nValue;
+	}
+
+	class test_server : public net::server_interface<eMsg>
+	{
+	public:
+		using net::server_interface<eMsg>::server_interface;
+
+		// Values of the data messages handled, in order, and who sent them.
+		std::vector<uint32_t> m_vecReceived;
+		std::vector<std::shared_ptr<net::connection<eMsg>>> m_vecSenders;
+		// Called for every client as it connects, on the I/O thread, to set it up for a test. Set before Start().
+		std::function<void(std::shared_ptr<net::connection<eMsg>>)> m_fnOnConnect;
+
+		// The client that connected last, nullptr before the first one.
+		std::shared_ptr<net::connection<eMsg>> LastClient()
+		{
+			std::scoped_lock lock(m_muxConnections);
+			return m_deqConnections.empty() ? nullptr : m_deqConnections.back();
+		}
+
+		// Messages waiting in the incoming queue for Update().
+		size_t Queued()
+		{
+			return m_qMessagesIn.count();
+		}
+
+		// Links to the node whose hello came in, spares included.
+		size_t LinksTo(uint32_t nNode)
+		{
+			std::scoped_lock lock(m_muxCluster);
+			return std::count_if(m_vecLinks.begin(), m_vecLinks.end(),
+				[nNode](const auto& pLink) { return pLink->nNode == nNode && pLink->pConnection->IsConnected(); });
+		}
+
+	protected:
+		bool OnClientConnect(std::shared_ptr<net::connection<eMsg>> client) override
+		{
+			if (m_fnOnConnect)
+				m_fnOnConnect(client);
+			return true;
+		}
+
+		void OnMessage(std::shared_ptr<net::connection<eMsg>> client, net::sMessage<eMsg>& message) override
+		{
+			switch (message.header.id)
+			{
+			case eMsg::echo:
+				client->Send(message);
+				break;
+			case eMsg::data:
+			{
+				uint32_t nValue = 0;
+				message >> nValue;
+				m_vecReceived.push_back(nValue);
+				m_vecSenders.push_back(client);
+				break;
+			}
+			case eMsg::subscribe:
+			{
+				uint32_t nTopic = 0;
+				message >> nTopic;
+				Subscribe(client, nTopic);
+				client->Send(MakeMessage(eMsg::subscribe, nTopic));
+				break;
+			}
+			case eMsg::call:
+				client->Reply(message, MakeMessage(eMsg::call, ValueOf(message)));
+				break;
+			}
+		}
+	};
+
+	class test_client : public net::client_interface<eMsg>
+	{
+	public:
+		net::connection<eMsg>& Connection()
+		{
+			return *m_connection;
+		}
+	};
+
+	// Path of the test executable, for tests that start more processes of it.
+	inline std::string& ExecutablePath()
+	{
+		static std::string sPath;
+		return sPath;
+	}
+
+	// Runs a cluster node in a process of its own, see ClusterTests.cpp. Returns the exit code.
+	int RunNode(const std::vector<std::string>& vecArgs);
+}